@@ -9,91 +9,2041 @@
  * UDP transfers.
  *************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
 #include <netdb.h>
 #include <sys/types.h> 
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
 #include <arpa/inet.h>
 
-/* Size of packet payload (for all packets, for simplicity) */
-#define DATA_SIZE 1024
-#define FRAME_SIZE 1022
-#define MSG_SIZE  DATA_SIZE + 8
+/* Size of packet payload, the most any control packet carries and the data frames of a path that
+ * can't carry more */
+#define DATA_SIZE 1024
+
+/* Header on the wire (operation and function share a byte, then transfer ID and timestamps), and
+ * the largest control datagram, each datagram only carries the data bytes it uses */
+#define MSG_HDR   13
+#define MSG_SIZE  (DATA_SIZE + MSG_HDR)
+#define OPER_NONE 0xff
+
+/* Largest datagram a path gets probed for (a 9000 byte jumbo MTU less IP and UDP headers) and the
+ * payload that leaves */
+#define MTU_MAX   9000
+#define IP_UDP_HDR 28
+#define MSG_MAX   (MTU_MAX - IP_UDP_HDR)
+#define DATA_MAX  (MSG_MAX - MSG_HDR)
+
+/* Data frame header (32 bit frame ID, flags and a CRC32C of the frame) followed by file data, parity
+ * frames have the first frame ID of their group and the group size above the flags */
+#define FRAME_HDR  9
+#define FRAME_CRC  5
+#define FRAME_SIZE (DATA_SIZE - FRAME_HDR)
+#define FRAME_MAX  (DATA_MAX - FRAME_HDR)
+#define FRAME_POLL 0x01
+#define FRAME_FLAGS 1
+
+/* CRC32C (Castagnoli) polynomial, reflected */
+#define CRC_POLY 0x82f63b78
+
+/* Largest file the 32 bit frame IDs can address */
+#define MAX_FILE_LEN ((uint64_t) FRAME_SIZE * UINT32_MAX)
+
+/* Frames sent per burst and frames covered by a selective ack bitmap */
+#define BURST_SIZE 5000
+#define SACK_HDR   8
+#define SACK_BITS  ((DATA_SIZE - SACK_HDR) * 8)
+
+/* Congestion control, window limits in frames */
+#define CC_INIT_CWND  10
+#define CC_MIN_CWND   2
+#define CC_MAX_CWND   SACK_BITS
+#define CUBIC_C       0.4
+#define CUBIC_BETA    0.7
+#define BBR_BW_ROUNDS 10
+#define BBR_RTT_WIN   10.0
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2.0
+#define BBR_CYCLE_LEN 8
+
+/* Default and largest receive window in frames, bounds reassembly memory */
+#define RX_WINDOW     16384
+#define RX_WINDOW_MAX 262144
+
+/* Parity groups, most and fewest frames per group and how hard the parity rate chases loss */
+#define FEC_MIN_GROUP 2
+#define FEC_MAX_GROUP 100
+#define FEC_LOSS_GAIN 2.0
+#define FEC_LOSS_EWMA 0.125
+
+/* Compression, the file is cut into blocks coded on their own, each behind a length header
+ * (high bit set if the block is stored as is), and the resulting stream is sent as frames */
+#define COMP_BLOCK   65536
+#define COMP_HDR     4
+#define COMP_STORED  0x80000000
+#define COMP_SAMPLES 8
+#define COMP_KEEP    0.9
+#define COMP_MAX_LEN ((uint64_t) 256 << 20)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+/* Delta PUT: GET flag asking for block signatures instead of the file, and copy records in a delta
+ * stream (a run of whole blocks of the server's copy, then the index of the first). Signatures are
+ * the block size, file size and mtime, then a weak rolling checksum and strong hash per whole block */
+#define GET_SIGS        0x80
+#define DELTA_COPY      0x40000000
+#define DELTA_REF       4
+#define DELTA_MIN_BLOCK 2048
+#define SIG_HDR         20
+#define SIG_ENTRY       12
+#define HASH_MUL        0xc6a4a7935bd1e995ULL
+
+/* Parallel transfers: GET flag for one stream's byte range (offset, length) of the file, a range of
+ * length 0 only asks for the file size */
+#define GET_RANGE  0x40
+#define RANGE_SIZE 16
+
+/* Recursive GET: flag for the list of files under a directory in place of a file */
+#define GET_TREE   0x20
+
+/* Resume state sent at INIT: file size, mtime, length sent, codec, frames already held and their size */
+#define RESUME_SIZE 33
+
+/* Checkpoint sidecar kept beside a partial file: resume state, bytes written, their checksum and
+ * the partial compressed block, saved every CKPT_BYTES of progress */
+#define CKPT_HDR    (RESUME_SIZE + 16)
+#define CKPT_NAME   (DATA_SIZE + 16)
+#define CKPT_BYTES  (8 << 20)
+
+/* Paged LS: page header (request number, more to come, entries in page), then per entry size,
+ * mtime and a directory flag ahead of the name */
+#define LS_HDR      9
+#define LS_ENTRY    17
+
+/* Datagrams moved per sendmmsg/recvmmsg call by default and at most */
+#define BATCH_SIZE 32
+#define BATCH_MAX  256
+
+/* UDP offload, frames per segmented send, most bytes one can carry and size of a coalesced receive */
+#define GSO_FRAMES   63
+#define GSO_BYTES    (65535 - IP_UDP_HDR)
+#define GRO_BUF_SIZE 65536
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT  103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO      104
+#endif
+
+/* Socket buffer size asked for, the kernel caps it at rmem_max/wmem_max */
+#define SOCK_BUF_SIZE (4 << 20)
+
+/* Most streams for -s, and the unit the ranges of a parallel transfer are cut in (page aligned,
+ * files under two of them go as one stream) */
+#define MAX_STREAMS 64
+#define RANGE_ALIGN (1 << 20)
+
+/* Files a batch command keeps in flight by default (-m), and transfer IDs set aside per file of a
+ * batch (a delta PUT takes three) */
+#define BATCH_FILES 8
+#define BATCH_XIDS  4
+
+/* Longest command line, a batch command can name many files */
+#define CMD_SIZE 8192
+
+/* Retransmission timeout before the first RTT sample, least margin over the RTT and cap, in seconds */
+#define RTO_INIT 0.2
+#define RTO_MIN  0.005
+#define RTO_MAX  2.0
+
+/* Give up on a peer after this long without hearing from it */
+#define PEER_TIMEOUT 10.0
+
+/* Path MTU probing, common MTUs stepped down through below the route's and tries at each */
+#define MTU_STEPS   4
+#define PROBE_TRIES 3
+
+/* Codes for operations and packet functions for each operation */
+enum oper_e {OPER_GET  = 0, OPER_PUT, OPER_DEL, OPER_LS, OPER_EXIT, OPER_PROBE, OPER_STATS};
+enum get_e  {GET_INIT  = 0, GET_DATA, GET_DONE, GET_SACK, GET_PARITY};
+enum put_e  {PUT_INIT  = 0, PUT_DATA, PUT_DONE, PUT_SACK, PUT_PARITY};
+enum del_e  {DEL_INIT  = 0, DEL_DONE};
+enum ls_e   {LS_INIT   = 0, LS_DATA,  LS_DONE};
+enum exit_e {EXIT_INIT = 0};
+enum probe_e {PROBE_INIT = 0};
+enum stats_e {STATS_INIT = 0};
+enum comp_e {COMP_NONE = 0, COMP_LZ, COMP_DELTA};
+
+/* Word of a frame bitmap and words needed for n frames */
+typedef uint64_t bits_t;
+#define BITS_WORDS(n) (((uint64_t) (n) + 63) / 64)
+
+/* Decoder for a compressed stream, the block being gathered and what it decodes to, and for a
+ * delta the copy it refers to */
+typedef struct zdec_s {
+    size_t   have;
+    uint8_t  buf[COMP_HDR + COMP_BLOCK];
+    uint8_t  out[COMP_BLOCK];
+    uint8_t  *basis;
+    uint64_t basis_len;
+    uint32_t block;
+} zdec_t;
+
+/* Byte range of a file one stream of a parallel transfer moves, and the size and mtime of the copy
+ * every stream has to see */
+typedef struct range_s {
+    uint64_t off;
+    uint64_t len;
+    uint64_t total;
+    uint64_t mtime;
+} range_t;
+
+/* One stream of a parallel transfer, run on its own thread and socket */
+typedef struct stream_s {
+    pthread_t          tid;
+    int                oper;
+    char               *file;
+    range_t            r;
+    uint32_t           xid;
+    struct sockaddr_in addr;
+    int                ret;
+} stream_t;
+
+/* List of file names for a batch command */
+typedef struct flist_s {
+    char **name;
+    int  count;
+    int  cap;
+} flist_t;
+
+/* Batch of files moved by a pool of streams, each takes the next file once done with one */
+typedef struct batch_s {
+    pthread_mutex_t    lock;
+    flist_t            *list;
+    int                next;
+    int                oper;
+    int                failed;
+    uint32_t           xid;
+    struct sockaddr_in addr;
+} batch_t;
+
+/* Receiver progress on a file, what it is a copy of and how far it got */
+typedef struct ckpt_s {
+    uint64_t raw_len;
+    uint64_t mtime;
+    uint64_t wire_len;
+    uint32_t codec;
+    uint32_t frames;
+    uint32_t frame;
+    uint64_t out_len;
+    uint32_t crc;
+    uint32_t have;
+} ckpt_t;
+
+/* Message structure */
+typedef struct msg_s {
+    uint32_t oper;
+    uint32_t func;
+    uint32_t xid;
+    uint32_t ts;
+    uint32_t ts_echo;
+    uint8_t data[DATA_MAX + 1];
+} msg_t;
+
+/* Round trip estimate for a peer, and the peer's last timestamp to echo back */
+typedef struct rtt_s {
+    double   srtt;
+    double   rttvar;
+    double   rto;
+    uint32_t peer_ts;
+    uint32_t peer_at;
+} rtt_t;
+
+/* Congestion control algorithms and BBR states */
+enum cc_e   {CC_FIXED  = 0, CC_AIMD, CC_CUBIC, CC_BBR, CC_COUNT};
+enum bbr_e  {BBR_STARTUP = 0, BBR_DRAIN, BBR_PROBE_BW};
+
+/* Congestion control state for one transfer */
+typedef struct cc_s {
+    int    algo;
+    double cwnd;
+    double ssthresh;
+    double w_max;
+    double w_est;
+    double k;
+    double epoch;
+    double bw[BBR_BW_ROUNDS];
+    double max_bw;
+    double full_bw;
+    double min_rtt;
+    double min_rtt_stamp;
+    int    round;
+    int    full_cnt;
+    int    mode;
+    int    cycle;
+} cc_t;
+
+/* Names for the -c option and BBR pacing gain cycle */
+char *cc_names[CC_COUNT] = {"fixed", "aimd", "cubic", "bbr"};
+double bbr_cycle[BBR_CYCLE_LEN] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+int cc_algo = CC_CUBIC;
+uint32_t rx_window = RX_WINDOW;
+int batch_size = BATCH_SIZE;
+
+/* Least parity per data frame we send (-f), 0 for none */
+double fec_min = 0;
+
+/* CRC32C tables for the software path, and whether the CPU has the instruction */
+uint32_t crc_table[8][256];
+int crc_hw = 0;
+
+/* Offer and use compression, off with -u */
+int compress = 1;
+
+/* Send only what changed against the server's copy of a file, on with -d */
+int delta = 0;
+
+/* Streams a big transfer is split over (-s), each a range of the file on its own thread */
+int streams = 1;
+
+/* Files a batch command has in flight at once (-m) */
+int batch_files = BATCH_FILES;
+
+/* Largest path MTU probed for (-M), and the frame size the path to the server was found to take */
+int mtu_max = MTU_MAX;
+int mtu_steps[MTU_STEPS] = {9000, 4096, 1500, 1280};
+uint32_t path_frame = FRAME_SIZE;
+
+/* Transfer ID of the current operation, lets the server tell our transfers apart (per stream) */
+__thread uint32_t xid = 0;
+
+/* Round trip estimate to the server and the receive timeout it sets (per stream) */
+__thread rtt_t rtt;
+__thread double rcv_timeout = 0;
+int offload = 0;
+__thread int gso_on = 0;
+__thread int gro_on = 0;
+
+/* Usage message */
+char usage[192] = "client [-c fixed|aimd|cubic|bbr] [-w window_frames] [-b batch_frames] [-g] [-f fec_percent] [-u] [-d] [-s streams] [-m batch_files] [-M mtu] <server_ip> <port>\n";
+
+/* Socket parameters, each stream of a parallel transfer has its own socket */
+__thread int sock = 0;
+__thread struct sockaddr_in serv_addr;
+
+/* Transmit batch, per frame headers with payloads in the file buffer (per stream) */
+__thread struct mmsghdr tx_mmsg[BATCH_MAX];
+__thread struct iovec tx_iov[BATCH_MAX][2];
+__thread uint8_t tx_hdr[BATCH_MAX][MSG_HDR + FRAME_HDR];
+__thread uint8_t *tx_par;
+__thread struct mmsghdr tx_gso[BATCH_MAX];
+__thread union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} tx_gso_cmsg[BATCH_MAX];
+__thread uint32_t tx_frame = FRAME_SIZE;
+__thread int tx_cnt = 0;
+
+/* Receive batch, handed out one message at a time by recv_msg (a slot may hold a coalesced run) */
+__thread struct mmsghdr rx_mmsg[BATCH_MAX];
+__thread struct iovec rx_iov[BATCH_MAX];
+__thread struct sockaddr_in rx_addr[BATCH_MAX];
+__thread union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} rx_cmsg[BATCH_MAX];
+__thread uint8_t *rx_area;
+__thread int rx_slot = MSG_MAX;
+__thread int rx_cnt = 0;
+__thread int rx_next = 0;
+__thread int rx_off = 0;
+
+/* Error handler */
+void error(char *msg) {
+  perror(msg);
+  exit(1);
+}
+
+/* Warning harndler */
+void warn(char *msg) {
+  perror(msg);
+}
+
+/* Big endian field helpers for the wire format */
+void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v >> 0;
+}
+
+uint32_t get_u32(uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8  | (uint32_t) p[3] << 0;
+}
+
+void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
+
+uint64_t get_u64(uint8_t *p) {
+    return (uint64_t) get_u32(p) << 32 | get_u32(p + 4);
+}
+
+/* Message header to and from the wire */
+void wire_put(uint8_t *p, msg_t *m) {
+    p[0] = m->oper << 4 | m->func;
+    put_u32(p + 1, m->xid);
+    put_u32(p + 5, m->ts);
+    put_u32(p + 9, m->ts_echo);
+}
+
+/* Read a datagram of n bytes into a message, control data it didn't carry reads as zeros and one
+ * too short for a header matches no operation */
+void wire_get(msg_t *m, uint8_t *p, int n) {
+    if (n < MSG_HDR) {
+        m->oper = OPER_NONE;
+        m->func = 0;
+        return;
+    }
+    m->oper = p[0] >> 4;
+    m->func = p[0] & 0x0f;
+    m->xid = get_u32(p + 1);
+    m->ts = get_u32(p + 5);
+    m->ts_echo = get_u32(p + 9);
+    n -= MSG_HDR;
+    memcpy(m->data, p + MSG_HDR, n);
+    if (n < DATA_SIZE) {
+        memset(m->data + n, 0, DATA_SIZE - n);
+    }
+
+    /* A name that fills the datagram still ends inside the message */
+    m->data[n] = 0;
+}
+
+/* Send a message carrying len bytes of data, header and data go out as they are */
+int msg_send(msg_t *m, int len, struct sockaddr_in *to) {
+    uint8_t hdr[MSG_HDR];
+    struct iovec iov[2];
+    struct msghdr mh;
+
+    wire_put(hdr, m);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = MSG_HDR;
+    iov[1].iov_base = m->data;
+    iov[1].iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = to;
+    mh.msg_namelen = sizeof(struct sockaddr_in);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    return sendmsg(sock, &mh, 0);
+}
+
+/* Frame sets, one bit per frame packed into 64 bit words */
+bits_t *bits_new(uint64_t n) {
+    return calloc(BITS_WORDS(n), sizeof(bits_t));
+}
+
+int bits_test(bits_t *b, uint64_t i) {
+    return (b[i >> 6] >> (i & 63)) & 1;
+}
+
+void bits_set(bits_t *b, uint64_t i) {
+    b[i >> 6] |= 1ULL << (i & 63);
+}
+
+/* First clear bit in [from, to), or to if there is none, a word at a time */
+uint64_t bits_ffz(bits_t *b, uint64_t from, uint64_t to) {
+    uint64_t w = 0;
+
+    while (from < to) {
+        w = ~b[from >> 6] >> (from & 63);
+        if (w != 0) {
+            from += __builtin_ctzll(w);
+            return (from < to) ? from : to;
+        }
+        from = (from | 63) + 1;
+    }
+    return to;
+}
+
+/* First set bit in [from, to), or to if there is none, a word at a time */
+uint64_t bits_ffs(bits_t *b, uint64_t from, uint64_t to) {
+    uint64_t w = 0;
+
+    while (from < to) {
+        w = b[from >> 6] >> (from & 63);
+        if (w != 0) {
+            from += __builtin_ctzll(w);
+            return (from < to) ? from : to;
+        }
+        from = (from | 63) + 1;
+    }
+    return to;
+}
+
+/* Set or clear bits [from, to), returns how many actually changed */
+uint64_t bits_fill(bits_t *b, uint64_t from, uint64_t to, int on) {
+    uint64_t mask = 0;
+    uint64_t n = 0;
+    uint64_t end = 0;
+
+    while (from < to) {
+        end = (from | 63) + 1;
+        if (end > to) {
+            end = to;
+        }
+        mask = (end - from == 64) ? ~0ULL : ((1ULL << (end - from)) - 1) << (from & 63);
+        if (on) {
+            n += __builtin_popcountll(~b[from >> 6] & mask);
+            b[from >> 6] |= mask;
+        } else {
+            n += __builtin_popcountll(b[from >> 6] & mask);
+            b[from >> 6] &= ~mask;
+        }
+        from = end;
+    }
+    return n;
+}
+
+/* Fill the software CRC32C tables and see if the CPU can do it instead */
+void crc_init() {
+    uint32_t c = 0;
+
+    for (int n = 0; n < 256; n++) {
+        c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (int n = 0; n < 256; n++) {
+        c = crc_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
+        }
+    }
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* CRC32C eight bytes at a time with the SSE4.2 instruction */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    uint64_t w = 0;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    for (; len > 0; len--) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+    }
+    return c;
+}
+#endif
+
+/* CRC32C eight bytes at a time from the tables (slicing by 8, little endian words) */
+uint32_t crc32c_sw(uint32_t crc, uint8_t *p, size_t len) {
+    uint64_t w = 0;
+
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+    for (; len > 0; len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+/* Extend a CRC32C over len more bytes, start from 0 */
+uint32_t crc32c(uint32_t crc, uint8_t *p, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc_hw) {
+        return ~crc32c_hw(crc, p, len);
+    }
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
+
+/* Checksum of a data or parity frame, its ID and flags then the bytes it carries */
+uint32_t frame_crc(uint8_t *hdr, uint8_t *payload, size_t len) {
+    return crc32c(crc32c(0, hdr, FRAME_CRC), payload, len);
+}
+
+/* 1 if a received frame matches its checksum */
+int frame_ok(uint8_t *data, size_t len) {
+    return get_u32(data + FRAME_CRC) == frame_crc(data, data + FRAME_HDR, len);
+}
+
+/* rsync style weak checksum of a block, the byte sum in the low half and the position weighted sum
+ * above it, sums are left in a and b for rolling */
+uint32_t weak_sum(uint8_t *p, size_t len, uint32_t *a, uint32_t *b) {
+    *a = 0;
+    *b = 0;
+    for (size_t i = 0; i < len; i++) {
+        *a += p[i];
+        *b += (len - i) * p[i];
+    }
+    return (*a & 0xffff) | (*b << 16);
+}
+
+/* Strong block hash (MurmurHash64A) */
+uint64_t hash64(uint8_t *p, size_t len) {
+    uint64_t h = len * HASH_MUL;
+    uint64_t k = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&k, p + i, 8);
+        k *= HASH_MUL;
+        k ^= k >> 47;
+        k *= HASH_MUL;
+        h ^= k;
+        h *= HASH_MUL;
+    }
+    if (i < len) {
+        k = 0;
+        memcpy(&k, p + i, len - i);
+        h ^= k;
+        h *= HASH_MUL;
+    }
+    h ^= h >> 47;
+    h *= HASH_MUL;
+    h ^= h >> 47;
+    return h;
+}
+
+/* Table slot for the 4 bytes at p */
+uint32_t lz_hash(uint8_t *p) {
+    uint32_t v = 0;
+
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+/* Length of an LZ run field past its 4 bit token, as 255 bytes and a remainder */
+uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* LZ4 style block coder: literal runs and 16 bit offset matches behind a nibble token,
+ * returns the coded size or 0 if it doesn't fit in cap */
+size_t lz_compress(uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint8_t *ip = src;
+    uint8_t *anchor = src;
+    uint8_t *end = src + len;
+    uint8_t *ref;
+    uint8_t *op = dst;
+    size_t lit = 0;
+    size_t mlen = 0;
+    uint32_t h = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= end) {
+        h = lz_hash(ip);
+        ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > 0xffff || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            /* Step faster the longer nothing matches, so incompressible data is cheap */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++);
+
+        /* Token, literals, offset, then the rest of the match length */
+        lit = ip - anchor;
+        if ((op - dst) + 1 + lit + lit/255 + 1 + 2 + mlen/255 + 1 > cap) {
+            return 0;
+        }
+        *op++ = ((lit < 15) ? lit : 15) << 4 | ((mlen - LZ_MIN_MATCH < 15) ? mlen - LZ_MIN_MATCH : 15);
+        if (lit >= 15) {
+            op = lz_put_len(op, lit - 15);
+        }
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) >> 0;
+        *op++ = (ip - ref) >> 8;
+        if (mlen - LZ_MIN_MATCH >= 15) {
+            op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* Last sequence is only literals, the block ends after them */
+    lit = end - anchor;
+    if ((op - dst) + 1 + lit + lit/255 + 1 > cap) {
+        return 0;
+    }
+    *op++ = ((lit < 15) ? lit : 15) << 4;
+    if (lit >= 15) {
+        op = lz_put_len(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
+
+/* Decode a block coded by lz_compress, returns its size or -1 if it is corrupt */
+int64_t lz_decompress(uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint8_t *ip = src;
+    uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t lit = 0;
+    size_t mlen = 0;
+    size_t off = 0;
+    uint8_t token = 0;
+
+    while (ip < iend) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip == iend) {
+                    return -1;
+                }
+                lit += *ip;
+            } while (*ip++ == 255);
+        }
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        /* Match, copied a byte at a time when it overlaps what it produces */
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip == iend) {
+                    return -1;
+                }
+                mlen += *ip;
+            } while (*ip++ == 255);
+        }
+        if (off == 0 || off > (size_t) (op - dst) || mlen > (size_t) (oend - op)) {
+            return -1;
+        }
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            for (; mlen > 0; mlen--, op++) {
+                *op = op[-off];
+            }
+        }
+    }
+
+    return op - dst;
+}
+
+/* Try a few blocks spread over the file, 1 if they code small enough to bother */
+int comp_worth(uint8_t *src, uint64_t len) {
+    uint8_t scratch[COMP_BLOCK];
+    uint64_t nblk = (len + COMP_BLOCK - 1) / COMP_BLOCK;
+    uint64_t raw = 0;
+    uint64_t coded = 0;
+    uint64_t off = 0;
+    size_t blen = 0;
+    size_t clen = 0;
+
+    if (len == 0 || len > COMP_MAX_LEN) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < COMP_SAMPLES && i < nblk; i++) {
+        off = (uint64_t) COMP_BLOCK*(nblk*i / ((nblk < COMP_SAMPLES) ? nblk : COMP_SAMPLES));
+        blen = (len - off < COMP_BLOCK) ? len - off : COMP_BLOCK;
+        clen = lz_compress(src + off, blen, scratch, blen);
+        raw += blen;
+        coded += (clen > 0) ? clen : blen;
+    }
+    return coded < COMP_KEEP*raw;
+}
+
+/* Most bytes comp_stream can produce for len bytes of file */
+uint64_t comp_bound(uint64_t len) {
+    return len + COMP_HDR*((len + COMP_BLOCK - 1) / COMP_BLOCK);
+}
+
+/* Code a whole file into a block stream, blocks that don't shrink are stored, returns the stream length */
+uint64_t comp_stream(uint8_t *src, uint64_t len, uint8_t *dst) {
+    uint64_t out = 0;
+    size_t blen = 0;
+    size_t clen = 0;
+
+    for (uint64_t off = 0; off < len; off += blen) {
+        blen = (len - off < COMP_BLOCK) ? len - off : COMP_BLOCK;
+        clen = lz_compress(src + off, blen, dst + out + COMP_HDR, blen - 1);
+        if (clen == 0) {
+            memcpy(dst + out + COMP_HDR, src + off, blen);
+            put_u32(dst + out, blen | COMP_STORED);
+            out += COMP_HDR + blen;
+        } else {
+            put_u32(dst + out, clen);
+            out += COMP_HDR + clen;
+        }
+    }
+    return out;
+}
+
+/* Write received bytes out, through the block decoder if the stream is compressed or a delta, and add
+ * what is written to the file checksum */
+int comp_write(zdec_t *z, uint32_t *crc, FILE *f, uint8_t *p, size_t len) {
+    size_t need = 0;
+    size_t n = 0;
+    int64_t out = 0;
+    uint32_t hdr = 0;
+    uint64_t idx = 0;
+    uint64_t nblk = 0;
+
+    if (z == NULL) {
+        *crc = crc32c(*crc, p, len);
+        return (fwrite(p, 1, len, f) == len) ? 0 : -1;
+    }
+    while (len > 0) {
+        /* Gather the header, then the block it describes */
+        need = COMP_HDR;
+        if (z->have >= COMP_HDR) {
+            hdr = get_u32(z->buf);
+            need += (hdr & DELTA_COPY) ? DELTA_REF : hdr & ~COMP_STORED;
+            if (need == COMP_HDR || need > COMP_HDR + COMP_BLOCK) {
+                return -1;
+            }
+        }
+        n = (need - z->have < len) ? need - z->have : len;
+        memcpy(z->buf + z->have, p, n);
+        z->have += n;
+        p += n;
+        len -= n;
+        if (z->have < need || need == COMP_HDR) {
+            continue;
+        }
+
+        /* Run of blocks from the copy a delta is against */
+        z->have = 0;
+        if (hdr & DELTA_COPY) {
+            nblk = hdr & ~DELTA_COPY;
+            idx = get_u32(z->buf + COMP_HDR);
+            if (z->basis == NULL || nblk == 0 || idx + nblk > z->basis_len / z->block) {
+                return -1;
+            }
+            *crc = crc32c(*crc, z->basis + z->block*idx, z->block*nblk);
+            if (fwrite(z->basis + z->block*idx, 1, z->block*nblk, f) != z->block*nblk) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Whole block, write it out */
+        if (hdr & COMP_STORED) {
+            *crc = crc32c(*crc, z->buf + COMP_HDR, need - COMP_HDR);
+            if (fwrite(z->buf + COMP_HDR, 1, need - COMP_HDR, f) != need - COMP_HDR) {
+                return -1;
+            }
+            continue;
+        }
+        out = lz_decompress(z->buf + COMP_HDR, need - COMP_HDR, z->out, COMP_BLOCK);
+        if (out < 0) {
+            return -1;
+        }
+        *crc = crc32c(*crc, z->out, out);
+        if (fwrite(z->out, 1, out, f) != (size_t) out) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Whether a path names something under the current directory: relative and no .. components */
+int path_ok(char *path) {
+    char *p = path;
+
+    if (path[0] == 0 || path[0] == '/') {
+        return 0;
+    }
+    while (p != NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0)) {
+            return 0;
+        }
+        p = strchr(p, '/');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return 1;
+}
+
+/* Create the directories leading up to a file, like mkdir -p of its parent */
+int make_parents(char *path) {
+    char dir[CKPT_NAME];
+
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p != 0; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = 0;
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
+
+/* Resume state to and from the wire (and the front of a checkpoint) */
+void resume_put(uint8_t *p, ckpt_t *c) {
+    put_u64(p, c->raw_len);
+    put_u64(p + 8, c->mtime);
+    put_u64(p + 16, c->wire_len);
+    p[24] = c->codec;
+    put_u32(p + 25, c->frames);
+    put_u32(p + 29, c->frame);
+}
+
+void resume_get(uint8_t *p, ckpt_t *c) {
+    c->raw_len = get_u64(p);
+    c->mtime = get_u64(p + 8);
+    c->wire_len = get_u64(p + 16);
+    c->codec = p[24];
+    c->frames = get_u32(p + 25);
+    c->frame = get_u32(p + 29);
+}
+
+/* 1 if two transfers send the same file the same way, so frames of one are frames of the other */
+int ckpt_match(ckpt_t *a, ckpt_t *b) {
+    return a->raw_len == b->raw_len && a->mtime == b->mtime && a->wire_len == b->wire_len && a->codec == b->codec;
+}
+
+/* Read the checkpoint for a file, -1 if there is none or the partial file no longer backs it */
+int ckpt_load(char *file, ckpt_t *c) {
+    char name[CKPT_NAME];
+    uint8_t hdr[CKPT_HDR];
+    struct stat st;
+    FILE *cf;
+    size_t n = 0;
+
+    snprintf(name, sizeof(name), "%s.resume", file);
+    cf = fopen(name, "rb");
+    if (cf == NULL) {
+        return -1;
+    }
+    n = fread(hdr, 1, CKPT_HDR, cf);
+    fclose(cf);
+    if (n != CKPT_HDR) {
+        return -1;
+    }
+    resume_get(hdr, c);
+    c->out_len = get_u64(hdr + RESUME_SIZE);
+    c->crc = get_u32(hdr + RESUME_SIZE + 8);
+    c->have = get_u32(hdr + RESUME_SIZE + 12);
+
+    if (stat(file, &st) < 0 || (uint64_t) st.st_size < c->out_len || c->have > COMP_HDR + COMP_BLOCK) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Save progress beside the file, after flushing so the file holds everything counted */
+void ckpt_save(char *file, ckpt_t *c, FILE *f, zdec_t *z) {
+    char name[CKPT_NAME];
+    char tmp[CKPT_NAME];
+    uint8_t hdr[CKPT_HDR];
+    FILE *cf;
+
+    if (fflush(f) != 0) {
+        warn("Couldn't save checkpoint");
+        return;
+    }
+    c->out_len = ftello(f);
+    c->have = (z != NULL) ? z->have : 0;
+    resume_put(hdr, c);
+    put_u64(hdr + RESUME_SIZE, c->out_len);
+    put_u32(hdr + RESUME_SIZE + 8, c->crc);
+    put_u32(hdr + RESUME_SIZE + 12, c->have);
+
+    /* Written aside and renamed over, so a crash leaves the old checkpoint or the new one */
+    snprintf(name, sizeof(name), "%s.resume", file);
+    snprintf(tmp, sizeof(tmp), "%s.resume.tmp", file);
+    cf = fopen(tmp, "wb");
+    if (cf == NULL) {
+        warn("Couldn't save checkpoint");
+        return;
+    }
+    if (fwrite(hdr, 1, CKPT_HDR, cf) != CKPT_HDR || (c->have > 0 && fwrite(z->buf, 1, c->have, cf) != c->have)) {
+        warn("Couldn't save checkpoint");
+        fclose(cf);
+        remove(tmp);
+        return;
+    }
+    fclose(cf);
+    rename(tmp, name);
+}
+
+/* Reopen a partial file at its checkpoint, with the decoder holding the block it was partway through */
+FILE *ckpt_open(char *file, ckpt_t *c, zdec_t *z) {
+    char name[CKPT_NAME];
+    FILE *f;
+    FILE *cf;
+    int ok = 0;
+
+    f = fopen(file, "r+b");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (z != NULL) {
+        snprintf(name, sizeof(name), "%s.resume", file);
+        cf = fopen(name, "rb");
+        ok = cf != NULL && fseek(cf, CKPT_HDR, SEEK_SET) == 0 && fread(z->buf, 1, c->have, cf) == c->have;
+        if (cf != NULL) {
+            fclose(cf);
+        }
+        z->have = c->have;
+    } else {
+        ok = c->have == 0;
+    }
+    if (!ok || ftruncate(fileno(f), c->out_len) < 0 || fseeko(f, 0, SEEK_END) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* Forget a file's checkpoint, once it is complete or being started over */
+void ckpt_drop(char *file) {
+    char name[CKPT_NAME];
+
+    snprintf(name, sizeof(name), "%s.resume", file);
+    remove(name);
+}
+
+/* Store a frame in the reassembly window if it falls inside it */
+void rx_store(char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t num_dpkt, uint32_t id, uint8_t *data) {
+    uint32_t slot = id % win;
+
+    if (id < curr_dpkt || id >= num_dpkt || id - curr_dpkt >= win || bits_test(pkt_arr, slot)) {
+        return;
+    }
+    memcpy(fbuf + (size_t) frame*slot, data, frame);
+    bits_set(pkt_arr, slot);
+}
+
+/* Write the run of complete frames at the front of the window, returns the new lowest missing frame */
+uint32_t rx_flush(FILE *f, zdec_t *z, uint32_t *crc, char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t num_dpkt, uint64_t file_len) {
+    uint32_t start = curr_dpkt;
+    uint32_t pos = curr_dpkt % win;
+    uint32_t left = (num_dpkt - curr_dpkt < win) ? num_dpkt - curr_dpkt : win;
+    uint32_t run = 0;
+    uint64_t end = 0;
+    uint64_t len = 0;
+    uint64_t first = 0;
+
+    /* Lowest missing frame, in up to two pieces since the run may wrap the ring */
+    run = bits_ffz(pkt_arr, pos, (pos + left < win) ? pos + left : win) - pos;
+    if (pos + run == win && run < left) {
+        run += bits_ffz(pkt_arr, 0, left - run);
+    }
+    if (run == 0) {
+        return curr_dpkt;
+    }
+    curr_dpkt += run;
+
+    /* Free the slots as the window slides */
+    if (pos + run <= win) {
+        bits_fill(pkt_arr, pos, pos + run, 0);
+    } else {
+        bits_fill(pkt_arr, pos, win, 0);
+        bits_fill(pkt_arr, 0, pos + run - win, 0);
+    }
+
+    /* Run may wrap around the end of the ring, last frame is cut to the file length */
+    end = (uint64_t) frame*curr_dpkt;
+    len = ((end < file_len) ? end : file_len) - (uint64_t) frame*start;
+    first = (uint64_t) frame*(win - start % win);
+    if (first > len) {
+        first = len;
+    }
+    if (comp_write(z, crc, f, (uint8_t *) fbuf + (size_t) frame*(start % win), first) < 0 ||
+        (len > first && comp_write(z, crc, f, (uint8_t *) fbuf, len - first) < 0)) {
+        warn("Couldn't write file");
+    }
+
+    return curr_dpkt;
+}
+
+/* Build a selective ack: lowest missing frame, frames rebuilt from parity and a bitmap of the frames after it,
+ * returns its length */
+int sack_build(msg_t *s, bits_t *pkt_arr, uint32_t win, uint32_t curr_dpkt, uint32_t high_dpkt, int rebuilt) {
+    uint32_t nbits = 0;
+    uint32_t pos = curr_dpkt % win;
+    uint32_t first = 0;
+    uint64_t i = 0;
+
+    if (high_dpkt > curr_dpkt) {
+        nbits = (high_dpkt - curr_dpkt > SACK_BITS) ? SACK_BITS : high_dpkt - curr_dpkt;
+    }
+    if (nbits > win) {
+        nbits = win;
+    }
+
+    put_u32(s->data, curr_dpkt);
+    s->data[4] = nbits >> 8;
+    s->data[5] = nbits >> 0;
+    s->data[6] = rebuilt >> 8;
+    s->data[7] = rebuilt >> 0;
+
+    /* Only visit frames we have, skipping holes a word at a time (ring may wrap) */
+    memset(s->data + SACK_HDR, 0, (nbits + 7) / 8);
+    first = (pos + nbits < win) ? nbits : win - pos;
+    for (i = bits_ffs(pkt_arr, pos, pos + first); i < pos + first; i = bits_ffs(pkt_arr, i + 1, pos + first)) {
+        s->data[SACK_HDR + (i - pos)/8] |= 1 << ((i - pos) % 8);
+    }
+    for (i = bits_ffs(pkt_arr, 0, nbits - first); i < nbits - first; i = bits_ffs(pkt_arr, i + 1, nbits - first)) {
+        s->data[SACK_HDR + (i + first)/8] |= 1 << ((i + first) % 8);
+    }
+    return SACK_HDR + (nbits + 7) / 8;
+}
+
+/* Mark frames reported by a selective ack, returns the lowest missing frame */
+uint32_t sack_apply(msg_t *s, bits_t *acked, uint32_t curr_dpkt, uint32_t num_dpkt, int *newly, int *rebuilt) {
+    uint32_t base = get_u32(s->data);
+    uint32_t nbits = s->data[4] << 8 | s->data[5] << 0;
+    uint8_t byte = 0;
+    uint32_t i = 0;
+
+    if (base > num_dpkt) {
+        base = num_dpkt;
+    }
+    if (nbits > SACK_BITS) {
+        nbits = SACK_BITS;
+    }
+    if (nbits > num_dpkt - base) {
+        nbits = num_dpkt - base;
+    }
+
+    /* Count frames acked for the first time, for congestion control */
+    *rebuilt = s->data[6] << 8 | s->data[7] << 0;
+    *newly = 0;
+    if (base > curr_dpkt) {
+        *newly += bits_fill(acked, curr_dpkt, base, 1);
+    }
+    for (uint32_t j = 0; j < (nbits + 7) / 8; j++) {
+        for (byte = s->data[SACK_HDR + j]; byte != 0; byte &= byte - 1) {
+            i = 8*j + __builtin_ctz(byte);
+            if (i < nbits && !bits_test(acked, base + i)) {
+                bits_set(acked, base + i);
+                (*newly)++;
+            }
+        }
+    }
+
+    /* Stale ack from before the last one, keep the newer position */
+    if (base < curr_dpkt) {
+        base = curr_dpkt;
+    }
+
+    return base;
+}
+
+/* dst ^= src, a word at a time */
+void xor_into(uint8_t *dst, uint8_t *src, size_t len) {
+    uint64_t a = 0;
+    uint64_t b = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+/* Bytes of file data in a frame, only the last one is short */
+size_t frame_len(uint64_t file_len, uint32_t frame, uint32_t id) {
+    uint64_t off = (uint64_t) frame*id;
+
+    return (file_len - off < frame) ? file_len - off : frame;
+}
+
+/* Frame size for a transfer from the one asked for, within what either end can hold */
+uint32_t frame_pick(uint32_t want) {
+    if (want < FRAME_SIZE) {
+        return FRAME_SIZE;
+    }
+    return (want > FRAME_MAX) ? FRAME_MAX : want;
+}
+
+/* Frames per parity group for the loss seen so far, 0 if parity is off */
+int fec_group(double loss) {
+    double ratio = fec_min;
+
+    if (fec_min == 0) {
+        return 0;
+    }
+    if (FEC_LOSS_GAIN*loss > ratio) {
+        ratio = FEC_LOSS_GAIN*loss;
+    }
+    if (ratio >= 1.0 / FEC_MIN_GROUP) {
+        return FEC_MIN_GROUP;
+    }
+    if (ratio <= 1.0 / FEC_MAX_GROUP) {
+        return FEC_MAX_GROUP;
+    }
+    return 1 / ratio;
+}
+
+/* Rebuild the one frame of a parity group that didn't arrive, returns 1 if there was one to rebuild */
+int fec_rebuild(char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t high_dpkt, uint32_t num_dpkt, uint64_t file_len, uint8_t *par) {
+    uint32_t first = get_u32(par);
+    uint32_t n = par[4] >> FRAME_FLAGS;
+    int64_t miss = -1;
+    uint8_t *out;
+
+    /* Frames written out stay in the ring until a frame a window later lands on them */
+    if (n < FEC_MIN_GROUP || first >= num_dpkt || n > num_dpkt - first || first + n > curr_dpkt + win || high_dpkt > first + win) {
+        return 0;
+    }
+    for (uint32_t i = (first > curr_dpkt) ? first : curr_dpkt; i < first + n; i++) {
+        if (!bits_test(pkt_arr, i % win)) {
+            if (miss >= 0) {
+                return 0;
+            }
+            miss = i;
+        }
+    }
+    if (miss < 0) {
+        return 0;
+    }
+
+    /* Parity XOR every other frame in the group, the last frame counts as zero past the end of the file */
+    out = (uint8_t *) fbuf + (size_t) frame*(miss % win);
+    memcpy(out, par + FRAME_HDR, frame);
+    for (uint32_t i = first; i < first + n; i++) {
+        if (i != miss) {
+            xor_into(out, (uint8_t *) fbuf + (size_t) frame*(i % win), frame_len(file_len, frame, i));
+        }
+    }
+    bits_set(pkt_arr, miss % win);
+
+    return 1;
+}
+
+/* Current time in seconds from a monotonic clock */
+double now_sec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Microsecond timestamp for message headers, wraps every 71 minutes and is never 0 (0 means none) */
+uint32_t now_usec() {
+    uint32_t t = (uint64_t) (now_sec() * 1e6);
+
+    return (t == 0) ? 1 : t;
+}
+
+/* No samples yet, start from the initial guess */
+void rtt_init(rtt_t *r) {
+    memset(r, 0, sizeof(rtt_t));
+    r->rto = RTO_INIT;
+}
+
+/* Stamp a message with our time and echo the peer's last one, advanced by how long we held it */
+void rtt_stamp(rtt_t *r, msg_t *m) {
+    uint32_t now = now_usec();
+
+    m->ts = now;
+    m->ts_echo = (r->peer_ts != 0) ? r->peer_ts + (now - r->peer_at) : 0;
+}
+
+/* Remember the peer's time and update the estimate from our echoed one (Jacobson/Karels) */
+void rtt_recv(rtt_t *r, msg_t *m) {
+    uint32_t now = now_usec();
+    double rtt = 0;
+
+    if (m->ts != 0) {
+        r->peer_ts = m->ts;
+        r->peer_at = now;
+    }
+    if (m->ts_echo == 0) {
+        return;
+    }
+
+    /* Garbage or from before a clock wrap */
+    rtt = (uint32_t) (now - m->ts_echo) / 1e6;
+    if (rtt > PEER_TIMEOUT) {
+        return;
+    }
+
+    if (r->srtt == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        r->rttvar = 0.75*r->rttvar + 0.25*fabs(r->srtt - rtt);
+        r->srtt = 0.875*r->srtt + 0.125*rtt;
+    }
+
+    /* A fresh sample also undoes any backoff, steady paths still get some slack over the RTT */
+    r->rto = fmin(r->srtt + fmax(RTO_MIN, 4*r->rttvar), RTO_MAX);
+}
+
+/* Answer to a poll older than the last one we stamped, i.e. to a round since resent */
+int rtt_stale(msg_t *last, msg_t *m) {
+    return last->ts != 0 && m->ts_echo != 0 && (int32_t) (m->ts_echo - last->ts) < 0;
+}
+
+/* Timed out, wait twice as long next time until a sample comes in */
+void rtt_backoff(rtt_t *r) {
+    r->rto = fmin(2*r->rto, RTO_MAX);
+}
+
+/* Parse a congestion control name, returns -1 if unknown */
+int cc_parse(char *name) {
+    for (int i = 0; i < CC_COUNT; i++) {
+        if (strcmp(name, cc_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Start a transfer with a small window in slow start */
+void cc_init(cc_t *cc, int algo) {
+    memset(cc, 0, sizeof(cc_t));
+    cc->algo = algo;
+    cc->cwnd = (algo == CC_FIXED) ? BURST_SIZE : CC_INIT_CWND;
+    cc->ssthresh = CC_MAX_CWND;
+    cc->min_rtt = 0;
+    cc->mode = BBR_STARTUP;
+}
+
+/* Frames the sender may put in flight this round */
+int cc_window(cc_t *cc) {
+    if (cc->cwnd < CC_MIN_CWND) {
+        cc->cwnd = CC_MIN_CWND;
+    }
+    if (cc->cwnd > CC_MAX_CWND) {
+        cc->cwnd = CC_MAX_CWND;
+    }
+    return (int) cc->cwnd;
+}
+
+/* Multiplicative decrease shared by the loss based algorithms */
+void cc_loss(cc_t *cc) {
+    if (cc->algo == CC_CUBIC) {
+        /* Fast convergence, release bandwidth when the peak keeps dropping */
+        if (cc->cwnd < cc->w_max) {
+            cc->w_max = cc->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+        } else {
+            cc->w_max = cc->cwnd;
+        }
+        cc->cwnd = cc->cwnd * CUBIC_BETA;
+        cc->epoch = 0;
+    } else {
+        cc->cwnd = cc->cwnd / 2;
+    }
+    cc->ssthresh = (cc->cwnd > CC_MIN_CWND) ? cc->cwnd : CC_MIN_CWND;
+}
+
+/* Window growth for cubic once out of slow start */
+void cc_cubic_grow(cc_t *cc, double rtt) {
+    double now = now_sec();
+    double t = 0;
+    double target = 0;
+    double w_est = 0;
+
+    /* Start a new epoch at the first round after a loss */
+    if (cc->epoch == 0) {
+        cc->epoch = now;
+        if (cc->w_max < cc->cwnd) {
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        } else {
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+        }
+        cc->w_est = cc->cwnd;
+    }
+
+    /* Cubic curve through w_max, checked one round ahead */
+    t = now - cc->epoch + rtt;
+    target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+
+    /* Stay at least as aggressive as standard AIMD would be */
+    cc->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA);
+    w_est = cc->w_est;
+    if (target < w_est) {
+        target = w_est;
+    }
+
+    /* Grow by at most half a window per round */
+    if (target > cc->cwnd * 1.5) {
+        target = cc->cwnd * 1.5;
+    }
+    if (target > cc->cwnd) {
+        cc->cwnd = target;
+    } else {
+        cc->cwnd += 1.0;
+    }
+}
+
+/* Delivery rate model for BBR, window follows the estimated BDP */
+void cc_bbr_round(cc_t *cc, int delivered, double rtt) {
+    double now = now_sec();
+    double bdp = 0;
+    double gain = 1.0;
+
+    /* Min RTT, refreshed when the sample gets too old */
+    if (cc->min_rtt == 0 || rtt < cc->min_rtt || now - cc->min_rtt_stamp > BBR_RTT_WIN) {
+        cc->min_rtt = rtt;
+        cc->min_rtt_stamp = now;
+    }
+
+    /* Windowed max of the delivery rate over recent rounds */
+    cc->bw[cc->round % BBR_BW_ROUNDS] = delivered / rtt;
+    cc->round++;
+    cc->max_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (cc->bw[i] > cc->max_bw) {
+            cc->max_bw = cc->bw[i];
+        }
+    }
+    bdp = cc->max_bw * cc->min_rtt;
+
+    switch (cc->mode) {
+        case BBR_STARTUP:
+            /* Pipe is full once bandwidth stops growing 25% for three rounds */
+            if (cc->max_bw >= cc->full_bw * 1.25) {
+                cc->full_bw = cc->max_bw;
+                cc->full_cnt = 0;
+            } else if (++cc->full_cnt >= 3) {
+                cc->mode = BBR_DRAIN;
+            }
+            gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_DRAIN:
+            gain = 1.0 / BBR_HIGH_GAIN;
+            cc->mode = BBR_PROBE_BW;
+            cc->cycle = 0;
+            break;
+        case BBR_PROBE_BW:
+            gain = bbr_cycle[cc->cycle % BBR_CYCLE_LEN];
+            cc->cycle++;
+            break;
+    }
+
+    cc->cwnd = gain * BBR_CWND_GAIN * bdp;
+}
+
+/* Update the window after a round, from frames sent, delivered and lost */
+void cc_on_round(cc_t *cc, int sent, int delivered, int lost, double rtt) {
+    if (rtt <= 0) {
+        rtt = 1e-6;
+    }
+
+    switch (cc->algo) {
+        case CC_FIXED:
+            break;
+        case CC_AIMD:
+        case CC_CUBIC:
+            if (lost > 0) {
+                cc_loss(cc);
+            } else if (sent < cc->cwnd / 2) {
+                /* Application limited round, don't grow */
+            } else if (cc->cwnd < cc->ssthresh) {
+                /* Slow start, without counting frames acked late from earlier rounds */
+                cc->cwnd += (delivered < sent) ? delivered : sent;
+                if (cc->cwnd > cc->ssthresh) {
+                    cc->cwnd = cc->ssthresh;
+                }
+            } else if (cc->algo == CC_AIMD) {
+                cc->cwnd += 1.0;
+            } else {
+                cc_cubic_grow(cc, rtt);
+            }
+            break;
+        case CC_BBR:
+            cc_bbr_round(cc, delivered, rtt);
+            break;
+    }
+}
+
+/* Nothing came back for a whole round, collapse the window */
+void cc_on_timeout(cc_t *cc) {
+    switch (cc->algo) {
+        case CC_FIXED:
+            break;
+        case CC_AIMD:
+        case CC_CUBIC:
+            cc_loss(cc);
+            cc->cwnd = CC_MIN_CWND;
+            break;
+        case CC_BBR:
+            /* Model is kept, next round restores the window from it */
+            cc->cwnd = CC_MIN_CWND;
+            break;
+    }
+}
+
+/* Opt in to UDP segmentation and receive offload where the kernel has it */
+void offload_init() {
+    int val = 0;
 
-/* Codes for operations and packet functions for each operation */
-enum oper_e {OPER_GET  = 0, OPER_PUT, OPER_DEL, OPER_LS, OPER_EXIT};
-enum get_e  {GET_INIT  = 0, GET_DATA, GET_DONE};
-enum put_e  {PUT_INIT  = 0, PUT_DATA, PUT_DONE};
-enum del_e  {DEL_INIT  = 0, DEL_DONE};
-enum ls_e   {LS_INIT   = 0, LS_DATA,  LS_DONE};
-enum exit_e {EXIT_INIT = 0};
+    /* Frame batches give their own segment size per send (frames differ in size between
+     * transfers), so nothing is split by default and this only checks the kernel has it */
+    val = 0;
+    if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) < 0) {
+        warn("UDP segmentation offload unavailable");
+    } else {
+        gso_on = 1;
+    }
 
-/* Message structure */
-typedef struct msg_s {
-    uint32_t oper;
-    uint32_t func;
-    uint8_t data[DATA_SIZE];
-} msg_t;
+    val = 1;
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0) {
+        warn("UDP receive offload unavailable");
+    } else {
+        gro_on = 1;
+    }
+}
 
-/* Usage message */
-char usage[128] = "client <server_ip> <port>\n";
+/* Fall back to one datagram per send */
+void gso_off() {
+    int val = 0;
 
-/* Socket parameters */
-int sock = 0;
-struct sockaddr_in serv_addr;
+    setsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+    gso_on = 0;
+}
 
-/* Error handler */
-void error(char *msg) {
-  perror(msg);
-  exit(1);
+/* Wait at most secs in each receive, only touching the socket when it changes */
+void set_timeout(double secs) {
+    struct timeval tv;
+
+    if (secs == rcv_timeout) {
+        return;
+    }
+    tv.tv_sec = (time_t) secs;
+    tv.tv_usec = (secs - tv.tv_sec) * 1e6;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
+        warn("Error setting socket timeout");
+        return;
+    }
+    rcv_timeout = secs;
 }
 
-/* Warning harndler */
-void warn(char *msg) {
-  perror(msg);
+/* Open this thread's socket to the server, with its own round trip estimate and batches */
+void sock_open() {
+    int optval = 0;
+
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        error("Error initializing socket\n");
+    }
+
+    /* Receive timeout follows the measured round trip, start from a guess */
+    rtt_init(&rtt);
+    set_timeout(rtt.rto);
+
+    /* Leave room for whole rounds in flight, the default buffer drops the tail of a round */
+    optval = SOCK_BUF_SIZE;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval)) < 0) {
+        warn("Error setting socket buffer size");
+    }
+
+    /* Never fragment, a frame too big for the path is dropped (which is how a probe finds the
+     * path MTU) rather than split into fragments that all have to arrive */
+    optval = IP_PMTUDISC_DO;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        warn("Error turning on path MTU discovery");
+    }
+
+    /* Offload if asked for, then size the receive slots for coalesced runs */
+    if (offload) {
+        offload_init();
+    }
+    rx_slot = gro_on ? GRO_BUF_SIZE : MSG_MAX;
+    rx_area = malloc((size_t) rx_slot*batch_size);
+    tx_par = malloc((size_t) FRAME_MAX*BATCH_MAX);
+    if (rx_area == NULL || tx_par == NULL) {
+        error("Error allocating packet buffers");
+    }
 }
 
-/* Get operation for client side */
-void get(char *file) {
+/* Every reply times the path, except parity and data frames before the last one of a round */
+void rtt_note(msg_t *m) {
+    if (m->oper == OPER_GET && m->func == GET_PARITY) {
+        return;
+    }
+    if (m->oper != OPER_GET || m->func != GET_DATA || (m->data[4] & FRAME_POLL)) {
+        rtt_recv(&rtt, m);
+    }
+}
+
+/* Send one message with len bytes of data to the server, stamped with timestamps */
+int send_msg(msg_t *m, int len) {
+    rtt_stamp(&rtt, m);
+    return msg_send(m, len, &serv_addr);
+}
+
+/* Receive one message, refilling the batch with a single recvmmsg when it runs dry */
+int recv_msg(msg_t *m, struct sockaddr_in *from, int *from_len) {
+    struct msghdr *mh;
+    struct cmsghdr *cm;
+    int ret = 0;
+    int len = 0;
+    int seg = 0;
+
+    /* Per packet path */
+    if (batch_size == 1 && gro_on == 0) {
+        set_timeout(rtt.rto);
+        ret = recvfrom(sock, rx_area, MSG_MAX, 0, (struct sockaddr *) from, from_len);
+        if (ret >= 0) {
+            wire_get(m, rx_area, ret);
+            rtt_note(m);
+        }
+        return ret;
+    }
+
+    if (rx_next == rx_cnt) {
+        for (int i = 0; i < batch_size; i++) {
+            rx_iov[i].iov_base = rx_area + (size_t) rx_slot*i;
+            rx_iov[i].iov_len = rx_slot;
+            memset(&rx_mmsg[i].msg_hdr, 0, sizeof(struct msghdr));
+            rx_mmsg[i].msg_hdr.msg_name = &rx_addr[i];
+            rx_mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            rx_mmsg[i].msg_hdr.msg_iov = &rx_iov[i];
+            rx_mmsg[i].msg_hdr.msg_iovlen = 1;
+            rx_mmsg[i].msg_hdr.msg_control = rx_cmsg[i].buf;
+            rx_mmsg[i].msg_hdr.msg_controllen = sizeof(rx_cmsg[i].buf);
+        }
+
+        /* Block for the first datagram (for up to the RTO), take whatever else is queued */
+        set_timeout(rtt.rto);
+        ret = recvmmsg(sock, rx_mmsg, batch_size, MSG_WAITFORONE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        rx_cnt = ret;
+        rx_next = 0;
+        rx_off = 0;
+    }
+
+    /* Coalesced slots carry datagrams of the size given by UDP_GRO, the last may be short */
+    mh = &rx_mmsg[rx_next].msg_hdr;
+    len = rx_mmsg[rx_next].msg_len;
+    seg = len;
+    for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+
+    ret = (len - rx_off < seg) ? len - rx_off : seg;
+    if (ret > MSG_MAX) {
+        ret = MSG_MAX;
+    }
+    wire_get(m, rx_area + (size_t) rx_slot*rx_next + rx_off, ret);
+    memcpy(from, &rx_addr[rx_next], sizeof(struct sockaddr_in));
+    *from_len = sizeof(struct sockaddr_in);
+
+    rx_off += seg;
+    if (rx_off >= len) {
+        rx_next++;
+        rx_off = 0;
+    }
+    rtt_note(m);
+
+    return ret;
+}
+
+/* Send queued frames as runs of up to GSO_FRAMES datagrams, split by the kernel at the batch's frame size */
+int flush_gso() {
+    struct msghdr *mh;
+    struct cmsghdr *cm;
+    uint16_t seg = MSG_HDR + FRAME_HDR + tx_frame;
+    int run = (GSO_FRAMES < GSO_BYTES / seg) ? GSO_FRAMES : GSO_BYTES / seg;
+    int groups = 0;
+    int sent = 0;
+    int ret = 0;
+    int n = 0;
+
+    /* Frames' iovecs are contiguous, so a run is just a longer iovec array */
+    for (int i = 0; i < tx_cnt; i += run) {
+        n = (tx_cnt - i < run) ? tx_cnt - i : run;
+        mh = &tx_gso[groups].msg_hdr;
+        memset(mh, 0, sizeof(struct msghdr));
+        mh->msg_name = &serv_addr;
+        mh->msg_namelen = sizeof(serv_addr);
+        mh->msg_iov = tx_iov[i];
+        mh->msg_iovlen = 2*n;
+        mh->msg_control = tx_gso_cmsg[groups].buf;
+        mh->msg_controllen = sizeof(tx_gso_cmsg[groups].buf);
+        cm = CMSG_FIRSTHDR(mh);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(seg));
+        memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+        groups++;
+    }
+
+    while (sent < groups) {
+        ret = sendmmsg(sock, tx_gso + sent, groups - sent, 0);
+        if (ret < 0) {
+            break;
+        }
+        sent += ret;
+    }
+
+    return ret;
+}
+
+/* Send all queued frames, sendmmsg may take fewer than asked per call */
+int flush_frames() {
+    int ret = 0;
+    int sent = 0;
+
+    /* Segmentation offload, turned off for good if the kernel or device refuses it */
+    if (gso_on && tx_cnt > 1) {
+        ret = flush_gso();
+        if (ret >= 0 || (errno != EIO && errno != EINVAL)) {
+            tx_cnt = 0;
+            return ret;
+        }
+        warn("UDP segmentation offload failed, using plain datagrams");
+        gso_off();
+    }
+
+    if (tx_cnt == 1) {
+        ret = sendmsg(sock, &tx_mmsg[0].msg_hdr, 0);
+    } else {
+        while (sent < tx_cnt) {
+            ret = sendmmsg(sock, tx_mmsg + sent, tx_cnt - sent, 0);
+            if (ret < 0) {
+                break;
+            }
+            sent += ret;
+        }
+    }
+    tx_cnt = 0;
+
+    return ret;
+}
+
+/* Queue one frame to the server from the file buffer */
+int queue_frame(msg_t *d, char *fbuf, uint64_t file_len, uint32_t frame, uint32_t id, int flags) {
+    size_t off = (size_t) frame*id;
+    uint8_t *hdr;
+    struct msghdr *mh;
+
+    /* A batch is segmented at one frame size */
+    if (tx_cnt > 0 && frame != tx_frame && flush_frames() < 0) {
+        return -1;
+    }
+    tx_frame = frame;
+    hdr = tx_hdr[tx_cnt];
+    mh = &tx_mmsg[tx_cnt].msg_hdr;
+
+    /* Each frame in the batch needs its own copy of the header */
+    wire_put(hdr, d);
+    put_u32(hdr + MSG_HDR, id);
+    hdr[MSG_HDR + 4] = flags;
+    put_u32(hdr + MSG_HDR + FRAME_CRC, frame_crc(hdr + MSG_HDR, (uint8_t *) fbuf + off, frame_len(file_len, frame, id)));
+
+    /* Header from the slot, payload from the buffer (padded to a whole frame) */
+    tx_iov[tx_cnt][0].iov_base = hdr;
+    tx_iov[tx_cnt][0].iov_len = MSG_HDR + FRAME_HDR;
+    tx_iov[tx_cnt][1].iov_base = fbuf + off;
+    tx_iov[tx_cnt][1].iov_len = frame;
+
+    memset(mh, 0, sizeof(struct msghdr));
+    mh->msg_name = &serv_addr;
+    mh->msg_namelen = sizeof(serv_addr);
+    mh->msg_iov = tx_iov[tx_cnt];
+    mh->msg_iovlen = 2;
+
+    if (++tx_cnt < batch_size) {
+        return 0;
+    }
+    return flush_frames();
+}
+
+/* Queue a parity frame for frames [first, first + n), its payload gets its own copy in the batch */
+int queue_parity(msg_t *d, uint8_t *par, uint32_t frame, uint32_t first, int n, int flags) {
+    uint8_t *hdr;
+    struct msghdr *mh;
+    uint32_t func = PUT_PARITY;
+
+    if (tx_cnt > 0 && frame != tx_frame && flush_frames() < 0) {
+        return -1;
+    }
+    tx_frame = frame;
+    hdr = tx_hdr[tx_cnt];
+    mh = &tx_mmsg[tx_cnt].msg_hdr;
+
+    wire_put(hdr, d);
+    hdr[0] = d->oper << 4 | func;
+    put_u32(hdr + MSG_HDR, first);
+    hdr[MSG_HDR + 4] = n << FRAME_FLAGS | flags;
+    memcpy(tx_par + (size_t) FRAME_MAX*tx_cnt, par, frame);
+    put_u32(hdr + MSG_HDR + FRAME_CRC, frame_crc(hdr + MSG_HDR, par, frame));
+
+    tx_iov[tx_cnt][0].iov_base = hdr;
+    tx_iov[tx_cnt][0].iov_len = MSG_HDR + FRAME_HDR;
+    tx_iov[tx_cnt][1].iov_base = tx_par + (size_t) FRAME_MAX*tx_cnt;
+    tx_iov[tx_cnt][1].iov_len = frame;
+
+    memset(mh, 0, sizeof(struct msghdr));
+    mh->msg_name = &serv_addr;
+    mh->msg_namelen = sizeof(serv_addr);
+    mh->msg_iov = tx_iov[tx_cnt];
+    mh->msg_iovlen = 2;
+
+    if (++tx_cnt < batch_size) {
+        return 0;
+    }
+    return flush_frames();
+}
+
+/* Send up to win unacked frames, the last one polls for a selective ack */
+int send_round(msg_t *d, rtt_t *rtt, char *fbuf, uint64_t file_len, uint32_t frame, bits_t *acked, uint32_t curr_dpkt, uint32_t num_dpkt, uint32_t rwnd, int win, int group) {
+    int64_t prev = -1;
+    int cnt = 0;
+    uint32_t end = (num_dpkt - curr_dpkt < rwnd) ? num_dpkt : curr_dpkt + rwnd;
+    uint8_t par[FRAME_MAX];
+    uint32_t par_first = 0;
+    int par_n = 0;
+
+    /* Jump straight from one unacked frame to the next */
+    for (uint32_t i = bits_ffz(acked, curr_dpkt, end); i < end && cnt < win; i = bits_ffz(acked, i + 1, end)) {
+        if (prev >= 0 && queue_frame(d, fbuf, file_len, frame, prev, 0) < 0) {
+            warn("Data response failure in PUT");
+        }
+        prev = i;
+        cnt++;
+
+        /* Parity covers runs of consecutive frames, sent right after the last frame of its run */
+        if (group == 0) {
+            continue;
+        }
+        if (par_n > 0 && (i != par_first + par_n || par_n == group)) {
+            if (par_n >= FEC_MIN_GROUP && queue_parity(d, par, frame, par_first, par_n, 0) < 0) {
+                warn("Parity failure in PUT");
+            }
+            par_n = 0;
+        }
+        if (par_n == 0) {
+            memset(par, 0, frame);
+            par_first = i;
+        }
+        xor_into(par, (uint8_t *) fbuf + (size_t) frame*i, frame_len(file_len, frame, i));
+        par_n++;
+    }
+
+    /* Only the poll times the round, so it carries a fresh timestamp */
+    rtt_stamp(rtt, d);
+    if (prev >= 0 && queue_frame(d, fbuf, file_len, frame, prev, FRAME_POLL) < 0) {
+        warn("Data response failure in PUT");
+    }
+
+    /* Last run's parity follows the poll and polls as well, for when it is the poll that got lost */
+    if (par_n >= FEC_MIN_GROUP && queue_parity(d, par, frame, par_first, par_n, FRAME_POLL) < 0) {
+        warn("Parity failure in PUT");
+    }
+    if (tx_cnt > 0 && flush_frames() < 0) {
+        warn("Data response failure in PUT");
+    }
+
+    return cnt;
+}
+
+/* Send a probe of len bytes until the server echoes it, 1 once it has (it also times the path) */
+int probe_size(msg_t *m, int len) {
+    msg_t rec;
+    int serv_len = 0;
+    int ret = 0;
+
+    put_u32(m->data, len);
+    set_timeout(rtt.rto);
+    for (int i = 0; i < PROBE_TRIES; i++) {
+        m->ts_echo = now_usec();
+        ret = msg_send(m, len - MSG_HDR, &serv_addr);
+        if (ret < 0 && errno == EMSGSIZE) {
+            return 0;
+        }
+        while (1) {
+            serv_len = sizeof(serv_addr);
+            ret = recv_msg(&rec, &serv_addr, &serv_len);
+            if (ret < 0) {
+                break;
+            }
+            if (rec.oper == OPER_PROBE && rec.xid == m->xid && ret == len && get_u32(rec.data) == (uint32_t) len) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Find the biggest datagram the path to the server carries both ways, from the route's MTU (at
+ * most -M) down through common MTUs, and size frames to it, a path that can't do better than the
+ * default keeps default frames */
+void pmtu_probe() {
+    msg_t m;
+    int fd = -1;
+    int mtu = 0;
+    int size = mtu_max;
+    socklen_t len = sizeof(mtu);
+
+    /* Kernel's MTU for the route to the server, asked through a connected socket */
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) == 0 &&
+        getsockopt(fd, IPPROTO_IP, IP_MTU, &mtu, &len) == 0 && mtu < size) {
+        size = mtu;
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+
+    /* Padding is zeros, the echo carries our send time back in ts_echo */
+    memset(&m, 0, sizeof(m));
+    m.oper = OPER_PROBE;
+    m.func = PROBE_INIT;
+    m.xid = xid;
+    while (size > MSG_SIZE + IP_UDP_HDR) {
+        if (probe_size(&m, size - IP_UDP_HDR)) {
+            path_frame = size - IP_UDP_HDR - MSG_HDR - FRAME_HDR;
+            break;
+        }
+        mtu = size;
+        size = 0;
+        for (int i = 0; i < MTU_STEPS; i++) {
+            if (mtu_steps[i] < mtu) {
+                size = mtu_steps[i];
+                break;
+            }
+        }
+    }
+    printf("Path takes frames of %" PRIu32 " bytes\n", path_frame);
+}
+
+/* Fetch a file (or what want asks for instead of it) into local, or with r one stream's range of it
+ * (a range of length 0 only fills in the file size and mtime), returns 0 once it is complete */
+int get_file(char *file, char *local, int want, range_t *r) {
     msg_t init;
     msg_t rec;
     msg_t d;
     msg_t done;
     int ret = 0;
     int serv_len = 0;
-    int file_len = 0;
+    uint64_t file_len = 0;
+    uint64_t raw_len = 0;
+    int codec = COMP_NONE;
     char *fbuf;
     FILE *f;
-    int curr_dpkt = 0;
-    int pkt_id = 0;
-    int num_dpkt = 0;
-    int cnt = 0;
-    char * pkt_arr;
+    zdec_t *z = NULL;
+    uint32_t crc = 0;
+    ckpt_t ck;
+    uint64_t mtime = 0;
+    uint32_t resume = 0;
+    uint32_t frame = FRAME_SIZE;
+    uint32_t curr_dpkt = 0;
+    uint32_t high_dpkt = 0;
+    int init_len = 0;
+    int sack_len = 0;
+    uint32_t pkt_id = 0;
+    uint32_t num_dpkt = 0;
+    double heard = 0;
+    int rebuilt = 0;
+    uint32_t bad = 0;
+    uint32_t stray = 0;
+    bits_t *pkt_arr;
 	
-    /* Create init packet */
+    /* New transfer ID for this operation */
+    xid++;
+
+    /* Create init packet with our receive window and the codecs we can decode */
     init.oper = OPER_GET;
     init.func = GET_INIT;
-    strcpy(init.data, file);
-
-    /* Create data request packet */
+    init.xid = xid;
+    put_u32(init.data, rx_window);
+    init.data[4] = (compress ? 1 << COMP_LZ : 0) | want | (r != NULL ? GET_RANGE : 0);
+
+    /* An earlier attempt may have left its progress beside the file, offer it to the server, along
+     * with the frame size our path takes */
+    if (want != 0 || r != NULL || ckpt_load(local, &ck) < 0) {
+        memset(&ck, 0, sizeof(ck));
+    }
+    resume_put(init.data + 5, &ck);
+    put_u64(init.data + 5 + RESUME_SIZE, r != NULL ? r->off : 0);
+    put_u64(init.data + 5 + RESUME_SIZE + 8, r != NULL ? r->len : 0);
+    put_u32(init.data + 5 + RESUME_SIZE + RANGE_SIZE, path_frame);
+    strcpy(init.data + 9 + RESUME_SIZE + RANGE_SIZE, file);
+    init_len = 9 + RESUME_SIZE + RANGE_SIZE + strlen(file) + 1;
+
+    /* Create selective ack packet */
     d.oper = OPER_GET;
-    d.func = GET_DATA;
+    d.func = GET_SACK;
+    d.xid = xid;
     d.data[0] = 0;
     d.data[1] = 0;
 
     /* Create done packet */
     done.oper = OPER_GET;
     done.func = GET_DONE;
+    done.xid = xid;
     done.data[0] = 0;
 
     /* Clear input from last operation */
     while(1) {
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
             break;
         }
@@ -102,286 +2052,1070 @@ void get(char *file) {
     /* Send init packet and wait for response */
     while (1) {
         serv_len = sizeof(serv_addr);
-        ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&init, init_len);
         if (ret < 0) {
             warn("Init packet failure in GET");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No init packet from server, retransmitting");
             continue;
         }
 
-        if (rec.oper != OPER_GET || rec.func != GET_INIT) {
+        if (rec.xid != xid || rec.oper != OPER_GET || rec.func != GET_INIT) {
             continue;
         }
 
-        file_len =  (int) (rec.data[0] << 24 | rec.data[1] << 16 |
-                              rec.data[2] << 8  | rec.data[3] << 0);
-        printf("File length is %d\n", file_len);
+        /* Size query for a parallel GET */
+        if (r != NULL && r->len == 0) {
+            r->mtime = get_u64(rec.data + 21);
+            r->total = get_u64(rec.data + 29);
+            return 0;
+        }
+
+        /* Length of what is sent, the codec it is in and the length of the file it decodes to */
+        file_len = get_u64(rec.data);
+        codec = rec.data[8];
+        raw_len = get_u64(rec.data + 9);
+        printf("File length is %" PRIu64 "\n", raw_len);
 
         if (file_len == 0) {
-            printf("Bad filename\n");
-            return;
+
+            /* Empty files are refused like missing ones, but with the mtime of the file */
+            if (!want && r == NULL && get_u64(rec.data + 21) != 0 && get_u64(rec.data + 29) == 0) {
+                f = fopen(local, "wb");
+                if (f == NULL) {
+                    warn("Couldn't open file");
+                    return -1;
+                }
+                fclose(f);
+                printf("Completed get operation\n");
+                return 0;
+            }
+            if (!want) {
+                printf("Bad filename\n");
+            }
+            return -1;
+        }
+        if (codec != COMP_NONE && (codec != COMP_LZ || !compress)) {
+            printf("Server sent an unknown codec\n");
+            return -1;
+        }
+        if (codec == COMP_LZ) {
+            printf("Compressed to %" PRIu64 "\n", file_len);
         }
 
+        /* Every stream of a parallel GET has to get its range of the same copy */
+        if (r != NULL && (get_u64(rec.data + 21) != r->mtime || get_u64(rec.data + 29) != r->total)) {
+            printf("File changed on the server\n");
+            return -1;
+        }
+
+        /* Frames the server agreed we already have, the mtime that identifies its copy and the
+         * size of the frames it sends */
+        resume = get_u32(rec.data + 17);
+        mtime = get_u64(rec.data + 21);
+        frame = frame_pick(get_u32(rec.data + 37));
+
         printf("Initializing\n");
         break;
     }
 
-    /* Creates data buffer (round up to a frame) */
-    fbuf = (char *) malloc(file_len - (file_len % FRAME_SIZE) + FRAME_SIZE);
+    /* Decoder if the file comes compressed */
+    if (codec == COMP_LZ) {
+        z = calloc(1, sizeof(zdec_t));
+        if (z == NULL) {
+            error("Could not make memory for decoder");
+        }
+        z->have = 0;
+    }
+
+    /* Open file, picking it up at the checkpoint if the server agreed to or at its range for a
+     * stream of a parallel GET, frames are written as soon as everything before them has arrived */
+    if (r != NULL) {
+        f = fopen(local, "r+b");
+        if (f != NULL && fseeko(f, r->off, SEEK_SET) < 0) {
+            fclose(f);
+            f = NULL;
+        }
+        if (f == NULL) {
+            warn("Couldn't open file");
+            free(z);
+            return -1;
+        }
+    } else if (resume > 0) {
+        f = ckpt_open(local, &ck, z);
+        if (f == NULL) {
+            warn("Couldn't reopen partial file");
+            ckpt_drop(local);
+            free(z);
+            return -1;
+        }
+        crc = ck.crc;
+        printf("Resuming at frame %" PRIu32 "\n", resume);
+    } else {
+        ckpt_drop(local);
+        f = fopen(local, "wb");
+        if (f == NULL) {
+            warn("Couldn't open file");
+            free(z);
+            return -1;
+        }
+    }
+    ck.raw_len = raw_len;
+    ck.mtime = mtime;
+    ck.wire_len = file_len;
+    ck.codec = codec;
+    ck.frames = resume;
+    ck.frame = frame;
+
+    /* Creates reassembly window */
+    fbuf = (char *) malloc((size_t) frame*rx_window);
     if (fbuf == NULL) {
         error("Could not make memory for file");
     }
 
     /* Calculate total number of packets */
-    num_dpkt = (file_len + (FRAME_SIZE - 1)) / FRAME_SIZE;    
-    curr_dpkt = 0;
-
-    /* Array to keep track of packets */
-    pkt_arr = calloc(num_dpkt+1, sizeof(char));
+    num_dpkt = (file_len + (frame - 1)) / frame;    
+    curr_dpkt = resume;
+    high_dpkt = resume;
+
+    /* Array to keep track of packets in the window */
+    pkt_arr = bits_new(rx_window);
+
+    /* Ask for the first burst right away */
+    sack_len = sack_build(&d, pkt_arr, rx_window, curr_dpkt, high_dpkt, 0);
+    ret = send_msg(&d, sack_len);
+    if (ret < 0) {
+        warn("Data packet failure");
+    }
 
     /* Data gathering loop */
+    heard = now_sec();
     while(1) {
-        /* Request packet */
-        /*d.data[0] = curr_dpkt >> 8;
-        d.data[1] = curr_dpkt >> 0;
-        ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
-        if (ret < 0) {
-            warn("Data packet failure");
-        } */
 
-        /* Recieve packet */
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        /* Recieve packet, the server resends a round if our ack is lost */
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
-            /* Request packet */
-            d.data[0] = curr_dpkt >> 8;
-            d.data[1] = curr_dpkt >> 0;
-            ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
-            if (ret < 0) {
-                warn("Data packet failure");
+            rtt_backoff(&rtt);
+            if (now_sec() - heard >= PEER_TIMEOUT) {
+                printf("Server stopped responding\n");
+                if (r == NULL) {
+                    ck.frames = curr_dpkt;
+                    ck.crc = crc;
+                    ckpt_save(local, &ck, f, z);
+                }
+                fclose(f);
+                free(pkt_arr);
+                free(fbuf);
+                free(z);
+                return -1;
+            }
+            continue;
+        }
+        heard = now_sec();
+
+        /* Save progress now and then, so a later attempt can resume if this one dies */
+        if (r == NULL && (uint64_t) frame*(curr_dpkt - ck.frames) >= CKPT_BYTES) {
+            ck.frames = curr_dpkt;
+            ck.crc = crc;
+            ckpt_save(local, &ck, f, z);
+        }
+
+        /* Parity, fill in the one frame of its group that went missing */
+        if (rec.xid == xid && rec.oper == OPER_GET && rec.func == GET_PARITY) {
+            if (!frame_ok(rec.data, frame)) {
+                bad++;
+                continue;
+            }
+            if (fec_rebuild(fbuf, pkt_arr, rx_window, frame, curr_dpkt, high_dpkt, num_dpkt, file_len, rec.data)) {
+                rebuilt++;
+                curr_dpkt = rx_flush(f, z, &crc, fbuf, pkt_arr, rx_window, frame, curr_dpkt, num_dpkt, file_len);
             }
 
+            /* Stands in for the poll of its round if that never arrived (it has the same timestamp) */
+            if ((rec.data[4] & FRAME_POLL) && rec.ts != rtt.peer_ts && curr_dpkt < num_dpkt) {
+                rtt_recv(&rtt, &rec);
+                sack_len = sack_build(&d, pkt_arr, rx_window, curr_dpkt, high_dpkt, rebuilt);
+                ret = send_msg(&d, sack_len);
+                if (ret < 0) {
+                    warn("Data packet failure");
+                }
+                rebuilt = 0;
+            }
+            if (curr_dpkt == num_dpkt) {
+                free(pkt_arr);
+                break;
+            }
             continue;
         }
 
-        if (rec.oper != OPER_GET || rec.func != GET_DATA) {
+        if (rec.xid != xid || rec.oper != OPER_GET || rec.func != GET_DATA) {
             //printf("Recieved invalid packet\n");
             //printf("Operation %d, function %d\n", rec.oper, rec.func);
             continue;
 
         }
 
-        /* Decode packet ID */
-        pkt_id = rec.data[0] << 8 | rec.data[1] << 0;
+        /* Decode packet ID, frames that fail their checksum are dropped and resent like lost ones
+         * (counted and reported once at the end, not per frame) */
+        pkt_id = get_u32(rec.data);
         //printf("Pkt ID is %d\n", pkt_id);
+        if (pkt_id >= num_dpkt) {
+            stray++;
+            continue;
+        }
+        if (!frame_ok(rec.data, frame_len(file_len, frame, pkt_id))) {
+            bad++;
+            continue;
+        }
 
         if (pkt_id % 10000 == 0) {
             printf("%f Percent...\n", (float) curr_dpkt * 100/ (float) num_dpkt);
         }
-        if (pkt_id < curr_dpkt) {
+        if (pkt_id >= curr_dpkt && pkt_id < num_dpkt && pkt_id - curr_dpkt < rx_window) {
+
+            /* copy into window and write out what is now contiguous */
+            rx_store(fbuf, pkt_arr, rx_window, frame, curr_dpkt, num_dpkt, pkt_id, rec.data + FRAME_HDR);
+            if (pkt_id >= high_dpkt) {
+                high_dpkt = pkt_id + 1;
+            }
+            if (pkt_id == curr_dpkt) {
+                curr_dpkt = rx_flush(f, z, &crc, fbuf, pkt_arr, rx_window, frame, curr_dpkt, num_dpkt, file_len);
+            }
+        }
+
+        /* Last frame of a round, report received frames so only missing ones are resent */
+        if ((rec.data[4] & FRAME_POLL) && curr_dpkt < num_dpkt) {
+            sack_len = sack_build(&d, pkt_arr, rx_window, curr_dpkt, high_dpkt, rebuilt);
+            ret = send_msg(&d, sack_len);
+            if (ret < 0) {
+                warn("Data packet failure");
+            }
+            rebuilt = 0;
+        }
+
+        if (curr_dpkt == num_dpkt) {
+            free(pkt_arr);
+            break;
+        }
+    }
+
+    /* File is already written, nothing left to resume */
+    fclose(f);
+    free(fbuf);
+    free(z);
+    if (r == NULL) {
+        ckpt_drop(local);
+    }
+    if (bad > 0 || stray > 0) {
+        printf("Dropped %" PRIu32 " frames with a bad checksum and %" PRIu32 " out of range\n", bad, stray);
+    }
+
+    /* Send done */
+    while(1) {
+        ret = send_msg(&done, 0);
+        if (ret < 0) {
+            warn("Done packet failure");
+            continue;
+        }
+
+        /* Recieve done ack packet */
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
+        if (ret < 0) {
+            rtt_backoff(&rtt);
+            warn("Didn't recieve done ack");
+            continue;
+        }
+
+        if (rec.xid == xid && rec.oper == OPER_GET && rec.func == GET_DONE) {
+            printf("%f Percent...\n", 100.0);
+
+            /* Server's checksum of the file, missing if it had already let the transfer go */
+            if (rec.data[0] == 1 && get_u32(rec.data + 1) != crc) {
+                printf("Get operation FAILED, file checksum mismatch\n");
+                return -1;
+            }
+            if (rec.data[0] != 1) {
+                printf("Server no longer had the file checksum\n");
+            }
+            if (want) {
+                printf("Fetched block signatures\n");
+            } else if (r == NULL) {
+                printf("Completed get operation\n");
+            }
+            return 0;
+        }
+    }
+}
+
+/* Most bytes delta_stream can produce for len bytes of file */
+uint64_t delta_bound(uint64_t len) {
+    return comp_bound(len) + (COMP_HDR + DELTA_REF)*(len / DELTA_MIN_BLOCK + 1);
+}
+
+/* Code a file against the server's signatures of its copy (rsync's rolling match), runs of blocks
+ * it has become copy records and the rest is coded as in comp_stream, returns the stream length or
+ * 0 if no block matched */
+uint64_t delta_stream(uint8_t *src, uint64_t len, uint8_t *sigs, uint64_t slen, uint8_t *dst) {
+    uint32_t block = get_u32(sigs);
+    uint64_t nblk = (slen - SIG_HDR) / SIG_ENTRY;
+    uint32_t size = 1;
+    int32_t *head;
+    int32_t *next;
+    int32_t j = 0;
+    int32_t k = 0;
+    uint8_t *e;
+    uint32_t a = 0;
+    uint32_t b = 0;
+    uint32_t weak = 0;
+    uint32_t h = 0;
+    uint64_t strong = 0;
+    int have_strong = 0;
+    uint64_t i = 0;
+    uint64_t lit = 0;
+    uint64_t out = 0;
+    uint64_t run_at = 0;
+    uint32_t run_idx = 0;
+    uint32_t run_n = 0;
+    uint64_t matched = 0;
+
+    if (block < DELTA_MIN_BLOCK || block > COMP_BLOCK || nblk == 0 || nblk != get_u64(sigs + 4) / block
+            || nblk > INT32_MAX / 2 || len < block) {
+        return 0;
+    }
+
+    /* Chain the blocks by weak checksum */
+    while (size < 2*nblk) {
+        size <<= 1;
+    }
+    head = malloc(size*sizeof(int32_t));
+    next = malloc(nblk*sizeof(int32_t));
+    if (head == NULL || next == NULL) {
+        free(head);
+        free(next);
+        return 0;
+    }
+    memset(head, 0xff, size*sizeof(int32_t));
+    for (j = nblk - 1; j >= 0; j--) {
+        h = get_u32(sigs + SIG_HDR + (uint64_t) SIG_ENTRY*j)*2654435761U;
+        h = (h ^ h >> 16) & (size - 1);
+        next[j] = head[h];
+        head[h] = j;
+    }
+
+    weak = weak_sum(src, block, &a, &b);
+    while (i + block <= len) {
+
+        /* Look the window up, the strong hash only once a weak checksum matches */
+        k = -1;
+        have_strong = 0;
+        h = weak*2654435761U;
+        for (j = head[(h ^ h >> 16) & (size - 1)]; j >= 0; j = next[j]) {
+            e = sigs + SIG_HDR + (uint64_t) SIG_ENTRY*j;
+            if (get_u32(e) != weak) {
+                continue;
+            }
+            if (!have_strong) {
+                strong = hash64(src + i, block);
+                have_strong = 1;
+            }
+            if (get_u64(e + 4) == strong) {
+                k = j;
+                break;
+            }
+        }
+
+        /* No match, roll the window on a byte */
+        if (k < 0) {
+            if (i + block < len) {
+                a += src[i + block] - src[i];
+                b += a - block*src[i];
+                weak = (a & 0xffff) | (b << 16);
+            }
+            i++;
             continue;
         }
 
-        /* copy into buffer and mark current packet TODO make smarter, keep track of recieved*/
-        if (pkt_arr[pkt_id] == 0) {
-            memcpy(fbuf + FRAME_SIZE*pkt_id, rec.data + 2, FRAME_SIZE);
-            pkt_arr[pkt_id] = 1;
+        /* Match, code the literals before it then extend the last copy record or start one */
+        if (i > lit) {
+            out += comp_stream(src + lit, i - lit, dst + out);
+            run_n = 0;
         }
-        cnt = 0;
-        while(pkt_arr[cnt] != 0){
-            cnt++;
+        if (run_n > 0 && (uint32_t) k == run_idx + run_n && run_n < DELTA_COPY - 1) {
+            run_n++;
+        } else {
+            run_at = out;
+            run_idx = k;
+            run_n = 1;
+            put_u32(dst + out + COMP_HDR, k);
+            out += COMP_HDR + DELTA_REF;
         }
-        curr_dpkt = cnt;
-        //if (pkt_id == curr_dpkt) {
-        //    curr_dpkt++;
-        //}
-
-        if (curr_dpkt == num_dpkt) {
-            free(pkt_arr);
-            break;
+        put_u32(dst + run_at, DELTA_COPY | run_n);
+        matched++;
+
+        /* Next window starts after the block */
+        i += block;
+        lit = i;
+        if (i + block <= len) {
+            weak = weak_sum(src + i, block, &a, &b);
         }
     }
+    if (len > lit) {
+        out += comp_stream(src + lit, len - lit, dst + out);
+    }
+    free(head);
+    free(next);
+    return matched > 0 ? out : 0;
+}
 
-    /* Save file */
-    f = fopen(file, "wb");
-    fwrite(fbuf, 1, file_len, f);
+/* Fetch the server's signatures of its copy of file and code src against them, returns the delta
+ * (its length in out_len, the signature header the server checks its copy against in sig) or NULL
+ * if the server has no copy or nothing matched */
+char *delta_build(char *file, uint8_t *src, uint64_t len, uint64_t *out_len, uint8_t *sig) {
+    char tmp[CKPT_NAME];
+    FILE *f;
+    uint8_t *sigs;
+    uint64_t slen = 0;
+    char *dst;
+
+    /* Signatures come down as a file of their own */
+    snprintf(tmp, sizeof(tmp), "%s.sigs", file);
+    if (get_file(file, tmp, GET_SIGS, NULL) < 0) {
+        remove(tmp);
+        return NULL;
+    }
+    f = fopen(tmp, "rb");
+    if (f == NULL) {
+        return NULL;
+    }
+    fseeko(f, 0, SEEK_END);
+    slen = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    sigs = malloc(slen + 1);
+    if (sigs == NULL || slen < SIG_HDR || fread(sigs, 1, slen, f) != slen) {
+        free(sigs);
+        fclose(f);
+        remove(tmp);
+        return NULL;
+    }
     fclose(f);
-    free(fbuf);
-
-    /* Send done */
-    while(1) {
-        ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
-        if (ret < 0) {
-            warn("Done packet failure");
-            continue;
-        }
-
-        /* Recieve done ack packet */
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
-        if (ret < 0) {
-            warn("Didn't recieve done ack");
-            continue;
-        }
-
-        if (rec.oper == OPER_GET && rec.func == GET_DONE) {
-            printf("%f Percent...\n", 100.0);
-            printf("Completed get operation\n");
-            break;
+    remove(tmp);
+
+    /* Code against them, a delta with nothing to copy is no better than the file */
+    dst = malloc(delta_bound(len) + FRAME_MAX);
+    if (dst != NULL) {
+        *out_len = delta_stream(src, len, sigs, slen, (uint8_t *) dst);
+        if (*out_len == 0) {
+            free(dst);
+            dst = NULL;
         }
     }
+    memcpy(sig, sigs, SIG_HDR);
+    free(sigs);
+    return dst;
 }
 
-void put(char *file) {
+/* Send a file, or with r one stream's range of it, as a delta if diff is set and the server has
+ * a copy, returns 0 once the server has it all */
+int put_file(char *file, range_t *r, int diff) {
     msg_t init;
     msg_t done;
     msg_t rec;
     msg_t d;
     FILE *f;
     char *fbuf;
-    int num_dpkt = 0;
-    int curr_dpkt = 0;
-    int file_len = 0;
+    char *zbuf;
+    uint32_t num_dpkt = 0;
+    uint32_t curr_dpkt = 0;
+    uint32_t shown = 0;
+    uint64_t file_len = 0;
+    uint64_t raw_len = 0;
+    int codec = COMP_NONE;
+    uint32_t crc = 0;
+    uint32_t resume = 0;
+    uint32_t frame = FRAME_SIZE;
+    int init_len = 0;
+    uint8_t sig[SIG_HDR];
+    struct stat st;
     int ret = 0;   
     int serv_len = 0;
-    int pkt_id = 0;
+    uint32_t pkt_id = 0;
+    int newly = 0;
+    int lost = 0;
+    int round_sent = 0;
+    int rebuilt = 0;
+    double round_start = 0;
+    double heard = 0;
+    double loss = 0;
+    uint32_t rwnd = 0;
+    bits_t *acked;
+    cc_t cc;
  
+    /* New transfer ID for this operation */
+    xid++;
+
     /* Create init response */
     init.oper = OPER_PUT;
     init.func = PUT_INIT;
+    init.xid = xid;
     init.data[0] = 0;
 
     /* Create data response */
     d.oper = OPER_PUT;
     d.func = PUT_DATA;
+    d.xid = xid;
     d.data[0] = 0;
 
     /* Create done packet */
     done.oper = OPER_PUT;
     done.func = PUT_DONE;
+    done.xid = xid;
     done.data[0] = 0;
 
     /* Open file buffer */
     f = fopen(file, "r");
     if (f == NULL) {
         warn("Couldn't open file");
-        return;
+        return -1;
     }
 
-    /* Get file size */
-    fseek(f, 0, SEEK_END);
-    file_len = ftell(f);
-    fseek(f, 0, SEEK_SET);
+    /* Get file size, and the mtime that tells the server whether a partial copy is of this file,
+     * a stream of a parallel PUT only reads its range */
+    fseeko(f, 0, SEEK_END);
+    file_len = ftello(f);
+    fseeko(f, 0, SEEK_SET);
+    if (fstat(fileno(f), &st) < 0) {
+        st.st_mtime = 0;
+    }
+    if (r != NULL) {
+        file_len = r->len;
+        fseeko(f, r->off, SEEK_SET);
+    }
+    if (file_len > MAX_FILE_LEN) {
+        printf("File too large to put\n");
+        fclose(f);
+        return -1;
+    }
 
-    /* Load file (round up to a frame) */
-    fbuf = malloc(file_len - (file_len % FRAME_SIZE) + FRAME_SIZE);
-    fread(fbuf, file_len, 1, f);
+    /* Load file (with room to pad the last frame out, whatever size frames turn out to be), a
+     * short read would be sent and checksummed as if it were the file */
+    fbuf = malloc(file_len + FRAME_MAX);
+    if (fbuf == NULL) {
+        warn("Couldn't allocate file buffer");
+        fclose(f);
+        return -1;
+    }
+    if (fread(fbuf, 1, file_len, f) != file_len) {
+        warn("Couldn't read file");
+        free(fbuf);
+        fclose(f);
+        return -1;
+    }
     fclose(f);
 
-    /* Calculate number of packets */
-    num_dpkt = (file_len + (FRAME_SIZE - 1)) / FRAME_SIZE;
-    curr_dpkt = 0;
+    /* Checksum of the whole file, the server checks what it wrote against it */
+    crc = crc32c(0, (uint8_t *) fbuf, file_len);
+    done.data[0] = 1;
+    put_u32(done.data + 1, crc);
+
+    /* With -d, send a delta against the server's copy if it has one, the signatures are fetched
+     * as a transfer of their own so this one takes the next ID */
+    raw_len = file_len;
+    memset(sig, 0, SIG_HDR);
+    if (diff && r == NULL) {
+        zbuf = delta_build(file, (uint8_t *) fbuf, raw_len, &file_len, sig);
+        xid++;
+        init.xid = xid;
+        d.xid = xid;
+        done.xid = xid;
+        if (zbuf != NULL) {
+            free(fbuf);
+            fbuf = zbuf;
+            codec = COMP_DELTA;
+            printf("Delta is %" PRIu64 "\n", file_len);
+        }
+    }
+
+    /* Send it compressed if a sample of it shrinks, the server decodes it as it writes */
+    if (codec == COMP_NONE && compress && comp_worth((uint8_t *) fbuf, raw_len)) {
+        zbuf = malloc(comp_bound(raw_len) + FRAME_MAX);
+        if (zbuf != NULL) {
+            file_len = comp_stream((uint8_t *) fbuf, raw_len, (uint8_t *) zbuf);
+            free(fbuf);
+            fbuf = zbuf;
+            codec = COMP_LZ;
+            printf("Compressed to %" PRIu64 "\n", file_len);
+        }
+    }
+
+    /* Set length sent, its codec, the file size and mtime, and for a delta the signature header of
+     * the copy it is against */
+    put_u64(init.data, file_len);
+    init.data[8] = codec;
+    put_u64(init.data + 9, raw_len);
+    put_u64(init.data + 17, st.st_mtime);
+    memcpy(init.data + 25, sig, SIG_HDR);
 
-    /* Set file size */
-    init.data[0] = file_len >> 24;
-    init.data[1] = file_len >> 16;
-    init.data[2] = file_len >> 8;
-    init.data[3] = file_len >> 0;
+    /* Set where the range sent starts and the size of the whole file */
+    put_u64(init.data + 45, r != NULL ? r->off : 0);
+    put_u64(init.data + 53, r != NULL ? r->total : raw_len);
 
-    /* Set file name for server */
-    strcpy(init.data+4, file);
+    /* Set the frame size our path takes and the file name for server */
+    put_u32(init.data + 61, path_frame);
+    strcpy(init.data + 65, file);
+    init_len = 65 + strlen(file) + 1;
 
     /* Send init packet and wait for response */
     while (1) {
         serv_len = sizeof(serv_addr);
-        ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&init, init_len);
         if (ret < 0) {
             warn("Init packet failure in PUT");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No init packet from server, retransmitting");
             continue;
         }
 
-        if (rec.oper == OPER_PUT && rec.func == PUT_INIT) {
+        if (rec.xid == xid && rec.oper == OPER_PUT && rec.func == PUT_INIT) {
             if (rec.data[0] == 1) {
+                /* Never have more frames in flight than the server can hold */
+                rwnd = get_u32(rec.data + 1);
+                if (rwnd == 0) {
+                    rwnd = 1;
+                }
+
+                /* Where a partial copy the server kept from an earlier attempt ends, and the size
+                 * of frames it takes (that copy's, if there is one) */
+                resume = get_u32(rec.data + 5);
+                frame = frame_pick(get_u32(rec.data + 9));
                 break;
+            } else if (rec.data[0] == 2) {
+                /* Server's copy changed after it sent its signatures, send the whole file */
+                printf("Server copy changed, sending the whole file\n");
+                free(fbuf);
+                return put_file(file, NULL, 0);
             } else {
                 printf("Could not open server file for write\n");
-                return;
+                free(fbuf);
+                return -1;
             }
         }
     }
 
+    /* Calculate number of packets */
+    num_dpkt = (file_len + (frame - 1)) / frame;
+    curr_dpkt = 0;
+
+    /* Array of frames the server has acknowledged, it only needs the rest of a partial copy */
+    acked = bits_new(num_dpkt);
+    cc_init(&cc, cc_algo);
+    if (resume > 0 && resume < num_dpkt) {
+        printf("Resuming at frame %" PRIu32 "\n", resume);
+        bits_fill(acked, 0, resume, 1);
+        curr_dpkt = resume;
+    }
+
+    heard = now_sec();
     while(1) {
 
-        /* Send packets and wait for server status */
-        for (int i = curr_dpkt; i < curr_dpkt + 5000; i++) {
-            if (i < num_dpkt) {
-                d.data[0] = i >> 8;
-                d.data[1] = i >> 0;
-                memcpy(d.data + 2, fbuf + FRAME_SIZE*i, FRAME_SIZE);
-                ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, sizeof(serv_addr));
-                if (ret < 0) {
-                    warn("Data response failure in PUT");
-                }
-            }
+        /* Send a round of frames the server hasn't acked yet */
+        if (round_sent == 0) {
+            round_start = now_sec();
+            round_sent = send_round(&d, &rtt, fbuf, file_len, frame, acked, curr_dpkt, num_dpkt, rwnd, cc_window(&cc), fec_group(loss));
         }
  
         /* Try to receieve a packet and set current packet or send done*/
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            /* Ack is late, back off and poll again */
             //warn("No data packet from server");
+            rtt_backoff(&rtt);
+            if (now_sec() - heard >= PEER_TIMEOUT) {
+                printf("Server stopped responding\n");
+                free(fbuf);
+                free(acked);
+                return -1;
+            }
+            cc_on_timeout(&cc);
+            round_sent = 0;
             continue;
         }
 
-        if  (rec.oper != OPER_PUT || rec.func != PUT_DATA) {
+        if  (rec.xid != xid || rec.oper != OPER_PUT || rec.func != PUT_SACK) {
             //printf("Received invalid packet\n");
             //printf("Operation %d, function %d\n", rec.oper, rec.func);
             continue;
         }
+        heard = now_sec();
+
+        /* Decode selective ack, whatever it didn't cover from the round was lost */
+        pkt_id = sack_apply(&rec, acked, curr_dpkt, num_dpkt, &newly, &rebuilt);
+
+        /* Late ack for a round we already resent, keep waiting for the resent one */
+        if (rtt_stale(&d, &rec) && pkt_id < num_dpkt) {
+            curr_dpkt = pkt_id;
+            continue;
+        }
+        lost = round_sent - newly;
+        cc_on_round(&cc, round_sent, newly, lost > 0 ? lost : 0, now_sec() - round_start);
 
-        /* Decode packet ID */
-        pkt_id = rec.data[0] << 8 | rec.data[1] << 0;
+        /* Loss before parity repair sets the parity rate, what is left after it would undersell the link */
+        if (round_sent > 0) {
+            loss = (1 - FEC_LOSS_EWMA)*loss + FEC_LOSS_EWMA*fmax(lost + rebuilt, 0) / round_sent;
+        }
         //printf("Pkt ID is %d\n", pkt_id);
-        printf("%f Percent...\n", (float) pkt_id * 100 / (float) num_dpkt);
+
+        /* Progress every 10000 frames acked rather than every ack */
+        if (pkt_id >= shown + 10000 && pkt_id < num_dpkt) {
+            printf("%f Percent...\n", (float) pkt_id * 100 / (float) num_dpkt);
+            shown = pkt_id;
+        }
     
         /* Server has all packets */
         if (pkt_id >= num_dpkt) {
             break;
         }
 
-        /* Server needs a packet */
-        if (pkt_id < num_dpkt) {
-            curr_dpkt = pkt_id;
-        } 
+        /* Server needs packets */
+        curr_dpkt = pkt_id;
+        round_sent = 0;
     }
 
+    free(fbuf);
+    free(acked);
+
     /* Send done and wait for server to agree */
     while(1) {
-        ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&done, 5);
         if (ret < 0) {
             warn("Done packet failure");
             continue;
         }
 
         /* Recieve done ack packet */
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("Didn't recieve done ack");
             continue;
         }
 
-        if (rec.oper == OPER_PUT && rec.func == PUT_DONE) {
-            printf("Completed put operation\n");
+        if (rec.xid == xid && rec.oper == OPER_PUT && rec.func == PUT_DONE) {
+
+            /* Server's checksum of what it wrote, missing if it had already let the transfer go */
+            if (rec.data[0] == 1 && get_u32(rec.data + 1) != crc) {
+                printf("Put operation FAILED, file checksum mismatch\n");
+                return -1;
+            }
+            if (rec.data[0] != 1) {
+                printf("Server no longer had the file checksum\n");
+            }
+            if (r == NULL) {
+                printf("Completed put operation\n");
+            }
+            return 0;
+        }
+    }
+}
+
+/* Thread of one stream, its own transfer ID and socket to the server */
+void *stream_run(void *arg) {
+    stream_t *st = (stream_t *) arg;
+
+    xid = st->xid;
+    serv_addr = st->addr;
+    sock_open();
+    if (st->oper == OPER_GET) {
+        st->ret = get_file(st->file, st->file, 0, &st->r);
+    } else {
+        st->ret = put_file(st->file, &st->r, 0);
+    }
+    close(sock);
+    free(rx_area);
+    free(tx_par);
+    return NULL;
+}
+
+/* Run a transfer as streams over ranges of the file cut at RANGE_ALIGN, returns how many failed */
+int run_streams(int oper, char *file, range_t *whole) {
+    stream_t st[MAX_STREAMS];
+    uint64_t step = 0;
+    int n = 0;
+    int failed = 0;
+
+    /* At most one range per stream, rounded up to whole units */
+    step = (whole->total + streams - 1) / streams;
+    step = (step + RANGE_ALIGN - 1) / RANGE_ALIGN * RANGE_ALIGN;
+    for (uint64_t off = 0; off < whole->total; off += step) {
+        st[n].oper = oper;
+        st[n].file = file;
+        st[n].r = *whole;
+        st[n].r.off = off;
+        st[n].r.len = (whole->total - off < step) ? whole->total - off : step;
+        st[n].xid = xid + n;
+        st[n].addr = serv_addr;
+        n++;
+    }
+    xid += n;
+    printf("Split over %d streams\n", n);
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&st[i].tid, NULL, stream_run, &st[i]) != 0) {
+            error("Error starting stream");
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(st[i].tid, NULL);
+        if (st[i].ret < 0) {
+            failed++;
+        }
+    }
+    return failed;
+}
+
+/* Get operation for client side, split over streams if asked for and the file is big enough */
+void get(char *file) {
+    range_t r;
+    FILE *f;
+    int failed = 0;
+
+    memset(&r, 0, sizeof(r));
+    if (streams == 1 || get_file(file, file, 0, &r) < 0 || r.total < 2*RANGE_ALIGN) {
+        get_file(file, file, 0, NULL);
+        return;
+    }
+
+    /* Size the file for the streams to write their ranges into */
+    f = fopen(file, "wb");
+    if (f == NULL || ftruncate(fileno(f), r.total) < 0) {
+        warn("Couldn't open file");
+        if (f != NULL) {
+            fclose(f);
+        }
+        return;
+    }
+    fclose(f);
+    ckpt_drop(file);
+
+    printf("File length is %" PRIu64 "\n", r.total);
+    failed = run_streams(OPER_GET, file, &r);
+    if (failed > 0) {
+        printf("Get operation FAILED, %d streams did not complete\n", failed);
+        return;
+    }
+    printf("Completed get operation\n");
+}
+
+/* Put operation for client side, split over streams if asked for and the file is big enough (a
+ * delta goes as one stream, it is coded against the whole file) */
+void put(char *file) {
+    range_t r;
+    struct stat st;
+    int failed = 0;
+
+    if (streams == 1 || delta || stat(file, &st) < 0 || st.st_size < 2*RANGE_ALIGN) {
+        put_file(file, NULL, delta);
+        return;
+    }
+    memset(&r, 0, sizeof(r));
+    r.total = st.st_size;
+    r.mtime = st.st_mtime;
+
+    failed = run_streams(OPER_PUT, file, &r);
+    if (failed > 0) {
+        printf("Put operation FAILED, %d streams did not complete\n", failed);
+        return;
+    }
+    printf("Completed put operation\n");
+}
+
+/* Add a copy of a name to a file list */
+void flist_add(flist_t *l, char *name) {
+    if (l->count == l->cap) {
+        l->cap = l->cap ? 2*l->cap : 64;
+        l->name = realloc(l->name, l->cap*sizeof(char *));
+        if (l->name == NULL) {
+            error("Could not make memory for file list");
+        }
+    }
+    l->name[l->count++] = strdup(name);
+}
+
+void flist_free(flist_t *l) {
+    for (int i = 0; i < l->count; i++) {
+        free(l->name[i]);
+    }
+    free(l->name);
+    memset(l, 0, sizeof(flist_t));
+}
+
+/* Add the files under a local directory to a list, recursively */
+void flist_walk(flist_t *l, char *dir) {
+    DIR *dr;
+    struct dirent *de;
+    struct stat st;
+    char path[CKPT_NAME];
+    size_t n = 0;
+
+    dr = opendir(dir);
+    if (dr == NULL) {
+        warn("Could not open directory");
+        return;
+    }
+    while ((de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        n = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (n >= DATA_SIZE - 64 || lstat(path, &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            flist_walk(l, path);
+        } else if (S_ISREG(st.st_mode)) {
+            flist_add(l, path);
+        }
+    }
+    closedir(dr);
+}
+
+/* Thread of a batch, moves the batch's files one at a time over its own socket (keeping its round
+ * trip estimate from file to file) until none are left */
+void *batch_run(void *arg) {
+    batch_t *b = (batch_t *) arg;
+    char *file;
+    int i = 0;
+    int ret = 0;
+
+    serv_addr = b->addr;
+    sock_open();
+    while (1) {
+        pthread_mutex_lock(&b->lock);
+        i = b->next++;
+        pthread_mutex_unlock(&b->lock);
+        if (i >= b->list->count) {
             break;
         }
+
+        file = b->list->name[i];
+        xid = b->xid + BATCH_XIDS*i;
+        if (b->oper == OPER_GET) {
+            ret = make_parents(file) < 0 ? -1 : get_file(file, file, 0, NULL);
+        } else {
+            ret = put_file(file, NULL, delta);
+        }
+        if (ret < 0) {
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+        }
+    }
+    close(sock);
+    free(rx_area);
+    free(tx_par);
+    return NULL;
+}
+
+/* Move every file of a list with up to batch_files in flight, prints how it went */
+void run_batch(int oper, flist_t *l) {
+    batch_t b;
+    pthread_t tid[MAX_STREAMS];
+    int n = (l->count < batch_files) ? l->count : batch_files;
+
+    if (l->count == 0) {
+        printf("No files to %s\n", oper == OPER_GET ? "get" : "put");
+        return;
+    }
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.lock, NULL);
+    b.list = l;
+    b.oper = oper;
+    b.xid = xid;
+    b.addr = serv_addr;
+    xid += BATCH_XIDS*l->count;
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&tid[i], NULL, batch_run, &b) != 0) {
+            error("Error starting stream");
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        pthread_join(tid[i], NULL);
+    }
+    pthread_mutex_destroy(&b.lock);
+
+    if (b.failed > 0) {
+        printf("Batch %s FAILED, %d of %d files did not complete\n", oper == OPER_GET ? "get" : "put", b.failed, l->count);
+        return;
+    }
+    printf("Completed batch %s of %d files\n", oper == OPER_GET ? "get" : "put", l->count);
+}
+
+/* Recursive get, fetches the list of files under a server directory then gets them as a batch */
+void rget(char *dir) {
+    flist_t l;
+    char tmp[64];
+    char *buf;
+    char *line;
+    char *save;
+    FILE *f;
+    long len = 0;
+
+    memset(&l, 0, sizeof(l));
+    snprintf(tmp, sizeof(tmp), ".tree.%d", (int) getpid());
+    if (get_file(dir, tmp, GET_TREE, NULL) < 0) {
+        remove(tmp);
+        printf("No files under %s\n", dir);
+        return;
+    }
+
+    /* One path per line, only ones under the current directory are taken */
+    f = fopen(tmp, "rb");
+    if (f == NULL) {
+        warn("Couldn't open file list");
+        return;
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(len + 1);
+    if (buf == NULL || fread(buf, 1, len, f) != (size_t) len) {
+        free(buf);
+        fclose(f);
+        remove(tmp);
+        return;
+    }
+    buf[len] = 0;
+    fclose(f);
+    remove(tmp);
+    for (line = strtok_r(buf, "\n", &save); line != NULL; line = strtok_r(NULL, "\n", &save)) {
+        if (!path_ok(line)) {
+            printf("Skipping %s, not under the current directory\n", line);
+            continue;
+        }
+        flist_add(&l, line);
     }
+    free(buf);
+
+    run_batch(OPER_GET, &l);
+    flist_free(&l);
+}
+
+/* Recursive put, puts the files under a local directory as a batch */
+void rput(char *dir) {
+    flist_t l;
 
+    memset(&l, 0, sizeof(l));
+    flist_walk(&l, dir);
+    run_batch(OPER_PUT, &l);
+    flist_free(&l);
 }
 
 void del(char *file) {
@@ -391,49 +3125,59 @@ void del(char *file) {
     int serv_len = 0;
     int ret = 0;
 
+    /* New transfer ID for this operation */
+    xid++;
+
     /* Create init packet */
     init.oper = OPER_DEL;
     init.func = DEL_INIT;
+    init.xid = xid;
     strcpy(init.data, file);
 
     /* Create done packet */
     done.oper = OPER_DEL;
     done.func = DEL_DONE;
+    done.xid = xid;
     done.data[0] = 0;
 
     /* Send init packet and wait for response */
     while (1) {
         serv_len = sizeof(serv_addr);
-        ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&init, strlen(file) + 1);
         if (ret < 0) {
             warn("Init packet failure in DEL");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No init packet from server, retransmitting");
             continue;
         }
+        if (rec.xid != xid || rec.oper != OPER_DEL || rec.func != DEL_INIT) {
+            continue;
+        }
 
         break;
     }
 
     /* Send done */
     while(1) {
-        ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&done, 0);
         if (ret < 0) {
             warn("Done packet failure");
             continue;
         }
 
         /* Recieve done ack packet */
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("Didn't recieve done ack");
             continue;
         }
 
-        if (rec.oper == OPER_GET && rec.func == GET_DONE) {
+        if (rec.xid == xid && rec.oper == OPER_GET && rec.func == GET_DONE) {
             if (rec.data[0] == 0) {
                 printf("Delete operation failed\n");
             } else {
@@ -452,74 +3196,113 @@ void ls() {
     msg_t rec;
     int serv_len = 0;
     int ret = 0;
+    uint32_t page = 0;
+    uint32_t cnt = 0;
+    uint32_t total = 0;
+    int more = 1;
+    int off;
+    time_t mtime;
+    char when[32];
+    char after[DATA_SIZE];
+
+    /* New transfer ID for this operation */
+    xid++;
 
     /* Create init packet */
     init.oper = OPER_LS;
     init.func = LS_INIT;
+    init.xid = xid;
     init.data[0] = 0;
 
     /* Create data request packet */
     d.oper = OPER_LS;
     d.func = LS_DATA;
+    d.xid = xid;
     d.data[0] = 0;
 
     /* Create done packet */
     done.oper = OPER_LS;
     done.func = LS_DONE;
+    done.xid = xid;
     done.data[0] = 0;
 
     /* Send init packet and wait for response */
     while (1) {
         serv_len = sizeof(serv_addr);
-        ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&init, 0);
         if (ret < 0) {
             warn("Init packet failure in LS");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No init packet from server, retransmitting");
             continue;
         }
+        if (rec.xid != xid || rec.oper != OPER_LS || rec.func != LS_INIT) {
+            continue;
+        }
 
+        total = get_u32(rec.data);
         break;
     }
-
-    /* Send data request and wait for data */
-    while (1) {
-        ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+    printf("Received contents of ls, %u entries:\n", total);
+
+    /* Ask for a page at a time, each after the last name seen, until the server has no more */
+    after[0] = 0;
+    while (more) {
+        put_u32(d.data, page);
+        strcpy((char *) d.data + 4, after);
+        ret = send_msg(&d, 4 + strlen(after) + 1);
         if (ret < 0) {
             warn("Data packet failture in LS");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No data packet from server, retransmitting request");
             continue;
         }
+        if (rec.xid != xid || rec.oper != OPER_LS || rec.func != LS_DATA ||
+            get_u32(rec.data) != page) {
+            continue;
+        }
 
-        if (rec.oper == OPER_LS && rec.func == LS_DATA) {
-            printf("Received contents of ls:\n%s\n", rec.data);
-            break;
+        /* Print the entries and remember where this page stopped */
+        more = rec.data[4];
+        cnt = get_u32(rec.data + 5);
+        off = LS_HDR;
+        for (uint32_t i = 0; i < cnt && off + LS_ENTRY < DATA_SIZE; i++) {
+            mtime = get_u64(rec.data + off + 8);
+            strftime(when, sizeof(when), "%Y-%m-%d %H:%M", localtime(&mtime));
+            rec.data[DATA_SIZE - 1] = 0;
+            printf("%12" PRIu64 "  %s  %s%s\n", get_u64(rec.data + off), when,
+                   (char *) rec.data + off + LS_ENTRY, rec.data[off + 16] ? "/" : "");
+            strcpy(after, (char *) rec.data + off + LS_ENTRY);
+            off += LS_ENTRY + strlen(after) + 1;
         }
+        page++;
     }
 
     /* Send done */
     while(1) {
-        ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&done, 0);
         if (ret < 0) {
             warn("Done packet failure");
             continue;
         }
 
         /* Recieve done ack packet */
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("Didn't recieve done ack");
             continue;
         }
 
-        if (rec.oper == OPER_LS && rec.func == LS_DONE) {
+        if (rec.xid == xid && rec.oper == OPER_LS && rec.func == LS_DONE) {
             printf("Completed ls operation\n");
             break;
         }
@@ -533,21 +3316,26 @@ void ex() {
     int ret = 0;
     int serv_len = 0; 
 
+    /* New transfer ID for this operation */
+    xid++;
+
     /* Create init packet */
     init.oper = OPER_EXIT;
     init.func = EXIT_INIT;
+    init.xid = xid;
 
     /* Send init packet and wait for response (try 5 times since there's no done) */
     while (count < 5) {
         count++;
         serv_len = sizeof(serv_addr);
-        ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, serv_len);
+        ret = send_msg(&init, 0);
         if (ret < 0) {
             warn("Init packet failure in EXIT");
             continue;
         }
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &serv_addr, &serv_len);
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
         if (ret < 0) {
+            rtt_backoff(&rtt);
             warn("No init packet from server, retransmitting");
             continue;
         }
@@ -562,34 +3350,139 @@ void ex() {
     }
 }
 
+/* Ask the server for its transfer stats, a line of key=value pairs (no state, so no done) */
+void stats() {
+    msg_t init;
+    msg_t rec;
+    int count = 0;
+    int ret = 0;
+    int serv_len = 0;
+
+    /* New transfer ID for this operation */
+    xid++;
+
+    /* Create init packet */
+    init.oper = OPER_STATS;
+    init.func = STATS_INIT;
+    init.xid = xid;
+
+    /* Send init packet and wait for the stats (give up after 5 tries, strays from earlier
+     * transfers don't count) */
+    while (count < 5) {
+        serv_len = sizeof(serv_addr);
+        ret = send_msg(&init, 0);
+        if (ret < 0) {
+            warn("Init packet failure in STATS");
+            count++;
+            continue;
+        }
+        ret = recv_msg(&rec, &serv_addr, &serv_len);
+        if (ret < 0) {
+            rtt_backoff(&rtt);
+            warn("No stats from server, retransmitting");
+            count++;
+            continue;
+        }
+        if (rec.xid != xid || rec.oper != OPER_STATS || rec.func != STATS_INIT) {
+            continue;
+        }
+
+        rec.data[DATA_SIZE - 1] = 0;
+        printf("Server stats: %s\n", rec.data);
+        return;
+    }
+    printf("Stats operation timed out\n");
+}
+
 int main(int argc, char **argv) {
     int serv_port = 0;
     char *serv_host;
     char *user_oper;
     char *user_arg;
-    char user_temp[64];
+    char user_temp[CMD_SIZE];
+    flist_t batch;
+    int opt = 0;
+
+    /* Parse options */
+    while ((opt = getopt(argc, argv, "c:w:b:gf:uds:m:M:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cc_algo = cc_parse(optarg);
+                if (cc_algo < 0) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'w':
+                if (atoi(optarg) < 1 || atoi(optarg) > RX_WINDOW_MAX) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                rx_window = atoi(optarg);
+                break;
+            case 'g':
+                offload = 1;
+                break;
+            case 'f':
+                fec_min = atof(optarg) / 100;
+                if (fec_min <= 0 || fec_min > 1.0 / FEC_MIN_GROUP) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'u':
+                compress = 0;
+                break;
+            case 'd':
+                delta = 1;
+                break;
+            case 's':
+                streams = atoi(optarg);
+                if (streams < 1 || streams > MAX_STREAMS) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                batch_files = atoi(optarg);
+                if (batch_files < 1 || batch_files > MAX_STREAMS) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'M':
+                mtu_max = atoi(optarg);
+                if (mtu_max < 1 || mtu_max > MTU_MAX) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > BATCH_MAX) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
 
     /* Parse server IP and port */
-    if (argc != 3) {
+    if (argc - optind != 2) {
         printf("%s", usage);
         exit(1);
     }
-    serv_host = argv[1];
-    serv_port = atoi(argv[2]);
+    serv_host = argv[optind];
+    serv_port = atoi(argv[optind + 1]);
 
-    /* Create socket */
-    sock = socket(AF_INET, SOCK_DGRAM, 0);
-    if (sock < 0) {
-        error("Error initializing socket\n");
-    }
+    /* Frame and file checksums */
+    crc_init();
 
-    /* Set socket recieve timeout (200ms) */
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        error("Error setting socket timeout");
-    }
+    /* Create socket */
+    sock_open();
 
     /* Build server address */
     bzero((char *) &serv_addr, sizeof(serv_addr));
@@ -599,13 +3492,19 @@ int main(int argc, char **argv) {
         error("Invalid host address\n");
     }
 
+    /* Start transfer IDs somewhere a restarted client won't reuse */
+    xid = (uint32_t) time(NULL) ^ ((uint32_t) getpid() << 16);
+
+    /* Size frames to the path */
+    pmtu_probe();
+
     /* Get operation from user */
     while (1) {
-        fgets(user_temp, 32, stdin);
+        fgets(user_temp, CMD_SIZE, stdin);
         
         /* Prevent empty input */
         if (strcmp("\n", user_temp) == 0) {
-            printf("Invalid option. Options are:\n\tget\n\tput\n\tdel\n\tls\n\texit\n");
+            printf("Invalid option. Options are:\n\tget\n\tput\n\tmget\n\tmput\n\trget\n\trput\n\tdel\n\tls\n\tstats\n\texit\n");
             continue;
         }
         
@@ -629,6 +3528,35 @@ int main(int argc, char **argv) {
             }
             printf("Sending 'put' command with file %s\n", user_arg);
             put(user_arg);
+        } else if (strcmp("mget", user_oper) == 0 || strcmp("mput", user_oper) == 0) {
+            memset(&batch, 0, sizeof(batch));
+            while ((user_arg = strtok(NULL, " \n\t\r")) != NULL) {
+                flist_add(&batch, user_arg);
+            }
+            if (batch.count == 0) {
+                printf("Needs arguments for files to %s\n", user_oper + 1);
+                continue;
+            }
+            printf("Sending '%s' command with %d files\n", user_oper, batch.count);
+            run_batch(user_oper[1] == 'g' ? OPER_GET : OPER_PUT, &batch);
+            flist_free(&batch);
+        } else if (strcmp("rget", user_oper) == 0 || strcmp("rput", user_oper) == 0) {
+            user_arg = strtok(NULL, " \n\t\r");
+            if (user_arg == NULL) {
+                printf("Needs an argument for directory to %s\n", user_oper + 1);
+                continue;
+            }
+
+            /* Paths under it are named without the trailing slash */
+            for (size_t n = strlen(user_arg); n > 1 && user_arg[n - 1] == '/'; n--) {
+                user_arg[n - 1] = 0;
+            }
+            printf("Sending '%s' command with directory %s\n", user_oper, user_arg);
+            if (user_oper[1] == 'g') {
+                rget(user_arg);
+            } else {
+                rput(user_arg);
+            }
         } else if (strcmp("del", user_oper) == 0) {
             user_arg = strtok(NULL, " \n\t\r");
             if (user_arg == NULL) {
@@ -640,11 +3568,14 @@ int main(int argc, char **argv) {
         } else if (strcmp("ls", user_oper) == 0) {
             printf("Sending 'ls' command\n");
             ls();
+        } else if (strcmp("stats", user_oper) == 0) {
+            printf("Sending 'stats' command\n");
+            stats();
         } else if (strcmp("exit", user_oper) == 0) {
             printf("Sending 'exit' command\n");
             ex();
         } else {
-            printf("Invalid option. Options are:\n\tget\n\tput\n\tdel\n\tls\n\texit\n");
+            printf("Invalid option. Options are:\n\tget\n\tput\n\tmget\n\tmput\n\trget\n\trput\n\tdel\n\tls\n\tstats\n\texit\n");
             continue;
         }
     }   
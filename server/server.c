@@ -9,46 +9,555 @@
  * UDP transfers.
  *************************************/
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdint.h>
+#include <errno.h>
+#include <stddef.h>
+#include <inttypes.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <dirent.h>
+#include <fcntl.h>
 #include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sched.h>
+#include <pthread.h>
+#include <signal.h>
 #include <netdb.h>
 #include <sys/types.h> 
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/inotify.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <linux/errqueue.h>
 #include <arpa/inet.h>
 
-/* Size of packet payload (for all packets, for simplicity) */
+/* Size of packet payload, the most any control packet carries and the data frames of a path that
+ * can't carry more */
 #define DATA_SIZE 1024
-#define FRAME_SIZE 1022
-#define MSG_SIZE  DATA_SIZE + 8
+
+/* Header on the wire (operation and function share a byte, then transfer ID and timestamps), and
+ * the largest control datagram, each datagram only carries the data bytes it uses */
+#define MSG_HDR   13
+#define MSG_SIZE  (DATA_SIZE + MSG_HDR)
+#define OPER_NONE 0xff
+
+/* Largest datagram a path gets probed for (a 9000 byte jumbo MTU less IP and UDP headers) and the
+ * payload that leaves */
+#define MTU_MAX   9000
+#define IP_UDP_HDR 28
+#define MSG_MAX   (MTU_MAX - IP_UDP_HDR)
+#define DATA_MAX  (MSG_MAX - MSG_HDR)
+
+/* Data frame header (32 bit frame ID, flags and a CRC32C of the frame) followed by file data, parity
+ * frames have the first frame ID of their group and the group size above the flags */
+#define FRAME_HDR  9
+#define FRAME_CRC  5
+#define FRAME_SIZE (DATA_SIZE - FRAME_HDR)
+#define FRAME_MAX  (DATA_MAX - FRAME_HDR)
+#define FRAME_POLL 0x01
+#define FRAME_FLAGS 1
+
+/* CRC32C (Castagnoli) polynomial, reflected */
+#define CRC_POLY 0x82f63b78
+
+/* Largest file the 32 bit frame IDs can address */
+#define MAX_FILE_LEN ((uint64_t) FRAME_SIZE * UINT32_MAX)
+
+/* Frames sent per burst and frames covered by a selective ack bitmap */
+#define BURST_SIZE 5000
+#define SACK_HDR   8
+#define SACK_BITS  ((DATA_SIZE - SACK_HDR) * 8)
+
+/* Congestion control, window limits in frames */
+#define CC_INIT_CWND  10
+#define CC_MIN_CWND   2
+#define CC_MAX_CWND   SACK_BITS
+#define CUBIC_C       0.4
+#define CUBIC_BETA    0.7
+#define BBR_BW_ROUNDS 10
+#define BBR_RTT_WIN   10.0
+#define BBR_HIGH_GAIN 2.885
+#define BBR_CWND_GAIN 2.0
+#define BBR_CYCLE_LEN 8
+
+/* Default and largest receive window in frames, bounds reassembly memory */
+#define RX_WINDOW     16384
+#define RX_WINDOW_MAX 262144
+
+/* Parity groups, most and fewest frames per group and how hard the parity rate chases loss */
+#define FEC_MIN_GROUP 2
+#define FEC_MAX_GROUP 100
+#define FEC_LOSS_GAIN 2.0
+#define FEC_LOSS_EWMA 0.125
+
+/* Mapped file pages are released behind the ack point in chunks of this size */
+#define MAP_DROP_SIZE (8 << 20)
+
+/* Compression, the file is cut into blocks coded on their own, each behind a length header
+ * (high bit set if the block is stored as is), and the resulting stream is sent as frames */
+#define COMP_BLOCK   65536
+#define COMP_HDR     4
+#define COMP_STORED  0x80000000
+#define COMP_SAMPLES 8
+#define COMP_KEEP    0.9
+#define COMP_MAX_LEN ((uint64_t) 256 << 20)
+#define LZ_MIN_MATCH 4
+#define LZ_HASH_BITS 12
+
+/* Delta PUT: GET flag asking for block signatures instead of the file, and copy records in a delta
+ * stream (a run of whole blocks of the server's copy, then the index of the first). Signatures are
+ * the block size, file size and mtime, then a weak rolling checksum and strong hash per whole block */
+#define GET_SIGS        0x80
+#define DELTA_COPY      0x40000000
+#define DELTA_REF       4
+#define DELTA_MIN_BLOCK 2048
+#define SIG_HDR         20
+#define SIG_ENTRY       12
+#define HASH_MUL        0xc6a4a7935bd1e995ULL
+
+/* Parallel transfers: GET flag for one stream's byte range (offset, length) of the file, a range of
+ * length 0 only asks for the file size */
+#define GET_RANGE  0x40
+#define RANGE_SIZE 16
+
+/* Recursive GET: flag for the list of files under a directory in place of a file */
+#define GET_TREE   0x20
+
+/* Resume state sent at INIT: file size, mtime, length sent, codec, frames already held and their size */
+#define RESUME_SIZE 33
+
+/* Checkpoint sidecar kept beside a partial file: resume state, bytes written, their checksum and
+ * the partial compressed block, saved every CKPT_BYTES of progress */
+#define CKPT_HDR    (RESUME_SIZE + 16)
+#define CKPT_NAME   (DATA_SIZE + 16)
+#define CKPT_BYTES  (8 << 20)
+
+/* Paged LS: page header (request number, more to come, entries in page), then per entry size,
+ * mtime and a directory flag ahead of the name, and room to read inotify events in */
+#define LS_HDR      9
+#define LS_ENTRY    17
+#define DIR_EVBUF   65536
+
+/* Datagrams moved per sendmmsg/recvmmsg call by default and at most */
+#define BATCH_SIZE 32
+#define BATCH_MAX  256
+
+/* UDP offload, frames per segmented send, most bytes one can carry and size of a coalesced receive */
+#define GSO_FRAMES   63
+#define GSO_BYTES    (65535 - IP_UDP_HDR)
+#define GRO_BUF_SIZE 65536
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT  103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO      104
+#endif
+
+/* Zero-copy sends, header slots in flight, unmaps that can wait and how long to wait */
+#define ZC_RING    16384
+#define ZC_HDR     (MSG_HDR + FRAME_HDR)
+#define ZC_GSO_FRAMES 4
+#define ZC_MAPS    64
+#define ZC_PROBE   64
+#define ZC_WAIT_MS 10
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+
+/* Socket buffer size asked for, the kernel caps it at rmem_max/wmem_max */
+#define SOCK_BUF_SIZE (4 << 20)
+
+/* Most transfers in progress at once */
+#define MAX_SESSIONS   4096
+#define SESS_HASH_BITS 13
+#define SESS_HASH      (1 << SESS_HASH_BITS)
+
+/* Timer wheel, each level has WHEEL_SLOTS slots and a level 0 slot is one tick */
+#define WHEEL_TICK   0.001
+#define WHEEL_BITS   8
+#define WHEEL_SLOTS  (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 3
+
+/* Most worker threads for -t */
+#define MAX_WORKERS 64
+
+/* Transfer stats, RTT histogram bucket i counts RTTs under RTT_HIST_BASE*2^i seconds (the last
+ * one everything longer) */
+#define RTT_BUCKETS   16
+#define RTT_HIST_BASE 0.0001
+
+/* Hot file cache, default budget in MB (-m) shared out between the workers, and hash buckets */
+#define HOT_MB        256
+#define HOT_HASH_BITS 10
+#define HOT_HASH      (1 << HOT_HASH_BITS)
+
+/* Messages handled per wakeup before timers get a turn */
+#define RX_BUDGET 1024
+
+/* Blocks of a GET's compressed copy (or file blocks signed) per turn of the event loop, so other
+ * transfers are never held up by a big file */
+#define PREP_BLOCKS 8
+
+/* Retransmission timeout before the first RTT sample, least margin over the RTT and cap, in seconds */
+#define RTO_INIT 0.2
+#define RTO_MIN  0.005
+#define RTO_MAX  2.0
+
+/* Give up on a peer after this long without hearing from it */
+#define PEER_TIMEOUT 10.0
 
 /* Codes for operations and packet functions for each operation */
-enum oper_e {OPER_GET  = 0, OPER_PUT, OPER_DEL, OPER_LS, OPER_EXIT};
-enum get_e  {GET_INIT  = 0, GET_DATA, GET_DONE};
-enum put_e  {PUT_INIT  = 0, PUT_DATA, PUT_DONE};
+enum oper_e {OPER_GET  = 0, OPER_PUT, OPER_DEL, OPER_LS, OPER_EXIT, OPER_PROBE, OPER_STATS};
+enum get_e  {GET_INIT  = 0, GET_DATA, GET_DONE, GET_SACK, GET_PARITY};
+enum put_e  {PUT_INIT  = 0, PUT_DATA, PUT_DONE, PUT_SACK, PUT_PARITY};
 enum del_e  {DEL_INIT  = 0, DEL_DONE};
 enum ls_e   {LS_INIT   = 0, LS_DATA,  LS_DONE};
 enum exit_e {EXIT_INIT = 0};
+enum probe_e {PROBE_INIT = 0};
+enum stats_e {STATS_INIT = 0};
+enum comp_e {COMP_NONE = 0, COMP_LZ, COMP_DELTA};
+enum prep_e {PREP_NONE = 0, PREP_SIGS, PREP_LZ};
+
+/* Word of a frame bitmap and words needed for n frames */
+typedef uint64_t bits_t;
+#define BITS_WORDS(n) (((uint64_t) (n) + 63) / 64)
+
+/* Decoder for a compressed stream, the block being gathered and what it decodes to, and for a
+ * delta the copy it refers to */
+typedef struct zdec_s {
+    size_t   have;
+    uint8_t  buf[COMP_HDR + COMP_BLOCK];
+    uint8_t  out[COMP_BLOCK];
+    uint8_t  *basis;
+    uint64_t basis_len;
+    uint32_t block;
+} zdec_t;
+
+/* Receiver progress on a file, what it is a copy of and how far it got */
+typedef struct ckpt_s {
+    uint64_t raw_len;
+    uint64_t mtime;
+    uint64_t wire_len;
+    uint32_t codec;
+    uint32_t frames;
+    uint32_t frame;
+    uint64_t out_len;
+    uint32_t crc;
+    uint32_t have;
+} ckpt_t;
 
 /* Message structure */
 typedef struct msg_s {
     uint32_t oper;
     uint32_t func;
-    uint8_t  data[DATA_SIZE];
+    uint32_t xid;
+    uint32_t ts;
+    uint32_t ts_echo;
+    uint8_t  data[DATA_MAX + 1];
 } msg_t;
 
+/* Round trip estimate for a peer, and the peer's last timestamp to echo back */
+typedef struct rtt_s {
+    double   srtt;
+    double   rttvar;
+    double   rto;
+    uint32_t peer_ts;
+    uint32_t peer_at;
+} rtt_t;
+
+/* Congestion control algorithms and BBR states */
+enum cc_e   {CC_FIXED  = 0, CC_AIMD, CC_CUBIC, CC_BBR, CC_COUNT};
+enum bbr_e  {BBR_STARTUP = 0, BBR_DRAIN, BBR_PROBE_BW};
+
+/* Congestion control state for one transfer */
+typedef struct cc_s {
+    int    algo;
+    double cwnd;
+    double ssthresh;
+    double w_max;
+    double w_est;
+    double k;
+    double epoch;
+    double bw[BBR_BW_ROUNDS];
+    double max_bw;
+    double full_bw;
+    double min_rtt;
+    double min_rtt_stamp;
+    int    round;
+    int    full_cnt;
+    int    mode;
+    int    cycle;
+} cc_t;
+
+/* Hot file cache entry, a ready-to-send copy of a file (its own mapping kept resident, or a
+ * compressed copy if the client takes that and it pays), the inode it was made from and the
+ * file checksum once a GET has summed it, shared by every GET of the file while it is current */
+typedef struct hot_s {
+    char     *name;
+    int      lz;
+    char     *buf;
+    uint64_t len;
+    uint64_t raw_len;
+    uint64_t mtime;
+    uint64_t ino;
+    struct timespec ctime;
+    uint32_t crc;
+    int      crc_ok;
+    int      codec;
+    int      refs;
+    int      listed;
+    struct hot_s *h_next;
+    struct hot_s *prev;
+    struct hot_s *next;
+} hot_t;
+
+/* Transfer counters, for a session and summed over them for its worker (all 64 bit, so they can
+ * be added up as an array), only the owning worker writes them but a worker's totals are summed
+ * by whichever worker answers a STATS query, so those are added to and read atomically */
+typedef struct stats_s {
+    uint64_t sessions;
+    uint64_t active;
+    uint64_t abandoned;
+    uint64_t frames_sent;
+    uint64_t frames_resent;
+    uint64_t parity_sent;
+    uint64_t bytes_sent;
+    uint64_t timeouts;
+    uint64_t frames_recv;
+    uint64_t frames_dup;
+    uint64_t frames_bad;
+    uint64_t frames_range;
+    uint64_t parity_recv;
+    uint64_t frames_rebuilt;
+    uint64_t bytes_recv;
+    uint64_t rtt_hist[RTT_BUCKETS];
+} stats_t;
+
+/* One transfer, keyed by client address and transfer ID */
+typedef struct sess_s {
+    int      used;
+    struct sockaddr_in addr;
+    uint32_t xid;
+    uint32_t oper;
+    double   heard;
+    rtt_t    rtt;
+    struct sess_s *h_next;
+    struct sess_s *t_next;
+    struct sess_s *t_prev;
+    struct sess_s **t_slot;
+    uint64_t t_expire;
+    msg_t    d;
+    char     *fbuf;
+    uint64_t file_len;
+    uint32_t frame;
+    uint32_t num_dpkt;
+    uint32_t curr_dpkt;
+
+    /* Checksum of the file so far, GET folds it in as the client acks */
+    uint32_t crc;
+    uint64_t crc_len;
+
+    /* File size, mtime and codec, what a resumed transfer has to match, and for one stream of a
+     * parallel transfer the size of the whole file it has a range of */
+    uint64_t raw_len;
+    uint64_t mtime;
+    int      codec;
+    uint64_t total;
+    int      ranged;
+
+    /* GET, mapped file (or its compressed copy, or the cached copy it is sent from) and what the
+     * client has acked */
+    hot_t    *hot;
+    uint64_t dropped;
+    bits_t   *acked;
+    uint32_t rwnd;
+    int      round_sent;
+    double   round_start;
+    double   loss;
+    cc_t     cc;
+
+    /* GET, the copy to send being built from src a few blocks per turn of the event loop, the
+     * saved INIT is answered once it is ready */
+    int      prep;
+    char     *src;
+    uint64_t src_off;
+    msg_t    *pend;
+    int      keep;
+    struct stat src_st;
+    struct sess_s *p_next;
+
+    /* PUT, reassembly window, output file and where it was last checkpointed */
+    FILE     *f;
+    zdec_t   *z;
+    bits_t   *pkt_arr;
+    uint32_t high_dpkt;
+    int      rebuilt;
+    char     *name;
+    uint32_t ckpt_dpkt;
+
+    /* Delta PUT, the copy being replaced once the file rebuilt from it checks out */
+    char     *dest;
+
+    /* DEL, -1 until the delete has been tried */
+    int      success;
+
+    /* What the transfer has cost so far, when it started, how far GET rounds have reached and
+     * whether both ends have agreed it is done */
+    stats_t  st;
+    double   started;
+    uint32_t sent_high;
+    int      complete;
+} sess_t;
+
+/* Count n more of a stat for a session and for its worker, the worker's totals are read by other
+ * workers answering a STATS query so they are only touched atomically */
+#define STAT_ADD(s, f, n) ((s)->st.f += (n), __atomic_fetch_add(&stats.f, (n), __ATOMIC_RELAXED))
+#define STAT_INC(f, n) __atomic_fetch_add(&stats.f, (n), __ATOMIC_RELAXED)
+
+/* Operation names for log messages */
+char *oper_names[] = {"GET", "PUT", "DEL", "LS", "EXIT", "PROBE", "STATS"};
+
+/* Names for the -c option and BBR pacing gain cycle */
+char *cc_names[CC_COUNT] = {"fixed", "aimd", "cubic", "bbr"};
+double bbr_cycle[BBR_CYCLE_LEN] = {1.25, 0.75, 1, 1, 1, 1, 1, 1};
+int cc_algo = CC_CUBIC;
+uint32_t rx_window = RX_WINDOW;
+int batch_size = BATCH_SIZE;
+
+/* Least parity per data frame we send (-f), 0 for none */
+double fec_min = 0;
+
+/* CRC32C tables for the software path, and whether the CPU has the instruction */
+uint32_t crc_table[8][256];
+int crc_hw = 0;
+int offload = 0;
+int zerocopy = 0;
+int workers = 1;
+
+/* Bytes of hot file cache (-m), each worker keeps its share */
+uint64_t hot_budget = (uint64_t) HOT_MB << 20;
+
+/* Stats of this worker, every worker's for a STATS query to add up, and seconds between dumps
+ * (-S, 0 for none) */
+__thread stats_t stats;
+__thread int worker_id = 0;
+__thread int stats_fd = -1;
+stats_t *worker_stats[MAX_WORKERS];
+int stats_every = 0;
+
+/* Page size, for the fault handler */
+uintptr_t page_size = 4096;
+
+/* Offload state of this thread's socket */
+__thread int gso_on = 0;
+__thread int gro_on = 0;
+
 /* Usage message */
-char usage[128] = "server <port>\n";
+char usage[192] = "server [-c fixed|aimd|cubic|bbr] [-w window_frames] [-b batch_frames] [-g] [-z] [-t threads] [-f fec_percent] [-m cache_mb] [-S stats_secs] <port>\n";
 
-/* Socket parameters */
-int sock = 0;
+/* Socket parameters, each worker thread has its own socket on the port */
+__thread int sock = 0;
 struct sockaddr_in serv_addr;
-struct sockaddr_in client_addr;
-int client_len = 0;
+__thread struct sockaddr_in client_addr;
+__thread int client_len = 0;
+
+/* Session table, hash chains by client address and transfer ID, and freed slots (per worker) */
+__thread sess_t *sessions;
+__thread sess_t *sess_hash[SESS_HASH];
+__thread sess_t *sess_idle = NULL;
+__thread int sess_top = 0;
+
+/* Session timers, wheel[level][slot] lists sessions expiring in that slot (per worker) */
+__thread sess_t *wheel[WHEEL_LEVELS][WHEEL_SLOTS];
+__thread uint64_t wheel_now = 0;
+__thread int wheel_armed = 0;
+__thread int wheel_ticking = 0;
+__thread int timer_fd = -1;
+
+/* Transmit batch, per frame headers with payloads in the file mapping */
+__thread struct mmsghdr tx_mmsg[BATCH_MAX];
+__thread struct iovec tx_iov[BATCH_MAX][2];
+__thread uint8_t tx_hdr[BATCH_MAX][MSG_HDR + FRAME_HDR];
+__thread uint8_t *tx_par;
+__thread struct mmsghdr tx_gso[BATCH_MAX];
+__thread union {
+    char buf[CMSG_SPACE(sizeof(uint16_t))];
+    struct cmsghdr align;
+} tx_gso_cmsg[BATCH_MAX];
+__thread uint32_t tx_frame = FRAME_SIZE;
+__thread int tx_cnt = 0;
+__thread uint64_t tx_bytes = 0;
+__thread uint64_t tx_parity = 0;
+
+/* Receive batch, handed out one message at a time by recv_msg (a slot may hold a coalesced run) */
+__thread struct mmsghdr rx_mmsg[BATCH_MAX];
+__thread struct iovec rx_iov[BATCH_MAX];
+__thread struct sockaddr_in rx_addr[BATCH_MAX];
+__thread union {
+    char buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr align;
+} rx_cmsg[BATCH_MAX];
+__thread uint8_t *rx_area;
+__thread int rx_slot = MSG_MAX;
+__thread int rx_cnt = 0;
+__thread int rx_next = 0;
+__thread int rx_off = 0;
+
+/* Zero-copy header ring, a slot is 2 while queued, 1 until the kernel is done with it, then 0 */
+__thread int zc_on = 0;
+__thread uint8_t *zc_hdr;
+__thread uint32_t *zc_id;
+__thread char *zc_busy;
+__thread uint32_t zc_head = 0;
+__thread uint32_t zc_tail = 0;
+__thread uint32_t zc_next = 0;
+__thread int zc_reports = 0;
+__thread int zc_copied = 0;
+__thread int tx_zc = 0;
+__thread uint32_t tx_zc_first = 0;
+
+/* File mappings still referenced by zero-copy sends, unmapped after send ID last completes */
+typedef struct zc_map_s {
+    char     *buf;
+    uint64_t len;
+    uint32_t last;
+} zc_map_t;
+__thread zc_map_t zc_maps[ZC_MAPS];
+__thread int zc_nmaps = 0;
+
+/* Directory index for LS, sorted by name and kept current from inotify rather than rescanned
+ * (per worker, built on the first listing and dropped if the event queue overflows) */
+typedef struct dent_s {
+    char     *name;
+    uint64_t size;
+    uint64_t mtime;
+    uint8_t  dir;
+} dent_t;
+__thread dent_t *dir_ent = NULL;
+__thread int dir_cnt = 0;
+__thread int dir_cap = 0;
+__thread int dir_ready = 0;
+__thread int dir_fd = -1;
+
+/* GETs with a copy to build, taken in turn */
+__thread sess_t *prep_head = NULL;
+__thread sess_t *prep_tail = NULL;
+
+/* Hot file cache, chains by name and a list from most to least recently sent (per worker) */
+__thread hot_t *hot_hash[HOT_HASH];
+__thread hot_t *hot_head = NULL;
+__thread hot_t *hot_tail = NULL;
+__thread uint64_t hot_bytes = 0;
 
 /* Error handler */
 void error(char *msg) {
@@ -61,306 +570,2938 @@ void warn(char *msg) {
     perror(msg);
 }
 
-/* Get operation server side */
-void get(msg_t *rec) {
-    int ret = 0;
-    msg_t init;
-    msg_t d;
-    msg_t done;
-    int file_len = 0;
-    FILE *f;   
-    char *fbuf;
-    int num_dpkt = 0;
-    int curr_dpkt = 0;
- 
-    /* Create init response */
-    init.oper = OPER_GET;
-    init.func = GET_INIT;
-    init.data[0] = 0;
+/* Big endian field helpers for the wire format */
+void put_u32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v >> 0;
+}
 
-    /* Create data response */
-    d.oper = OPER_GET;
-    d.func = GET_DATA;
-    d.data[0] = 0;
+uint32_t get_u32(uint8_t *p) {
+    return (uint32_t) p[0] << 24 | (uint32_t) p[1] << 16 |
+           (uint32_t) p[2] << 8  | (uint32_t) p[3] << 0;
+}
 
-    /* Create done packet */
-    done.oper = OPER_GET;
-    done.func = GET_DONE;  
-    done.data[0] = 0;
+void put_u64(uint8_t *p, uint64_t v) {
+    put_u32(p, v >> 32);
+    put_u32(p + 4, v);
+}
 
-    while(1) { 
+uint64_t get_u64(uint8_t *p) {
+    return (uint64_t) get_u32(p) << 32 | get_u32(p + 4);
+}
 
-        /* Send init response  with file size */
-        if (rec->oper == OPER_GET  && rec->func == GET_INIT) {
-            printf("Received GET init\n");
-//            printf("Filename is %s\n",rec->data);
+/* Message header to and from the wire */
+void wire_put(uint8_t *p, msg_t *m) {
+    p[0] = m->oper << 4 | m->func;
+    put_u32(p + 1, m->xid);
+    put_u32(p + 5, m->ts);
+    put_u32(p + 9, m->ts_echo);
+}
 
-            /* Open file buffer */
-            f = fopen(rec->data, "r");
-            if (f == NULL) {
-                warn("Couldn't open file");
-                file_len = 0;
-                init.data[0] = file_len >> 24;
-                init.data[1] = file_len >> 16;
-                init.data[2] = file_len >> 8;
-                init.data[3] = file_len >> 0;
+/* Read a datagram of n bytes into a message, control data it didn't carry reads as zeros and one
+ * too short for a header matches no operation */
+void wire_get(msg_t *m, uint8_t *p, int n) {
+    if (n < MSG_HDR) {
+        m->oper = OPER_NONE;
+        m->func = 0;
+        return;
+    }
+    m->oper = p[0] >> 4;
+    m->func = p[0] & 0x0f;
+    m->xid = get_u32(p + 1);
+    m->ts = get_u32(p + 5);
+    m->ts_echo = get_u32(p + 9);
+    n -= MSG_HDR;
+    memcpy(m->data, p + MSG_HDR, n);
+    if (n < DATA_SIZE) {
+        memset(m->data + n, 0, DATA_SIZE - n);
+    }
 
-                ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                break;
-            }
+    /* A name that fills the datagram still ends inside the message */
+    m->data[n] = 0;
+}
 
-            /* Get file size */
-            fseek(f, 0, SEEK_END);
-            file_len = ftell(f);
-            fseek(f, 0, SEEK_SET);
-           
-//            printf("file len is %d\n", file_len);
+/* Send a message carrying len bytes of data, header and data go out as they are */
+int msg_send(msg_t *m, int len, struct sockaddr_in *to) {
+    uint8_t hdr[MSG_HDR];
+    struct iovec iov[2];
+    struct msghdr mh;
 
-            /* Load file (round up to a frame) */ 
-            fbuf = malloc(file_len - (file_len % FRAME_SIZE) + FRAME_SIZE);
-            fread(fbuf, file_len, 1, f);
-            fclose(f);
+    wire_put(hdr, m);
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = MSG_HDR;
+    iov[1].iov_base = m->data;
+    iov[1].iov_len = len;
+    memset(&mh, 0, sizeof(mh));
+    mh.msg_name = to;
+    mh.msg_namelen = sizeof(struct sockaddr_in);
+    mh.msg_iov = iov;
+    mh.msg_iovlen = 2;
+    return sendmsg(sock, &mh, 0);
+}
 
-            /* Calculate number of packets */
-            num_dpkt = (file_len + (FRAME_SIZE - 1)) / FRAME_SIZE;
-            curr_dpkt = 0;
-    
-            /* Set file size */
-            init.data[0] = file_len >> 24;
-            init.data[1] = file_len >> 16;
-            init.data[2] = file_len >> 8;
-            init.data[3] = file_len >> 0;
-
-            /* Send init response */
-            ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Init response failure in GET");
-                free(fbuf);
-                continue;
-            }
+/* Frame sets, one bit per frame packed into 64 bit words */
+bits_t *bits_new(uint64_t n) {
+    return calloc(BITS_WORDS(n), sizeof(bits_t));
+}
+
+int bits_test(bits_t *b, uint64_t i) {
+    return (b[i >> 6] >> (i & 63)) & 1;
+}
+
+void bits_set(bits_t *b, uint64_t i) {
+    b[i >> 6] |= 1ULL << (i & 63);
+}
+
+/* First clear bit in [from, to), or to if there is none, a word at a time */
+uint64_t bits_ffz(bits_t *b, uint64_t from, uint64_t to) {
+    uint64_t w = 0;
+
+    while (from < to) {
+        w = ~b[from >> 6] >> (from & 63);
+        if (w != 0) {
+            from += __builtin_ctzll(w);
+            return (from < to) ? from : to;
         }
+        from = (from | 63) + 1;
+    }
+    return to;
+}
 
-        /* Request for missing packet */
-        if (rec->oper == OPER_GET  && rec->func == GET_DATA) {
-            curr_dpkt = rec->data[0] << 8 | rec->data[1] << 0;
-            //printf("Pkt ID is %d\n", curr_dpkt);
+/* First set bit in [from, to), or to if there is none, a word at a time */
+uint64_t bits_ffs(bits_t *b, uint64_t from, uint64_t to) {
+    uint64_t w = 0;
 
-            /* Send next 5000 packets */
-            for (int i = curr_dpkt; i < curr_dpkt + 5000; i++) {
-                if (i < num_dpkt) {
-                    d.data[0] = i >> 8;
-                    d.data[1] = i >> 0;
-                    memcpy(d.data + 2, fbuf + FRAME_SIZE*i, FRAME_SIZE);
-                    ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                    if (ret < 0) {
-                        warn("Data response failure in GET");
-                    }
-                }
-            }
+    while (from < to) {
+        w = b[from >> 6] >> (from & 63);
+        if (w != 0) {
+            from += __builtin_ctzll(w);
+            return (from < to) ? from : to;
         }
+        from = (from | 63) + 1;
+    }
+    return to;
+}
 
-        /* Agree that we are done */
-        if  (rec->oper == OPER_GET && rec->func == GET_DONE) {
-            ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Done response failure in GET");
-            }
+/* Set or clear bits [from, to), returns how many actually changed */
+uint64_t bits_fill(bits_t *b, uint64_t from, uint64_t to, int on) {
+    uint64_t mask = 0;
+    uint64_t n = 0;
+    uint64_t end = 0;
 
-            /* Can break out of loop since another GET DONE from client puts us back in loop */
-            break;
+    while (from < to) {
+        end = (from | 63) + 1;
+        if (end > to) {
+            end = to;
+        }
+        mask = (end - from == 64) ? ~0ULL : ((1ULL << (end - from)) - 1) << (from & 63);
+        if (on) {
+            n += __builtin_popcountll(~b[from >> 6] & mask);
+            b[from >> 6] |= mask;
+        } else {
+            n += __builtin_popcountll(b[from >> 6] & mask);
+            b[from >> 6] &= ~mask;
         }
+        from = end;
+    }
+    return n;
+}
 
-        /* Get packet from client */
-        ret = recvfrom(sock, rec, MSG_SIZE, 0 , (struct sockaddr *) &client_addr, &client_len);
-        if (ret < 0) {
-            continue;
+/* Fill the software CRC32C tables and see if the CPU can do it instead */
+void crc_init() {
+    uint32_t c = 0;
+
+    for (int n = 0; n < 256; n++) {
+        c = n;
+        for (int k = 0; k < 8; k++) {
+            c = (c & 1) ? (c >> 1) ^ CRC_POLY : c >> 1;
+        }
+        crc_table[0][n] = c;
+    }
+    for (int n = 0; n < 256; n++) {
+        c = crc_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            c = crc_table[0][c & 0xff] ^ (c >> 8);
+            crc_table[k][n] = c;
         }
     }
+#if defined(__x86_64__)
+    crc_hw = __builtin_cpu_supports("sse4.2");
+#endif
 }
 
-void put(msg_t *rec) {
-    msg_t init;
-    msg_t d;
-    msg_t done;
-    int ret = 0;
-    FILE *f = NULL;
-    char *fbuf = NULL;
-    int file_len = 0;
-    int num_dpkt = 0;
-    int curr_dpkt = 0;
-    int pkt_id = 0;
-    char filename[64];
-    int data_flag = 0;
-    int cnt = 0;
-    char *pkt_arr = NULL;
+/* CRC32C eight bytes at a time with the SSE4.2 instruction */
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32c_hw(uint32_t crc, uint8_t *p, size_t len) {
+    uint64_t c = crc;
+    uint64_t w = 0;
 
-    /* Create init response */
-    init.oper = OPER_PUT;
-    init.func = PUT_INIT;
-    init.data[0] = 0;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        c = __builtin_ia32_crc32di(c, w);
+    }
+    for (; len > 0; len--) {
+        c = __builtin_ia32_crc32qi(c, *p++);
+    }
+    return c;
+}
+#endif
 
-    /* Create data response */
-    d.oper = OPER_PUT;
-    d.func = PUT_DATA;
-    d.data[0] = 0;
+/* CRC32C eight bytes at a time from the tables (slicing by 8, little endian words) */
+uint32_t crc32c_sw(uint32_t crc, uint8_t *p, size_t len) {
+    uint64_t w = 0;
 
-    /* Create done packet */
-    done.oper = OPER_PUT;
-    done.func = PUT_DONE;
-    done.data[0] = 0;
+    for (; len >= 8; len -= 8, p += 8) {
+        memcpy(&w, p, 8);
+        w ^= crc;
+        crc = crc_table[7][w & 0xff] ^ crc_table[6][(w >> 8) & 0xff] ^
+              crc_table[5][(w >> 16) & 0xff] ^ crc_table[4][(w >> 24) & 0xff] ^
+              crc_table[3][(w >> 32) & 0xff] ^ crc_table[2][(w >> 40) & 0xff] ^
+              crc_table[1][(w >> 48) & 0xff] ^ crc_table[0][w >> 56];
+    }
+    for (; len > 0; len--) {
+        crc = crc_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return crc;
+}
 
-    while(1) {
+/* Extend a CRC32C over len more bytes, start from 0 */
+uint32_t crc32c(uint32_t crc, uint8_t *p, size_t len) {
+    crc = ~crc;
+#if defined(__x86_64__)
+    if (crc_hw) {
+        return ~crc32c_hw(crc, p, len);
+    }
+#endif
+    return ~crc32c_sw(crc, p, len);
+}
 
-        /* Send init response and malloc memory for file */
-        if (rec->oper == OPER_PUT  && rec->func == PUT_INIT) {
-            printf("Received PUT init\n");
-            //printf("Filename is %s\n",rec->data+4);
+/* Checksum of a data or parity frame, its ID and flags then the bytes it carries */
+uint32_t frame_crc(uint8_t *hdr, uint8_t *payload, size_t len) {
+    return crc32c(crc32c(0, hdr, FRAME_CRC), payload, len);
+}
 
-            /* Open file buffer */
-            strcpy(filename, rec->data+4);
-            if (f == NULL) {
-                f = fopen(filename, "wb");
-            }
-            if (f == NULL) {
-                warn("Couldn't open file");
-                init.data[0] = 0;
-                init.data[1] = 0;
-                init.data[2] = 0;
-                init.data[3] = 0;
-                ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                break;
-            }
+/* 1 if a received frame matches its checksum */
+int frame_ok(uint8_t *data, size_t len) {
+    return get_u32(data + FRAME_CRC) == frame_crc(data, data + FRAME_HDR, len);
+}
 
-            /* Get file size */
-            file_len = rec->data[0] << 24 | rec->data[1] << 16 |
-                       rec->data[2] <<  8 | rec->data[3] << 0; 
+/* rsync style weak checksum of a block, the byte sum in the low half and the position weighted sum
+ * above it, sums are left in a and b for rolling */
+uint32_t weak_sum(uint8_t *p, size_t len, uint32_t *a, uint32_t *b) {
+    *a = 0;
+    *b = 0;
+    for (size_t i = 0; i < len; i++) {
+        *a += p[i];
+        *b += (len - i) * p[i];
+    }
+    return (*a & 0xffff) | (*b << 16);
+}
 
-            /* Allocate memory for file */
-            if (fbuf == NULL) {
-                fbuf = malloc(file_len - (file_len % FRAME_SIZE) + FRAME_SIZE);
-            }
+/* Strong block hash (MurmurHash64A) */
+uint64_t hash64(uint8_t *p, size_t len) {
+    uint64_t h = len * HASH_MUL;
+    uint64_t k = 0;
+    size_t i = 0;
 
-            /* Calculate number of packets */
-            num_dpkt = (file_len + (FRAME_SIZE - 1)) / FRAME_SIZE;
-            curr_dpkt = 0;
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&k, p + i, 8);
+        k *= HASH_MUL;
+        k ^= k >> 47;
+        k *= HASH_MUL;
+        h ^= k;
+        h *= HASH_MUL;
+    }
+    if (i < len) {
+        k = 0;
+        memcpy(&k, p + i, len - i);
+        h ^= k;
+        h *= HASH_MUL;
+    }
+    h ^= h >> 47;
+    h *= HASH_MUL;
+    h ^= h >> 47;
+    return h;
+}
 
-            /* Allocate packet array */
-            if (pkt_arr == NULL) {
-                pkt_arr = calloc(num_dpkt + 1, sizeof(char));
-            }
+/* Table slot for the 4 bytes at p */
+uint32_t lz_hash(uint8_t *p) {
+    uint32_t v = 0;
 
-            /* Set okay response in init packet*/
-            init.data[0] = 1;
-            init.data[1] = 1;
-            init.data[2] = 1;
-            init.data[3] = 1;
+    memcpy(&v, p, 4);
+    return (v * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
 
-            /* Send init response */
-            ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Init response failure in GET");
-                free(fbuf);
-                continue;
-            }
+/* Length of an LZ run field past its 4 bit token, as 255 bytes and a remainder */
+uint8_t *lz_put_len(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) {
+        *op++ = 255;
+    }
+    *op++ = len;
+    return op;
+}
+
+/* LZ4 style block coder: literal runs and 16 bit offset matches behind a nibble token,
+ * returns the coded size or 0 if it doesn't fit in cap */
+size_t lz_compress(uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint32_t table[1 << LZ_HASH_BITS];
+    uint8_t *ip = src;
+    uint8_t *anchor = src;
+    uint8_t *end = src + len;
+    uint8_t *ref;
+    uint8_t *op = dst;
+    size_t lit = 0;
+    size_t mlen = 0;
+    uint32_t h = 0;
+
+    memset(table, 0, sizeof(table));
+    while (ip + LZ_MIN_MATCH <= end) {
+        h = lz_hash(ip);
+        ref = src + table[h];
+        table[h] = ip - src;
+        if (ref >= ip || ip - ref > 0xffff || memcmp(ref, ip, LZ_MIN_MATCH) != 0) {
+            /* Step faster the longer nothing matches, so incompressible data is cheap */
+            ip += 1 + ((ip - anchor) >> 6);
+            continue;
+        }
+        for (mlen = LZ_MIN_MATCH; ip + mlen < end && ref[mlen] == ip[mlen]; mlen++);
+
+        /* Token, literals, offset, then the rest of the match length */
+        lit = ip - anchor;
+        if ((op - dst) + 1 + lit + lit/255 + 1 + 2 + mlen/255 + 1 > cap) {
+            return 0;
+        }
+        *op++ = ((lit < 15) ? lit : 15) << 4 | ((mlen - LZ_MIN_MATCH < 15) ? mlen - LZ_MIN_MATCH : 15);
+        if (lit >= 15) {
+            op = lz_put_len(op, lit - 15);
         }
+        memcpy(op, anchor, lit);
+        op += lit;
+        *op++ = (ip - ref) >> 0;
+        *op++ = (ip - ref) >> 8;
+        if (mlen - LZ_MIN_MATCH >= 15) {
+            op = lz_put_len(op, mlen - LZ_MIN_MATCH - 15);
+        }
+        ip += mlen;
+        anchor = ip;
+    }
+
+    /* Last sequence is only literals, the block ends after them */
+    lit = end - anchor;
+    if ((op - dst) + 1 + lit + lit/255 + 1 > cap) {
+        return 0;
+    }
+    *op++ = ((lit < 15) ? lit : 15) << 4;
+    if (lit >= 15) {
+        op = lz_put_len(op, lit - 15);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return op - dst;
+}
 
-        /* Handle data packet */
-        if (rec->oper == OPER_PUT && rec->func == PUT_DATA) {
-            data_flag = 1;
-            
-            /* Decode packet ID */
-            pkt_id = rec->data[0] << 8 | rec->data[1] << 0;
-            //printf("Pkt ID is %d\n", pkt_id);
-            if (pkt_id >= curr_dpkt) {
+/* Decode a block coded by lz_compress, returns its size or -1 if it is corrupt */
+int64_t lz_decompress(uint8_t *src, size_t len, uint8_t *dst, size_t cap) {
+    uint8_t *ip = src;
+    uint8_t *iend = src + len;
+    uint8_t *op = dst;
+    uint8_t *oend = dst + cap;
+    size_t lit = 0;
+    size_t mlen = 0;
+    size_t off = 0;
+    uint8_t token = 0;
 
-                /* Save into buffer and mark current packet TODO Make smarter */
-                if (pkt_arr[pkt_id] == 0) {
-                    memcpy(fbuf + FRAME_SIZE*pkt_id, rec->data + 2, FRAME_SIZE);
-                    pkt_arr[pkt_id] = 1;
+    while (ip < iend) {
+        token = *ip++;
+        lit = token >> 4;
+        if (lit == 15) {
+            do {
+                if (ip == iend) {
+                    return -1;
                 }
-                
-                /* Find earliest missing data spot */
-                cnt = 0;
-                while(pkt_arr[cnt] != 0) {
-                    cnt++;
+                lit += *ip;
+            } while (*ip++ == 255);
+        }
+        if (lit > (size_t) (iend - ip) || lit > (size_t) (oend - op)) {
+            return -1;
+        }
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) {
+            break;
+        }
+
+        /* Match, copied a byte at a time when it overlaps what it produces */
+        if (iend - ip < 2) {
+            return -1;
+        }
+        off = ip[0] | ip[1] << 8;
+        ip += 2;
+        mlen = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15) {
+            do {
+                if (ip == iend) {
+                    return -1;
                 }
+                mlen += *ip;
+            } while (*ip++ == 255);
+        }
+        if (off == 0 || off > (size_t) (op - dst) || mlen > (size_t) (oend - op)) {
+            return -1;
+        }
+        if (off >= mlen) {
+            memcpy(op, op - off, mlen);
+            op += mlen;
+        } else {
+            for (; mlen > 0; mlen--, op++) {
+                *op = op[-off];
+            }
+        }
+    }
+
+    return op - dst;
+}
 
-                curr_dpkt = cnt;
+/* Try a few blocks spread over the file, 1 if they code small enough to bother */
+int comp_worth(uint8_t *src, uint64_t len) {
+    uint8_t scratch[COMP_BLOCK];
+    uint64_t nblk = (len + COMP_BLOCK - 1) / COMP_BLOCK;
+    uint64_t raw = 0;
+    uint64_t coded = 0;
+    uint64_t off = 0;
+    size_t blen = 0;
+    size_t clen = 0;
 
-                //if (pkt_id == curr_dpkt) {
-                //   curr_dpkt++;
-                //}
+    if (len == 0 || len > COMP_MAX_LEN) {
+        return 0;
+    }
+    for (uint64_t i = 0; i < COMP_SAMPLES && i < nblk; i++) {
+        off = (uint64_t) COMP_BLOCK*(nblk*i / ((nblk < COMP_SAMPLES) ? nblk : COMP_SAMPLES));
+        blen = (len - off < COMP_BLOCK) ? len - off : COMP_BLOCK;
+        clen = lz_compress(src + off, blen, scratch, blen);
+        raw += blen;
+        coded += (clen > 0) ? clen : blen;
+    }
+    return coded < COMP_KEEP*raw;
+}
+
+/* Most bytes comp_stream can produce for len bytes of file */
+uint64_t comp_bound(uint64_t len) {
+    return len + COMP_HDR*((len + COMP_BLOCK - 1) / COMP_BLOCK);
+}
+
+/* Code a file, or a run of its blocks, into a block stream, blocks that don't shrink are stored,
+ * returns the stream length */
+uint64_t comp_stream(uint8_t *src, uint64_t len, uint8_t *dst) {
+    uint64_t out = 0;
+    size_t blen = 0;
+    size_t clen = 0;
+
+    for (uint64_t off = 0; off < len; off += blen) {
+        blen = (len - off < COMP_BLOCK) ? len - off : COMP_BLOCK;
+        clen = lz_compress(src + off, blen, dst + out + COMP_HDR, blen - 1);
+        if (clen == 0) {
+            memcpy(dst + out + COMP_HDR, src + off, blen);
+            put_u32(dst + out, blen | COMP_STORED);
+            out += COMP_HDR + blen;
+        } else {
+            put_u32(dst + out, clen);
+            out += COMP_HDR + clen;
+        }
+    }
+    return out;
+}
+
+/* Signature block size for a file, about its square root so blocks and signatures both stay few */
+uint32_t sig_block(uint64_t len) {
+    uint64_t block = ((uint64_t) sqrt((double) len) + 63) & ~63ULL;
+
+    if (block < DELTA_MIN_BLOCK) {
+        block = DELTA_MIN_BLOCK;
+    }
+    if (block > COMP_BLOCK) {
+        block = COMP_BLOCK;
+    }
+    return block;
+}
+
+/* Bytes of signatures for a file */
+uint64_t sig_size(uint64_t len) {
+    return SIG_HDR + SIG_ENTRY*(len / sig_block(len));
+}
+
+/* Write the signature header of a file to dst */
+void sig_head(uint64_t len, uint64_t mtime, uint8_t *dst) {
+    put_u32(dst, sig_block(len));
+    put_u64(dst + 4, len);
+    put_u64(dst + 12, mtime);
+}
+
+/* Write the signatures of len bytes of a file's blocks to dst, a trailing partial block is left
+ * out (it's never copied) */
+void sig_build(uint8_t *src, uint64_t len, uint32_t block, uint8_t *dst) {
+    uint32_t a = 0;
+    uint32_t b = 0;
+
+    for (uint64_t off = 0; off + block <= len; off += block) {
+        put_u32(dst, weak_sum(src + off, block, &a, &b));
+        put_u64(dst + 4, hash64(src + off, block));
+        dst += SIG_ENTRY;
+    }
+}
+
+/* Write received bytes out, through the block decoder if the stream is compressed or a delta, and add
+ * what is written to the file checksum */
+int comp_write(zdec_t *z, uint32_t *crc, FILE *f, uint8_t *p, size_t len) {
+    size_t need = 0;
+    size_t n = 0;
+    int64_t out = 0;
+    uint32_t hdr = 0;
+    uint64_t idx = 0;
+    uint64_t nblk = 0;
+
+    if (z == NULL) {
+        *crc = crc32c(*crc, p, len);
+        return (fwrite(p, 1, len, f) == len) ? 0 : -1;
+    }
+    while (len > 0) {
+        /* Gather the header, then the block it describes */
+        need = COMP_HDR;
+        if (z->have >= COMP_HDR) {
+            hdr = get_u32(z->buf);
+            need += (hdr & DELTA_COPY) ? DELTA_REF : hdr & ~COMP_STORED;
+            if (need == COMP_HDR || need > COMP_HDR + COMP_BLOCK) {
+                return -1;
             }
-    
+        }
+        n = (need - z->have < len) ? need - z->have : len;
+        memcpy(z->buf + z->have, p, n);
+        z->have += n;
+        p += n;
+        len -= n;
+        if (z->have < need || need == COMP_HDR) {
+            continue;
         }
 
-        /* Agree that we are done */
-        if  (rec->oper == OPER_PUT && rec->func == PUT_DONE) {
-            ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Done response failure in GET");
+        /* Run of blocks from the copy a delta is against */
+        z->have = 0;
+        if (hdr & DELTA_COPY) {
+            nblk = hdr & ~DELTA_COPY;
+            idx = get_u32(z->buf + COMP_HDR);
+            if (z->basis == NULL || nblk == 0 || idx + nblk > z->basis_len / z->block) {
+                return -1;
+            }
+            *crc = crc32c(*crc, z->basis + z->block*idx, z->block*nblk);
+            if (fwrite(z->basis + z->block*idx, 1, z->block*nblk, f) != z->block*nblk) {
+                return -1;
+            }
+            continue;
+        }
+
+        /* Whole block, write it out */
+        if (hdr & COMP_STORED) {
+            *crc = crc32c(*crc, z->buf + COMP_HDR, need - COMP_HDR);
+            if (fwrite(z->buf + COMP_HDR, 1, need - COMP_HDR, f) != need - COMP_HDR) {
+                return -1;
             }
+            continue;
+        }
+        out = lz_decompress(z->buf + COMP_HDR, need - COMP_HDR, z->out, COMP_BLOCK);
+        if (out < 0) {
+            return -1;
+        }
+        *crc = crc32c(*crc, z->out, out);
+        if (fwrite(z->out, 1, out, f) != (size_t) out) {
+            return -1;
+        }
+    }
+    return 0;
+}
 
-            if (curr_dpkt >= num_dpkt) {
+/* Whether a path names something under the current directory: relative and no .. components */
+int path_ok(char *path) {
+    char *p = path;
 
-                /* Write file and release memory only once */
-                if (f != NULL && fbuf != NULL) {
-                    fwrite(fbuf, 1, file_len, f);
-                    fclose(f);
-                    free(fbuf);
-                    f = NULL;
-                    fbuf = NULL;
-                }
+    if (path[0] == 0 || path[0] == '/') {
+        return 0;
+    }
+    while (p != NULL) {
+        if (p[0] == '.' && p[1] == '.' && (p[2] == '/' || p[2] == 0)) {
+            return 0;
+        }
+        p = strchr(p, '/');
+        if (p != NULL) {
+            p++;
+        }
+    }
+    return 1;
+}
 
-                /* No longer in data mode */
-                data_flag = 0;
+/* Create the directories leading up to a file, like mkdir -p of its parent */
+int make_parents(char *path) {
+    char dir[CKPT_NAME];
 
-                /* Release packet array */
-                if (pkt_arr != NULL) {
-                    free(pkt_arr);
-                    pkt_arr = NULL;
-                }
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char *p = dir + 1; *p != 0; p++) {
+        if (*p != '/') {
+            continue;
+        }
+        *p = 0;
+        if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+        *p = '/';
+    }
+    return 0;
+}
 
-                /* Can break out of loop since another GET DONE from client puts us back in loop */
-                break;
-            } else {
-                /* Send request packet for curr_dpkt */
-                d.data[0] = curr_dpkt << 8;
-                d.data[1] = curr_dpkt << 0;
-                ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                if (ret < 0) {
-                    warn("Data request failure in PUT");
-                    continue;
-                }
+/* Resume state to and from the wire (and the front of a checkpoint) */
+void resume_put(uint8_t *p, ckpt_t *c) {
+    put_u64(p, c->raw_len);
+    put_u64(p + 8, c->mtime);
+    put_u64(p + 16, c->wire_len);
+    p[24] = c->codec;
+    put_u32(p + 25, c->frames);
+    put_u32(p + 29, c->frame);
+}
+
+void resume_get(uint8_t *p, ckpt_t *c) {
+    c->raw_len = get_u64(p);
+    c->mtime = get_u64(p + 8);
+    c->wire_len = get_u64(p + 16);
+    c->codec = p[24];
+    c->frames = get_u32(p + 25);
+    c->frame = get_u32(p + 29);
+}
 
+/* 1 if two transfers send the same file the same way, so frames of one are frames of the other */
+int ckpt_match(ckpt_t *a, ckpt_t *b) {
+    return a->raw_len == b->raw_len && a->mtime == b->mtime && a->wire_len == b->wire_len && a->codec == b->codec;
+}
+
+/* Read the checkpoint for a file, -1 if there is none or the partial file no longer backs it */
+int ckpt_load(char *file, ckpt_t *c) {
+    char name[CKPT_NAME];
+    uint8_t hdr[CKPT_HDR];
+    struct stat st;
+    FILE *cf;
+    size_t n = 0;
+
+    snprintf(name, sizeof(name), "%s.resume", file);
+    cf = fopen(name, "rb");
+    if (cf == NULL) {
+        return -1;
+    }
+    n = fread(hdr, 1, CKPT_HDR, cf);
+    fclose(cf);
+    if (n != CKPT_HDR) {
+        return -1;
+    }
+    resume_get(hdr, c);
+    c->out_len = get_u64(hdr + RESUME_SIZE);
+    c->crc = get_u32(hdr + RESUME_SIZE + 8);
+    c->have = get_u32(hdr + RESUME_SIZE + 12);
+
+    if (stat(file, &st) < 0 || (uint64_t) st.st_size < c->out_len || c->have > COMP_HDR + COMP_BLOCK) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Save progress beside the file, after flushing so the file holds everything counted */
+void ckpt_save(char *file, ckpt_t *c, FILE *f, zdec_t *z) {
+    char name[CKPT_NAME];
+    char tmp[CKPT_NAME];
+    uint8_t hdr[CKPT_HDR];
+    FILE *cf;
+
+    if (fflush(f) != 0) {
+        warn("Couldn't save checkpoint");
+        return;
+    }
+    c->out_len = ftello(f);
+    c->have = (z != NULL) ? z->have : 0;
+    resume_put(hdr, c);
+    put_u64(hdr + RESUME_SIZE, c->out_len);
+    put_u32(hdr + RESUME_SIZE + 8, c->crc);
+    put_u32(hdr + RESUME_SIZE + 12, c->have);
+
+    /* Written aside and renamed over, so a crash leaves the old checkpoint or the new one */
+    snprintf(name, sizeof(name), "%s.resume", file);
+    snprintf(tmp, sizeof(tmp), "%s.resume.tmp", file);
+    cf = fopen(tmp, "wb");
+    if (cf == NULL) {
+        warn("Couldn't save checkpoint");
+        return;
+    }
+    if (fwrite(hdr, 1, CKPT_HDR, cf) != CKPT_HDR || (c->have > 0 && fwrite(z->buf, 1, c->have, cf) != c->have)) {
+        warn("Couldn't save checkpoint");
+        fclose(cf);
+        remove(tmp);
+        return;
+    }
+    fclose(cf);
+    rename(tmp, name);
+}
+
+/* Reopen a partial file at its checkpoint, with the decoder holding the block it was partway through */
+FILE *ckpt_open(char *file, ckpt_t *c, zdec_t *z) {
+    char name[CKPT_NAME];
+    FILE *f;
+    FILE *cf;
+    int ok = 0;
+
+    f = fopen(file, "r+b");
+    if (f == NULL) {
+        return NULL;
+    }
+    if (z != NULL) {
+        snprintf(name, sizeof(name), "%s.resume", file);
+        cf = fopen(name, "rb");
+        ok = cf != NULL && fseek(cf, CKPT_HDR, SEEK_SET) == 0 && fread(z->buf, 1, c->have, cf) == c->have;
+        if (cf != NULL) {
+            fclose(cf);
+        }
+        z->have = c->have;
+    } else {
+        ok = c->have == 0;
+    }
+    if (!ok || ftruncate(fileno(f), c->out_len) < 0 || fseeko(f, 0, SEEK_END) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* Forget a file's checkpoint, once it is complete or being started over */
+void ckpt_drop(char *file) {
+    char name[CKPT_NAME];
+
+    snprintf(name, sizeof(name), "%s.resume", file);
+    remove(name);
+}
+
+/* Store a frame in the reassembly window if it falls inside it */
+void rx_store(char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t num_dpkt, uint32_t id, uint8_t *data) {
+    uint32_t slot = id % win;
+
+    if (id < curr_dpkt || id >= num_dpkt || id - curr_dpkt >= win || bits_test(pkt_arr, slot)) {
+        return;
+    }
+    memcpy(fbuf + (size_t) frame*slot, data, frame);
+    bits_set(pkt_arr, slot);
+}
+
+/* Write the run of complete frames at the front of the window, returns the new lowest missing frame */
+uint32_t rx_flush(FILE *f, zdec_t *z, uint32_t *crc, char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t num_dpkt, uint64_t file_len) {
+    uint32_t start = curr_dpkt;
+    uint32_t pos = curr_dpkt % win;
+    uint32_t left = (num_dpkt - curr_dpkt < win) ? num_dpkt - curr_dpkt : win;
+    uint32_t run = 0;
+    uint64_t end = 0;
+    uint64_t len = 0;
+    uint64_t first = 0;
+
+    /* Lowest missing frame, in up to two pieces since the run may wrap the ring */
+    run = bits_ffz(pkt_arr, pos, (pos + left < win) ? pos + left : win) - pos;
+    if (pos + run == win && run < left) {
+        run += bits_ffz(pkt_arr, 0, left - run);
+    }
+    if (run == 0) {
+        return curr_dpkt;
+    }
+    curr_dpkt += run;
+
+    /* Free the slots as the window slides */
+    if (pos + run <= win) {
+        bits_fill(pkt_arr, pos, pos + run, 0);
+    } else {
+        bits_fill(pkt_arr, pos, win, 0);
+        bits_fill(pkt_arr, 0, pos + run - win, 0);
+    }
+
+    /* Run may wrap around the end of the ring, last frame is cut to the file length */
+    end = (uint64_t) frame*curr_dpkt;
+    len = ((end < file_len) ? end : file_len) - (uint64_t) frame*start;
+    first = (uint64_t) frame*(win - start % win);
+    if (first > len) {
+        first = len;
+    }
+    if (comp_write(z, crc, f, (uint8_t *) fbuf + (size_t) frame*(start % win), first) < 0 ||
+        (len > first && comp_write(z, crc, f, (uint8_t *) fbuf, len - first) < 0)) {
+        warn("Couldn't write file");
+    }
+
+    return curr_dpkt;
+}
+
+/* Build a selective ack: lowest missing frame, frames rebuilt from parity and a bitmap of the frames after it,
+ * returns its length */
+int sack_build(msg_t *s, bits_t *pkt_arr, uint32_t win, uint32_t curr_dpkt, uint32_t high_dpkt, int rebuilt) {
+    uint32_t nbits = 0;
+    uint32_t pos = curr_dpkt % win;
+    uint32_t first = 0;
+    uint64_t i = 0;
+
+    if (high_dpkt > curr_dpkt) {
+        nbits = (high_dpkt - curr_dpkt > SACK_BITS) ? SACK_BITS : high_dpkt - curr_dpkt;
+    }
+    if (nbits > win) {
+        nbits = win;
+    }
+
+    put_u32(s->data, curr_dpkt);
+    s->data[4] = nbits >> 8;
+    s->data[5] = nbits >> 0;
+    s->data[6] = rebuilt >> 8;
+    s->data[7] = rebuilt >> 0;
+
+    /* Only visit frames we have, skipping holes a word at a time (ring may wrap) */
+    memset(s->data + SACK_HDR, 0, (nbits + 7) / 8);
+    first = (pos + nbits < win) ? nbits : win - pos;
+    for (i = bits_ffs(pkt_arr, pos, pos + first); i < pos + first; i = bits_ffs(pkt_arr, i + 1, pos + first)) {
+        s->data[SACK_HDR + (i - pos)/8] |= 1 << ((i - pos) % 8);
+    }
+    for (i = bits_ffs(pkt_arr, 0, nbits - first); i < nbits - first; i = bits_ffs(pkt_arr, i + 1, nbits - first)) {
+        s->data[SACK_HDR + (i + first)/8] |= 1 << ((i + first) % 8);
+    }
+    return SACK_HDR + (nbits + 7) / 8;
+}
+
+/* Mark frames reported by a selective ack, returns the lowest missing frame */
+uint32_t sack_apply(msg_t *s, bits_t *acked, uint32_t curr_dpkt, uint32_t num_dpkt, int *newly, int *rebuilt) {
+    uint32_t base = get_u32(s->data);
+    uint32_t nbits = s->data[4] << 8 | s->data[5] << 0;
+    uint8_t byte = 0;
+    uint32_t i = 0;
+
+    if (base > num_dpkt) {
+        base = num_dpkt;
+    }
+    if (nbits > SACK_BITS) {
+        nbits = SACK_BITS;
+    }
+    if (nbits > num_dpkt - base) {
+        nbits = num_dpkt - base;
+    }
+
+    /* Count frames acked for the first time, for congestion control */
+    *rebuilt = s->data[6] << 8 | s->data[7] << 0;
+    *newly = 0;
+    if (base > curr_dpkt) {
+        *newly += bits_fill(acked, curr_dpkt, base, 1);
+    }
+    for (uint32_t j = 0; j < (nbits + 7) / 8; j++) {
+        for (byte = s->data[SACK_HDR + j]; byte != 0; byte &= byte - 1) {
+            i = 8*j + __builtin_ctz(byte);
+            if (i < nbits && !bits_test(acked, base + i)) {
+                bits_set(acked, base + i);
+                (*newly)++;
+            }
+        }
+    }
+
+    /* Stale ack from before the last one, keep the newer position */
+    if (base < curr_dpkt) {
+        base = curr_dpkt;
+    }
+
+    return base;
+}
+
+/* dst ^= src, a word at a time */
+void xor_into(uint8_t *dst, uint8_t *src, size_t len) {
+    uint64_t a = 0;
+    uint64_t b = 0;
+    size_t i = 0;
+
+    for (; i + 8 <= len; i += 8) {
+        memcpy(&a, dst + i, 8);
+        memcpy(&b, src + i, 8);
+        a ^= b;
+        memcpy(dst + i, &a, 8);
+    }
+    for (; i < len; i++) {
+        dst[i] ^= src[i];
+    }
+}
+
+/* Bytes of file data in a frame, only the last one is short */
+size_t frame_len(uint64_t file_len, uint32_t frame, uint32_t id) {
+    uint64_t off = (uint64_t) frame*id;
+
+    return (file_len - off < frame) ? file_len - off : frame;
+}
+
+/* Frame size for a transfer from the one asked for, within what either end can hold */
+uint32_t frame_pick(uint32_t want) {
+    if (want < FRAME_SIZE) {
+        return FRAME_SIZE;
+    }
+    return (want > FRAME_MAX) ? FRAME_MAX : want;
+}
+
+/* Frames per parity group for the loss seen so far, 0 if parity is off */
+int fec_group(double loss) {
+    double ratio = fec_min;
+
+    if (fec_min == 0) {
+        return 0;
+    }
+    if (FEC_LOSS_GAIN*loss > ratio) {
+        ratio = FEC_LOSS_GAIN*loss;
+    }
+    if (ratio >= 1.0 / FEC_MIN_GROUP) {
+        return FEC_MIN_GROUP;
+    }
+    if (ratio <= 1.0 / FEC_MAX_GROUP) {
+        return FEC_MAX_GROUP;
+    }
+    return 1 / ratio;
+}
+
+/* Rebuild the one frame of a parity group that didn't arrive, returns 1 if there was one to rebuild */
+int fec_rebuild(char *fbuf, bits_t *pkt_arr, uint32_t win, uint32_t frame, uint32_t curr_dpkt, uint32_t high_dpkt, uint32_t num_dpkt, uint64_t file_len, uint8_t *par) {
+    uint32_t first = get_u32(par);
+    uint32_t n = par[4] >> FRAME_FLAGS;
+    int64_t miss = -1;
+    uint8_t *out;
+
+    /* Frames written out stay in the ring until a frame a window later lands on them */
+    if (n < FEC_MIN_GROUP || first >= num_dpkt || n > num_dpkt - first || first + n > curr_dpkt + win || high_dpkt > first + win) {
+        return 0;
+    }
+    for (uint32_t i = (first > curr_dpkt) ? first : curr_dpkt; i < first + n; i++) {
+        if (!bits_test(pkt_arr, i % win)) {
+            if (miss >= 0) {
+                return 0;
+            }
+            miss = i;
+        }
+    }
+    if (miss < 0) {
+        return 0;
+    }
+
+    /* Parity XOR every other frame in the group, the last frame counts as zero past the end of the file */
+    out = (uint8_t *) fbuf + (size_t) frame*(miss % win);
+    memcpy(out, par + FRAME_HDR, frame);
+    for (uint32_t i = first; i < first + n; i++) {
+        if (i != miss) {
+            xor_into(out, (uint8_t *) fbuf + (size_t) frame*(i % win), frame_len(file_len, frame, i));
+        }
+    }
+    bits_set(pkt_arr, miss % win);
+
+    return 1;
+}
+
+/* Current time in seconds from a monotonic clock */
+double now_sec() {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Microsecond timestamp for message headers, wraps every 71 minutes and is never 0 (0 means none) */
+uint32_t now_usec() {
+    uint32_t t = (uint64_t) (now_sec() * 1e6);
+
+    return (t == 0) ? 1 : t;
+}
+
+/* No samples yet, start from the initial guess */
+void rtt_init(rtt_t *r) {
+    memset(r, 0, sizeof(rtt_t));
+    r->rto = RTO_INIT;
+}
+
+/* Stamp a message with our time and echo the peer's last one, advanced by how long we held it */
+void rtt_stamp(rtt_t *r, msg_t *m) {
+    uint32_t now = now_usec();
+
+    m->ts = now;
+    m->ts_echo = (r->peer_ts != 0) ? r->peer_ts + (now - r->peer_at) : 0;
+}
+
+/* Remember the peer's time and update the estimate from our echoed one (Jacobson/Karels), returns
+ * the sample or 0 if there was none */
+double rtt_recv(rtt_t *r, msg_t *m) {
+    uint32_t now = now_usec();
+    double rtt = 0;
+
+    if (m->ts != 0) {
+        r->peer_ts = m->ts;
+        r->peer_at = now;
+    }
+    if (m->ts_echo == 0) {
+        return 0;
+    }
+
+    /* Garbage or from before a clock wrap */
+    rtt = (uint32_t) (now - m->ts_echo) / 1e6;
+    if (rtt > PEER_TIMEOUT) {
+        return 0;
+    }
+
+    if (r->srtt == 0) {
+        r->srtt = rtt;
+        r->rttvar = rtt / 2;
+    } else {
+        r->rttvar = 0.75*r->rttvar + 0.25*fabs(r->srtt - rtt);
+        r->srtt = 0.875*r->srtt + 0.125*rtt;
+    }
+
+    /* A fresh sample also undoes any backoff, steady paths still get some slack over the RTT */
+    r->rto = fmin(r->srtt + fmax(RTO_MIN, 4*r->rttvar), RTO_MAX);
+    return rtt;
+}
+
+/* Answer to a poll older than the last one we stamped, i.e. to a round since resent */
+int rtt_stale(msg_t *last, msg_t *m) {
+    return last->ts != 0 && m->ts_echo != 0 && (int32_t) (m->ts_echo - last->ts) < 0;
+}
+
+/* Timed out, wait twice as long next time until a sample comes in */
+void rtt_backoff(rtt_t *r) {
+    r->rto = fmin(2*r->rto, RTO_MAX);
+}
+
+/* Parse a congestion control name, returns -1 if unknown */
+int cc_parse(char *name) {
+    for (int i = 0; i < CC_COUNT; i++) {
+        if (strcmp(name, cc_names[i]) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Start a transfer with a small window in slow start */
+void cc_init(cc_t *cc, int algo) {
+    memset(cc, 0, sizeof(cc_t));
+    cc->algo = algo;
+    cc->cwnd = (algo == CC_FIXED) ? BURST_SIZE : CC_INIT_CWND;
+    cc->ssthresh = CC_MAX_CWND;
+    cc->min_rtt = 0;
+    cc->mode = BBR_STARTUP;
+}
+
+/* Frames the sender may put in flight this round */
+int cc_window(cc_t *cc) {
+    if (cc->cwnd < CC_MIN_CWND) {
+        cc->cwnd = CC_MIN_CWND;
+    }
+    if (cc->cwnd > CC_MAX_CWND) {
+        cc->cwnd = CC_MAX_CWND;
+    }
+    return (int) cc->cwnd;
+}
+
+/* Multiplicative decrease shared by the loss based algorithms */
+void cc_loss(cc_t *cc) {
+    if (cc->algo == CC_CUBIC) {
+        /* Fast convergence, release bandwidth when the peak keeps dropping */
+        if (cc->cwnd < cc->w_max) {
+            cc->w_max = cc->cwnd * (1.0 + CUBIC_BETA) / 2.0;
+        } else {
+            cc->w_max = cc->cwnd;
+        }
+        cc->cwnd = cc->cwnd * CUBIC_BETA;
+        cc->epoch = 0;
+    } else {
+        cc->cwnd = cc->cwnd / 2;
+    }
+    cc->ssthresh = (cc->cwnd > CC_MIN_CWND) ? cc->cwnd : CC_MIN_CWND;
+}
+
+/* Window growth for cubic once out of slow start */
+void cc_cubic_grow(cc_t *cc, double rtt) {
+    double now = now_sec();
+    double t = 0;
+    double target = 0;
+    double w_est = 0;
+
+    /* Start a new epoch at the first round after a loss */
+    if (cc->epoch == 0) {
+        cc->epoch = now;
+        if (cc->w_max < cc->cwnd) {
+            cc->k = 0;
+            cc->w_max = cc->cwnd;
+        } else {
+            cc->k = cbrt((cc->w_max - cc->cwnd) / CUBIC_C);
+        }
+        cc->w_est = cc->cwnd;
+    }
+
+    /* Cubic curve through w_max, checked one round ahead */
+    t = now - cc->epoch + rtt;
+    target = CUBIC_C * (t - cc->k) * (t - cc->k) * (t - cc->k) + cc->w_max;
+
+    /* Stay at least as aggressive as standard AIMD would be */
+    cc->w_est += 3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA);
+    w_est = cc->w_est;
+    if (target < w_est) {
+        target = w_est;
+    }
+
+    /* Grow by at most half a window per round */
+    if (target > cc->cwnd * 1.5) {
+        target = cc->cwnd * 1.5;
+    }
+    if (target > cc->cwnd) {
+        cc->cwnd = target;
+    } else {
+        cc->cwnd += 1.0;
+    }
+}
+
+/* Delivery rate model for BBR, window follows the estimated BDP */
+void cc_bbr_round(cc_t *cc, int delivered, double rtt) {
+    double now = now_sec();
+    double bdp = 0;
+    double gain = 1.0;
+
+    /* Min RTT, refreshed when the sample gets too old */
+    if (cc->min_rtt == 0 || rtt < cc->min_rtt || now - cc->min_rtt_stamp > BBR_RTT_WIN) {
+        cc->min_rtt = rtt;
+        cc->min_rtt_stamp = now;
+    }
+
+    /* Windowed max of the delivery rate over recent rounds */
+    cc->bw[cc->round % BBR_BW_ROUNDS] = delivered / rtt;
+    cc->round++;
+    cc->max_bw = 0;
+    for (int i = 0; i < BBR_BW_ROUNDS; i++) {
+        if (cc->bw[i] > cc->max_bw) {
+            cc->max_bw = cc->bw[i];
+        }
+    }
+    bdp = cc->max_bw * cc->min_rtt;
+
+    switch (cc->mode) {
+        case BBR_STARTUP:
+            /* Pipe is full once bandwidth stops growing 25% for three rounds */
+            if (cc->max_bw >= cc->full_bw * 1.25) {
+                cc->full_bw = cc->max_bw;
+                cc->full_cnt = 0;
+            } else if (++cc->full_cnt >= 3) {
+                cc->mode = BBR_DRAIN;
+            }
+            gain = BBR_HIGH_GAIN;
+            break;
+        case BBR_DRAIN:
+            gain = 1.0 / BBR_HIGH_GAIN;
+            cc->mode = BBR_PROBE_BW;
+            cc->cycle = 0;
+            break;
+        case BBR_PROBE_BW:
+            gain = bbr_cycle[cc->cycle % BBR_CYCLE_LEN];
+            cc->cycle++;
+            break;
+    }
+
+    cc->cwnd = gain * BBR_CWND_GAIN * bdp;
+}
+
+/* Update the window after a round, from frames sent, delivered and lost */
+void cc_on_round(cc_t *cc, int sent, int delivered, int lost, double rtt) {
+    if (rtt <= 0) {
+        rtt = 1e-6;
+    }
+
+    switch (cc->algo) {
+        case CC_FIXED:
+            break;
+        case CC_AIMD:
+        case CC_CUBIC:
+            if (lost > 0) {
+                cc_loss(cc);
+            } else if (sent < cc->cwnd / 2) {
+                /* Application limited round, don't grow */
+            } else if (cc->cwnd < cc->ssthresh) {
+                /* Slow start, without counting frames acked late from earlier rounds */
+                cc->cwnd += (delivered < sent) ? delivered : sent;
+                if (cc->cwnd > cc->ssthresh) {
+                    cc->cwnd = cc->ssthresh;
+                }
+            } else if (cc->algo == CC_AIMD) {
+                cc->cwnd += 1.0;
+            } else {
+                cc_cubic_grow(cc, rtt);
+            }
+            break;
+        case CC_BBR:
+            cc_bbr_round(cc, delivered, rtt);
+            break;
+    }
+}
+
+/* Nothing came back for a whole round, collapse the window */
+void cc_on_timeout(cc_t *cc) {
+    switch (cc->algo) {
+        case CC_FIXED:
+            break;
+        case CC_AIMD:
+        case CC_CUBIC:
+            cc_loss(cc);
+            cc->cwnd = CC_MIN_CWND;
+            break;
+        case CC_BBR:
+            /* Model is kept, next round restores the window from it */
+            cc->cwnd = CC_MIN_CWND;
+            break;
+    }
+}
+
+/* Opt in to UDP segmentation and receive offload where the kernel has it */
+void offload_init() {
+    int val = 0;
+
+    /* Frame batches give their own segment size per send (frames differ in size between
+     * transfers), so nothing is split by default and this only checks the kernel has it */
+    val = 0;
+    if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val)) < 0) {
+        warn("UDP segmentation offload unavailable");
+    } else {
+        gso_on = 1;
+    }
+
+    val = 1;
+    if (setsockopt(sock, SOL_UDP, UDP_GRO, &val, sizeof(val)) < 0) {
+        warn("UDP receive offload unavailable");
+    } else {
+        gro_on = 1;
+    }
+}
+
+/* Fall back to one datagram per send */
+void gso_off() {
+    int val = 0;
+
+    setsockopt(sock, SOL_UDP, UDP_SEGMENT, &val, sizeof(val));
+    gso_on = 0;
+}
+
+/* Turn on zero-copy sends if the kernel has them */
+void zc_init() {
+    int val = 1;
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+        warn("Zero-copy send unavailable");
+        return;
+    }
+    zc_hdr = malloc((size_t) ZC_RING*ZC_HDR);
+    zc_id = malloc(ZC_RING*sizeof(uint32_t));
+    zc_busy = calloc(ZC_RING, sizeof(char));
+    if (zc_hdr == NULL || zc_id == NULL || zc_busy == NULL) {
+        error("Error allocating zero-copy ring");
+    }
+    zc_on = 1;
+}
+
+/* Move the ring tail past finished slots and unmap files no send points into any more */
+void zc_release() {
+    uint32_t low = 0;
+
+    while (zc_tail != zc_head && zc_busy[zc_tail % ZC_RING] == 0) {
+        zc_tail++;
+    }
+
+    /* Every send ID before low has completed */
+    if (zc_tail != zc_head && zc_busy[zc_tail % ZC_RING] == 1) {
+        low = zc_id[zc_tail % ZC_RING];
+    } else {
+        low = zc_next;
+    }
+    for (int i = 0; i < zc_nmaps; ) {
+        if ((int32_t) (zc_maps[i].last - low) < 0) {
+            munmap(zc_maps[i].buf, zc_maps[i].len);
+            zc_maps[i] = zc_maps[--zc_nmaps];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Read send completions from the error queue and free the header slots they cover */
+void zc_reap() {
+    char control[128];
+    struct msghdr mh;
+    struct cmsghdr *cm;
+    struct sock_extended_err ee;
+    uint32_t slot = 0;
+
+    while (1) {
+        memset(&mh, 0, sizeof(mh));
+        mh.msg_control = control;
+        mh.msg_controllen = sizeof(control);
+        if (recvmsg(sock, &mh, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&mh); cm != NULL; cm = CMSG_NXTHDR(&mh, cm)) {
+            if (cm->cmsg_level != SOL_IP || cm->cmsg_type != IP_RECVERR) {
+                continue;
+            }
+            memcpy(&ee, CMSG_DATA(cm), sizeof(ee));
+            if (ee.ee_errno != 0 || ee.ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+
+            /* Sends ee_info through ee_data are done, IDs rise along the ring */
+            for (uint32_t i = zc_tail; i != zc_head; i++) {
+                slot = i % ZC_RING;
+                if (zc_busy[slot] != 1) {
+                    continue;
+                }
+                if ((int32_t) (zc_id[slot] - ee.ee_data) > 0) {
+                    break;
+                }
+                if ((int32_t) (zc_id[slot] - ee.ee_info) >= 0) {
+                    zc_busy[slot] = 0;
+                }
+            }
+            zc_reports++;
+            if (ee.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                zc_copied++;
+            }
+        }
+    }
+    zc_release();
+
+    /* Kernel copies anyway on this route (loopback, no scatter-gather), pinning only costs */
+    if (zc_on && zc_reports >= ZC_PROBE && zc_copied == zc_reports) {
+        printf("Zero-copy sends are being copied, turning them off\n");
+        zc_on = 0;
+    }
+}
+
+/* Wait a little for the kernel to report sends done */
+void zc_wait() {
+    struct pollfd pfd;
+
+    pfd.fd = sock;
+    pfd.events = 0;
+    poll(&pfd, 1, ZC_WAIT_MS);
+    zc_reap();
+}
+
+/* Take the next header slot, waiting for completions while the ring is full */
+uint8_t *zc_slot() {
+    while (zc_head - zc_tail >= ZC_RING) {
+        zc_wait();
+    }
+    zc_busy[zc_head % ZC_RING] = 2;
+    return zc_hdr + (size_t) (zc_head++ % ZC_RING)*ZC_HDR;
+}
+
+/* Give the frames just sent their send IDs (per frames to a send), free slots of frames that didn't go */
+void zc_sent(int per, int sent) {
+    uint32_t slot = 0;
+
+    if (!tx_zc) {
+        return;
+    }
+    if (sent < 0) {
+        sent = 0;
+    }
+    for (int k = 0; k < tx_cnt; k++) {
+        slot = (tx_zc_first + k) % ZC_RING;
+        if (k / per < sent) {
+            zc_id[slot] = zc_next + k / per;
+            zc_busy[slot] = 1;
+        } else {
+            zc_busy[slot] = 0;
+        }
+    }
+    zc_next += sent;
+    zc_release();
+}
+
+/* Unmap a file now, or once the sends that may still point into it are done */
+void zc_unmap(char *buf, uint64_t len) {
+    if (zc_tail == zc_head) {
+        munmap(buf, len);
+        return;
+    }
+    while (zc_nmaps == ZC_MAPS) {
+        zc_wait();
+    }
+    zc_maps[zc_nmaps].buf = buf;
+    zc_maps[zc_nmaps].len = len;
+    zc_maps[zc_nmaps].last = zc_next - 1;
+    zc_nmaps++;
+}
+
+/* Receive one message, refilling the batch with a single recvmmsg when it runs dry */
+int recv_msg(msg_t *m, struct sockaddr_in *from, int *from_len) {
+    struct msghdr *mh;
+    struct cmsghdr *cm;
+    int ret = 0;
+    int len = 0;
+    int seg = 0;
+
+    /* Per packet path */
+    if (batch_size == 1 && gro_on == 0) {
+        ret = recvfrom(sock, rx_area, MSG_MAX, 0, (struct sockaddr *) from, from_len);
+        if (ret >= 0) {
+            wire_get(m, rx_area, ret);
+        }
+        return ret;
+    }
+
+    if (rx_next == rx_cnt) {
+        for (int i = 0; i < batch_size; i++) {
+            rx_iov[i].iov_base = rx_area + (size_t) rx_slot*i;
+            rx_iov[i].iov_len = rx_slot;
+            memset(&rx_mmsg[i].msg_hdr, 0, sizeof(struct msghdr));
+            rx_mmsg[i].msg_hdr.msg_name = &rx_addr[i];
+            rx_mmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+            rx_mmsg[i].msg_hdr.msg_iov = &rx_iov[i];
+            rx_mmsg[i].msg_hdr.msg_iovlen = 1;
+            rx_mmsg[i].msg_hdr.msg_control = rx_cmsg[i].buf;
+            rx_mmsg[i].msg_hdr.msg_controllen = sizeof(rx_cmsg[i].buf);
+        }
+
+        /* Block for the first datagram (socket timeout applies), take whatever else is queued */
+        ret = recvmmsg(sock, rx_mmsg, batch_size, MSG_WAITFORONE, NULL);
+        if (ret < 0) {
+            return ret;
+        }
+        rx_cnt = ret;
+        rx_next = 0;
+        rx_off = 0;
+    }
+
+    /* Coalesced slots carry datagrams of the size given by UDP_GRO, the last may be short */
+    mh = &rx_mmsg[rx_next].msg_hdr;
+    len = rx_mmsg[rx_next].msg_len;
+    seg = len;
+    for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            memcpy(&seg, CMSG_DATA(cm), sizeof(int));
+        }
+    }
+
+    ret = (len - rx_off < seg) ? len - rx_off : seg;
+    if (ret > MSG_MAX) {
+        ret = MSG_MAX;
+    }
+    wire_get(m, rx_area + (size_t) rx_slot*rx_next + rx_off, ret);
+    memcpy(from, &rx_addr[rx_next], sizeof(struct sockaddr_in));
+    *from_len = sizeof(struct sockaddr_in);
+
+    rx_off += seg;
+    if (rx_off >= len) {
+        rx_next++;
+        rx_off = 0;
+    }
+
+    return ret;
+}
+
+/* Send queued frames as runs of up to run datagrams, split by the kernel at the batch's frame size */
+int flush_gso(int run, int flags) {
+    struct msghdr *mh;
+    struct cmsghdr *cm;
+    uint16_t seg = MSG_HDR + FRAME_HDR + tx_frame;
+    int groups = 0;
+    int sent = 0;
+    int ret = 0;
+    int n = 0;
+
+    /* Frames' iovecs are contiguous, so a run is just a longer iovec array */
+    for (int i = 0; i < tx_cnt; i += run) {
+        n = (tx_cnt - i < run) ? tx_cnt - i : run;
+        mh = &tx_gso[groups].msg_hdr;
+        memset(mh, 0, sizeof(struct msghdr));
+        mh->msg_name = tx_mmsg[i].msg_hdr.msg_name;
+        mh->msg_namelen = sizeof(struct sockaddr_in);
+        mh->msg_iov = tx_iov[i];
+        mh->msg_iovlen = 2*n;
+        mh->msg_control = tx_gso_cmsg[groups].buf;
+        mh->msg_controllen = sizeof(tx_gso_cmsg[groups].buf);
+        cm = CMSG_FIRSTHDR(mh);
+        cm->cmsg_level = SOL_UDP;
+        cm->cmsg_type = UDP_SEGMENT;
+        cm->cmsg_len = CMSG_LEN(sizeof(seg));
+        memcpy(CMSG_DATA(cm), &seg, sizeof(seg));
+        groups++;
+    }
+
+    while (sent < groups) {
+        ret = sendmmsg(sock, tx_gso + sent, groups - sent, flags);
+        if (ret < 0) {
+            break;
+        }
+        sent += ret;
+    }
+
+    return (sent > 0) ? sent : ret;
+}
+
+/* Send all queued frames, sendmmsg may take fewer than asked per call */
+int flush_frames() {
+    int ret = 0;
+    int sent = 0;
+    int flags = tx_zc ? MSG_ZEROCOPY : 0;
+    uint32_t run = GSO_FRAMES;
+
+    /* Zero-copy pins every iovec page as its own fragment, and a datagram only holds MAX_SKB_FRAGS */
+    if (tx_zc) {
+        run = ZC_GSO_FRAMES*FRAME_SIZE / tx_frame;
+    }
+    if (run > GSO_BYTES / (MSG_HDR + FRAME_HDR + tx_frame)) {
+        run = GSO_BYTES / (MSG_HDR + FRAME_HDR + tx_frame);
+    }
+    if (run < 1) {
+        run = 1;
+    }
+
+    /* Segmentation offload, turned off for good if the kernel or device refuses it */
+    if (gso_on && tx_cnt > 1) {
+        ret = flush_gso(run, flags);
+        if (ret >= 0 || (errno != EIO && errno != EINVAL)) {
+            zc_sent(run, ret);
+            tx_cnt = 0;
+            return ret;
+        }
+        warn("UDP segmentation offload failed, using plain datagrams");
+        gso_off();
+    }
+
+    if (tx_cnt == 1) {
+        ret = sendmsg(sock, &tx_mmsg[0].msg_hdr, flags);
+        sent = (ret < 0) ? 0 : 1;
+    } else {
+        while (sent < tx_cnt) {
+            ret = sendmmsg(sock, tx_mmsg + sent, tx_cnt - sent, flags);
+            if (ret < 0) {
+                break;
+            }
+            sent += ret;
+        }
+    }
+    zc_sent(1, sent);
+    tx_cnt = 0;
+
+    return ret;
+}
+
+/* Queue one frame for a client straight from the file mapping */
+int queue_frame(msg_t *d, struct sockaddr_in *to, char *fbuf, uint64_t file_len, uint32_t frame, uint32_t id, int flags) {
+    uint64_t off = (uint64_t) frame*id;
+    uint8_t *hdr;
+    struct msghdr *mh;
+
+    /* A batch is segmented at one frame size */
+    if (tx_cnt > 0 && frame != tx_frame && flush_frames() < 0) {
+        return -1;
+    }
+    mh = &tx_mmsg[tx_cnt].msg_hdr;
+
+    /* Zero-copy headers must stay put until the kernel is done, so they come from the ring */
+    if (tx_cnt == 0) {
+        tx_zc = zc_on;
+        tx_zc_first = zc_head;
+        tx_frame = frame;
+    }
+    hdr = tx_zc ? zc_slot() : tx_hdr[tx_cnt];
+
+    /* Each frame in the batch needs its own copy of the header */
+    wire_put(hdr, d);
+    put_u32(hdr + MSG_HDR, id);
+    hdr[MSG_HDR + 4] = flags;
+
+    /* Header from the slot, payload from the mapping (last frame is short) */
+    tx_iov[tx_cnt][0].iov_base = hdr;
+    tx_iov[tx_cnt][0].iov_len = MSG_HDR + FRAME_HDR;
+    tx_iov[tx_cnt][1].iov_base = fbuf + off;
+    tx_iov[tx_cnt][1].iov_len = frame_len(file_len, frame, id);
+    put_u32(hdr + MSG_HDR + FRAME_CRC, frame_crc(hdr + MSG_HDR, (uint8_t *) fbuf + off, tx_iov[tx_cnt][1].iov_len));
+    tx_bytes += tx_iov[tx_cnt][1].iov_len;
+
+    memset(mh, 0, sizeof(struct msghdr));
+    mh->msg_name = to;
+    mh->msg_namelen = sizeof(struct sockaddr_in);
+    mh->msg_iov = tx_iov[tx_cnt];
+    mh->msg_iovlen = 2;
+
+    if (++tx_cnt < batch_size) {
+        return 0;
+    }
+    return flush_frames();
+}
+
+/* Queue a parity frame for frames [first, first + n), its payload gets its own copy in the batch */
+int queue_parity(msg_t *d, struct sockaddr_in *to, uint8_t *par, uint32_t frame, uint32_t first, int n, int flags) {
+    uint8_t *hdr;
+    struct msghdr *mh;
+    uint32_t func = GET_PARITY;
+
+    /* The copy is reused once sent, so it can't ride in a zero-copy batch and goes on its own,
+     * and it can't follow the short last frame of the file inside one segmentation run */
+    if (tx_cnt > 0 && (tx_zc || frame != tx_frame || tx_iov[tx_cnt - 1][1].iov_len < frame) && flush_frames() < 0) {
+        return -1;
+    }
+    if (tx_cnt == 0) {
+        tx_zc = 0;
+        tx_frame = frame;
+    }
+    hdr = tx_hdr[tx_cnt];
+    mh = &tx_mmsg[tx_cnt].msg_hdr;
+
+    wire_put(hdr, d);
+    hdr[0] = d->oper << 4 | func;
+    put_u32(hdr + MSG_HDR, first);
+    hdr[MSG_HDR + 4] = n << FRAME_FLAGS | flags;
+    memcpy(tx_par + (size_t) FRAME_MAX*tx_cnt, par, frame);
+    put_u32(hdr + MSG_HDR + FRAME_CRC, frame_crc(hdr + MSG_HDR, par, frame));
+
+    tx_iov[tx_cnt][0].iov_base = hdr;
+    tx_iov[tx_cnt][0].iov_len = MSG_HDR + FRAME_HDR;
+    tx_iov[tx_cnt][1].iov_base = tx_par + (size_t) FRAME_MAX*tx_cnt;
+    tx_iov[tx_cnt][1].iov_len = frame;
+    tx_bytes += frame;
+    tx_parity++;
+
+    memset(mh, 0, sizeof(struct msghdr));
+    mh->msg_name = to;
+    mh->msg_namelen = sizeof(struct sockaddr_in);
+    mh->msg_iov = tx_iov[tx_cnt];
+    mh->msg_iovlen = 2;
+
+    if (++tx_cnt < batch_size && !zc_on) {
+        return 0;
+    }
+    return flush_frames();
+}
+
+/* Send up to win unacked frames, the last one polls for a selective ack, and move high past the
+ * furthest frame sent (those before it that go again are resends) */
+int send_round(msg_t *d, rtt_t *rtt, struct sockaddr_in *to, char *fbuf, uint64_t file_len, uint32_t frame, bits_t *acked, uint32_t curr_dpkt, uint32_t num_dpkt, uint32_t rwnd, int win, int group, uint32_t *high) {
+    int64_t prev = -1;
+    int cnt = 0;
+    uint32_t end = (num_dpkt - curr_dpkt < rwnd) ? num_dpkt : curr_dpkt + rwnd;
+    uint8_t par[FRAME_MAX];
+    uint32_t par_first = 0;
+    int par_n = 0;
+
+    /* Jump straight from one unacked frame to the next */
+    for (uint32_t i = bits_ffz(acked, curr_dpkt, end); i < end && cnt < win; i = bits_ffz(acked, i + 1, end)) {
+        if (prev >= 0 && queue_frame(d, to, fbuf, file_len, frame, prev, 0) < 0) {
+            warn("Data response failure in GET");
+        }
+        prev = i;
+        cnt++;
+
+        /* Parity covers runs of consecutive frames, sent right after the last frame of its run */
+        if (group == 0) {
+            continue;
+        }
+        if (par_n > 0 && (i != par_first + par_n || par_n == group)) {
+            if (par_n >= FEC_MIN_GROUP && queue_parity(d, to, par, frame, par_first, par_n, 0) < 0) {
+                warn("Parity failure in GET");
+            }
+            par_n = 0;
+        }
+        if (par_n == 0) {
+            memset(par, 0, frame);
+            par_first = i;
+        }
+        xor_into(par, (uint8_t *) fbuf + (size_t) frame*i, frame_len(file_len, frame, i));
+        par_n++;
+    }
+
+    /* Only the poll times the round, so it carries a fresh timestamp */
+    rtt_stamp(rtt, d);
+    if (prev >= 0 && queue_frame(d, to, fbuf, file_len, frame, prev, FRAME_POLL) < 0) {
+        warn("Data response failure in GET");
+    }
+
+    /* Last run's parity follows the poll and polls as well, for when it is the poll that got lost */
+    if (par_n >= FEC_MIN_GROUP && queue_parity(d, to, par, frame, par_first, par_n, FRAME_POLL) < 0) {
+        warn("Parity failure in GET");
+    }
+    if (tx_cnt > 0 && flush_frames() < 0) {
+        warn("Data response failure in GET");
+    }
+    if (prev >= *high) {
+        *high = prev + 1;
+    }
+
+    return cnt;
+}
+
+/* Bucket for a client address and transfer ID */
+uint32_t sess_key(struct sockaddr_in *addr, uint32_t xid) {
+    uint32_t h = addr->sin_addr.s_addr ^ ((uint32_t) addr->sin_port << 16) ^ xid;
+
+    return (h * 2654435761u) >> (32 - SESS_HASH_BITS);
+}
+
+/* Current time in wheel ticks */
+uint64_t now_tick() {
+    return (uint64_t) (now_sec() / WHEEL_TICK);
+}
+
+/* Start or stop the periodic tick that drives the wheel */
+void wheel_tick(int on) {
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    if (on) {
+        its.it_value.tv_nsec = WHEEL_TICK * 1e9;
+        its.it_interval.tv_nsec = WHEEL_TICK * 1e9;
+    }
+    if (timerfd_settime(timer_fd, 0, &its, NULL) < 0) {
+        warn("Couldn't set timer");
+    }
+    wheel_ticking = on;
+}
+
+/* Put a session into the slot for its expiry, the level depends on how far away it is */
+void wheel_insert(sess_t *s) {
+    uint64_t delta = s->t_expire - wheel_now;
+    int level = 0;
+
+    while (level < WHEEL_LEVELS - 1 && delta >= (1ULL << (WHEEL_BITS*(level + 1)))) {
+        level++;
+    }
+    s->t_slot = &wheel[level][(s->t_expire >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1)];
+    s->t_prev = NULL;
+    s->t_next = *s->t_slot;
+    if (s->t_next != NULL) {
+        s->t_next->t_prev = s;
+    }
+    *s->t_slot = s;
+}
+
+/* Disarm a session timer */
+void timer_stop(sess_t *s) {
+    if (s->t_expire == 0) {
+        return;
+    }
+    if (s->t_prev != NULL) {
+        s->t_prev->t_next = s->t_next;
+    } else {
+        *s->t_slot = s->t_next;
+    }
+    if (s->t_next != NULL) {
+        s->t_next->t_prev = s->t_prev;
+    }
+    s->t_expire = 0;
+    wheel_armed--;
+}
+
+/* Arm a session timer to fire secs from now */
+void timer_set(sess_t *s, double secs) {
+    uint64_t ticks = secs / WHEEL_TICK;
+
+    timer_stop(s);
+    if (wheel_armed == 0) {
+        wheel_now = now_tick();
+    }
+    if (ticks < 1) {
+        ticks = 1;
+    }
+    if (ticks >= 1ULL << (WHEEL_BITS*WHEEL_LEVELS)) {
+        ticks = (1ULL << (WHEEL_BITS*WHEEL_LEVELS)) - 1;
+    }
+    s->t_expire = wheel_now + ticks;
+    wheel_insert(s);
+    wheel_armed++;
+    if (!wheel_ticking) {
+        wheel_tick(1);
+    }
+}
+
+/* Find the session for a client address and transfer ID */
+sess_t *sess_find(struct sockaddr_in *addr, uint32_t xid) {
+    sess_t *s;
+
+    for (s = sess_hash[sess_key(addr, xid)]; s != NULL; s = s->h_next) {
+        if (s->xid == xid && s->addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+            s->addr.sin_port == addr->sin_port) {
+            return s;
+        }
+    }
+    return NULL;
+}
+
+/* Claim a free slot for a new transfer, NULL if the table is full */
+sess_t *sess_new(struct sockaddr_in *addr, uint32_t xid, uint32_t oper) {
+    sess_t *s;
+    uint32_t key = sess_key(addr, xid);
+
+    if (sess_idle != NULL) {
+        s = sess_idle;
+        sess_idle = s->h_next;
+    } else if (sess_top < MAX_SESSIONS) {
+        s = &sessions[sess_top++];
+    } else {
+        return NULL;
+    }
+
+    memset(s, 0, sizeof(sess_t));
+    s->used = 1;
+    s->addr = *addr;
+    s->xid = xid;
+    s->oper = oper;
+    s->success = -1;
+    s->heard = now_sec();
+    s->started = s->heard;
+    rtt_init(&s->rtt);
+    STAT_INC(sessions, 1);
+    STAT_INC(active, 1);
+    s->h_next = sess_hash[key];
+    sess_hash[key] = s;
+    return s;
+}
+
+/* Bucket for a file name */
+uint32_t hot_key(char *name) {
+    return hash64((uint8_t *) name, strlen(name)) >> (64 - HOT_HASH_BITS);
+}
+
+/* Free a cache entry, zero-copy sends may still point into its copy */
+void hot_free(hot_t *h) {
+    zc_unmap(h->buf, h->len);
+    free(h->name);
+    free(h);
+}
+
+/* Take an entry off the recently sent list */
+void hot_unlink(hot_t *h) {
+    if (h->prev != NULL) {
+        h->prev->next = h->next;
+    } else {
+        hot_head = h->next;
+    }
+    if (h->next != NULL) {
+        h->next->prev = h->prev;
+    } else {
+        hot_tail = h->prev;
+    }
+}
+
+/* Put an entry at the front of the recently sent list */
+void hot_front(hot_t *h) {
+    h->prev = NULL;
+    h->next = hot_head;
+    if (hot_head != NULL) {
+        hot_head->prev = h;
+    } else {
+        hot_tail = h;
+    }
+    hot_head = h;
+}
+
+/* Take an entry out of the cache, its copy goes now or when the last GET sending it is done */
+void hot_evict(hot_t *h) {
+    hot_t **p;
+
+    for (p = &hot_hash[hot_key(h->name)]; *p != NULL; p = &(*p)->h_next) {
+        if (*p == h) {
+            *p = h->h_next;
+            break;
+        }
+    }
+    hot_unlink(h);
+    hot_bytes -= h->len;
+    h->listed = 0;
+    if (h->refs == 0) {
+        hot_free(h);
+    }
+}
+
+/* Drop every cached copy of a file that was written, replaced or deleted */
+void hot_forget(char *name) {
+    hot_t *h;
+    hot_t *next;
+
+    for (h = hot_hash[hot_key(name)]; h != NULL; h = next) {
+        next = h->h_next;
+        if (strcmp(h->name, name) == 0) {
+            hot_evict(h);
+        }
+    }
+}
+
+/* A GET is done sending from an entry */
+void hot_put(hot_t *h) {
+    h->refs--;
+    if (h->refs == 0 && !h->listed) {
+        hot_free(h);
+    }
+}
+
+/* Whether an entry is still a copy of the file as st has it, any write moves the ctime, even one
+ * that puts the mtime back after */
+int hot_current(hot_t *h, struct stat *st) {
+    return (uint64_t) st->st_ino == h->ino && (uint64_t) st->st_size == h->raw_len &&
+           (uint64_t) st->st_mtime == h->mtime && st->st_ctim.tv_sec == h->ctime.tv_sec &&
+           st->st_ctim.tv_nsec == h->ctime.tv_nsec;
+}
+
+/* Send a GET from an entry, the file checksum comes with the copy, or is summed as the client
+ * acks until one GET has got through it all */
+void hot_use(sess_t *s, hot_t *h) {
+    hot_unlink(h);
+    hot_front(h);
+    h->refs++;
+    s->hot = h;
+    s->fbuf = h->buf;
+    s->file_len = h->len;
+    s->raw_len = h->raw_len;
+    s->total = h->raw_len;
+    s->mtime = h->mtime;
+    s->codec = h->codec;
+    s->crc = h->crc_ok ? h->crc : 0;
+    s->crc_len = h->crc_ok ? h->len : 0;
+}
+
+/* Send a whole file GET from the cache, no disk reads and nothing to allocate, -1 if there is no
+ * current copy in the form the client takes (a plain copy suits a client that can't decode, and
+ * one kept for a client that can once the file turned out not to shrink) */
+int hot_load(sess_t *s, char *name, int lz) {
+    struct stat st;
+    hot_t *h;
+
+    for (h = hot_hash[hot_key(name)]; h != NULL; h = h->h_next) {
+        if ((h->lz == lz || (!lz && h->codec == COMP_NONE)) && strcmp(h->name, name) == 0) {
+            break;
+        }
+    }
+    if (h == NULL) {
+        return -1;
+    }
+    if (stat(name, &st) < 0 || !hot_current(h, &st)) {
+        hot_forget(name);
+        return -1;
+    }
+    printf("Sending %s from the hot file cache\n", name);
+    hot_use(s, h);
+    return 0;
+}
+
+/* Keep a ready-to-send copy of a file a whole file GET just loaded from st, least recently sent
+ * copies make room for it if it fits this worker's share at all. A GET that missed alongside
+ * another, or a plain copy loaded again for a client that can decode, finds the copy already
+ * kept and sends that, dropping its own */
+void hot_keep(sess_t *s, char *name, int lz, struct stat *st) {
+    hot_t *h;
+    hot_t *next;
+    uint64_t budget = hot_budget / workers;
+
+    for (h = hot_hash[hot_key(name)]; h != NULL; h = next) {
+        next = h->h_next;
+        if (strcmp(h->name, name) != 0) {
+            continue;
+        }
+        if (!hot_current(h, st)) {
+            hot_evict(h);
+        } else if (h->codec == s->codec) {
+            h->lz |= lz;
+            munmap(s->fbuf, s->file_len);
+            hot_use(s, h);
+            return;
+        }
+    }
+    if (s->file_len > budget) {
+        return;
+    }
+    h = calloc(1, sizeof(hot_t));
+    if (h == NULL || (h->name = strdup(name)) == NULL) {
+        free(h);
+        return;
+    }
+
+    /* A compressed copy is already ours with its checksum, the file mapping itself is kept and
+     * read in behind the worker's back, its pages are never dropped while it is cached */
+    if (s->codec == COMP_NONE) {
+        madvise(s->fbuf, s->file_len, MADV_WILLNEED);
+    }
+    while (hot_tail != NULL && hot_bytes + s->file_len > budget) {
+        hot_evict(hot_tail);
+    }
+
+    h->lz = lz;
+    h->buf = s->fbuf;
+    h->len = s->file_len;
+    h->raw_len = s->raw_len;
+    h->mtime = st->st_mtime;
+    h->ino = st->st_ino;
+    h->ctime = st->st_ctim;
+    h->crc = s->crc;
+    h->crc_ok = s->codec != COMP_NONE;
+    h->codec = s->codec;
+    h->refs = 1;
+    h->listed = 1;
+    h->h_next = hot_hash[hot_key(name)];
+    hot_hash[hot_key(name)] = h;
+    hot_front(h);
+    hot_bytes += h->len;
+    s->hot = h;
+}
+
+/* Count an RTT sample in its histogram bucket */
+void stats_rtt(sess_t *s, double rtt) {
+    int b = 0;
+
+    while (b < RTT_BUCKETS - 1 && rtt >= RTT_HIST_BASE * (1 << b)) {
+        b++;
+    }
+    STAT_ADD(s, rtt_hist[b], 1);
+}
+
+/* Format the transfer counters as key=value pairs, returns the length */
+int stats_format(char *buf, int n, stats_t *st) {
+    int len = 0;
+
+    len = snprintf(buf, n, "frames_sent=%" PRIu64 " frames_resent=%" PRIu64 " parity_sent=%" PRIu64 " bytes_sent=%" PRIu64
+                   " timeouts=%" PRIu64 " frames_recv=%" PRIu64 " frames_dup=%" PRIu64 " frames_bad=%" PRIu64 " frames_range=%" PRIu64 " parity_recv=%" PRIu64
+                   " frames_rebuilt=%" PRIu64 " bytes_recv=%" PRIu64 " rtt_hist=",
+                   st->frames_sent, st->frames_resent, st->parity_sent, st->bytes_sent, st->timeouts, st->frames_recv,
+                   st->frames_dup, st->frames_bad, st->frames_range, st->parity_recv, st->frames_rebuilt, st->bytes_recv);
+    for (int i = 0; i < RTT_BUCKETS && len < n; i++) {
+        len += snprintf(buf + len, n - len, "%s%" PRIu64, (i > 0) ? "," : "", st->rtt_hist[i]);
+    }
+    return (len < n) ? len : n - 1;
+}
+
+/* Log a transfer's stats, how far it got and its goodput so far, in the same form as the totals
+ * (a GET's ack point lags what the client has, so a finished one counts the whole file) */
+void stats_session(sess_t *s, char *tag) {
+    char buf[DATA_SIZE];
+    char addr[INET_ADDRSTRLEN];
+    double secs = now_sec() - s->started;
+    uint64_t good = (uint64_t) s->frame*s->curr_dpkt;
+
+    if (s->complete || good > s->file_len) {
+        good = s->file_len;
+    }
+    stats_format(buf, sizeof(buf), &s->st);
+    inet_ntop(AF_INET, &s->addr.sin_addr, addr, sizeof(addr));
+    printf("%s worker=%d xid=%" PRIu32 " client=%s:%d oper=%s secs=%.3f bytes_good=%" PRIu64 " goodput_mbps=%.2f srtt_ms=%.3f %s\n",
+           tag, worker_id, s->xid, addr, ntohs(s->addr.sin_port), oper_names[s->oper], secs, good,
+           (secs > 0) ? good*8/secs/1e6 : 0, s->rtt.srtt*1e3, buf);
+}
+
+/* Dump this worker's totals and the transfers it has going */
+void stats_dump() {
+    char buf[DATA_SIZE];
+
+    stats_format(buf, sizeof(buf), &stats);
+    printf("stats worker=%d time=%ld sessions=%" PRIu64 " active=%" PRIu64 " abandoned=%" PRIu64 " %s\n",
+           worker_id, (long) time(NULL), stats.sessions, stats.active, stats.abandoned, buf);
+    for (int i = 0; i < sess_top; i++) {
+        if (sessions[i].used && sessions[i].num_dpkt > 0) {
+            stats_session(&sessions[i], "progress");
+        }
+    }
+}
+
+/* Answer a stats query with every worker's totals added up, each figure is read atomically but a
+ * worker mid-update may leave one a moment behind another */
+void stats_reply(msg_t *rec) {
+    msg_t r;
+    stats_t sum;
+    uint64_t *from;
+    int len = 0;
+
+    memset(&sum, 0, sizeof(sum));
+    for (int w = 0; w < workers; w++) {
+        from = (uint64_t *) worker_stats[w];
+        for (size_t i = 0; from != NULL && i < sizeof(stats_t) / sizeof(uint64_t); i++) {
+            ((uint64_t *) &sum)[i] += __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+        }
+    }
+
+    r.oper = OPER_STATS;
+    r.func = STATS_INIT;
+    r.xid = rec->xid;
+    r.ts = 0;
+    r.ts_echo = 0;
+    len = snprintf((char *) r.data, DATA_SIZE, "workers=%d sessions=%" PRIu64 " active=%" PRIu64 " abandoned=%" PRIu64 " ",
+                   workers, sum.sessions, sum.active, sum.abandoned);
+    len += stats_format((char *) r.data + len, DATA_SIZE - len, &sum);
+    if (msg_send(&r, len + 1, &client_addr) < 0) {
+        warn("Stats response failure");
+    }
+}
+
+/* Build the copy a GET sends (its signatures or compressed copy) into buf from its mapped file
+ * before answering its INIT, -1 if the INIT can't be saved */
+int prep_start(sess_t *s, msg_t *rec, int stage, char *buf, int keep, struct stat *st) {
+    s->pend = malloc(sizeof(msg_t));
+    if (s->pend == NULL) {
+        return -1;
+    }
+    memcpy(s->pend, rec, sizeof(msg_t));
+    s->prep = stage;
+    s->src = s->fbuf;
+    s->src_off = 0;
+    s->fbuf = buf;
+    s->file_len = 0;
+    s->crc = 0;
+    s->keep = keep;
+    s->src_st = *st;
+    s->p_next = NULL;
+    if (prep_tail != NULL) {
+        prep_tail->p_next = s;
+    } else {
+        prep_head = s;
+    }
+    prep_tail = s;
+    return 0;
+}
+
+/* Take a GET off the build list, and unless it finished drop what it was building */
+void prep_stop(sess_t *s, int done) {
+    sess_t *prev = NULL;
+
+    for (sess_t *t = prep_head; t != NULL; prev = t, t = t->p_next) {
+        if (t == s) {
+            if (prev != NULL) {
+                prev->p_next = s->p_next;
+            } else {
+                prep_head = s->p_next;
+            }
+            if (prep_tail == s) {
+                prep_tail = prev;
+            }
+            break;
+        }
+    }
+    if (!done) {
+        munmap(s->src, s->raw_len);
+        munmap(s->fbuf, (s->prep == PREP_SIGS) ? sig_size(s->raw_len) : comp_bound(s->raw_len));
+        s->fbuf = NULL;
+    }
+    s->prep = PREP_NONE;
+    s->src = NULL;
+    free(s->pend);
+    s->pend = NULL;
+}
+
+/* Release everything a session holds and free its slot */
+void sess_free(sess_t *s) {
+    sess_t **p;
+
+    /* A transfer leaves a line of what it cost */
+    if (s->num_dpkt > 0) {
+        stats_session(s, "session");
+    }
+    __atomic_fetch_sub(&stats.active, 1, __ATOMIC_RELAXED);
+
+    if (s->prep != PREP_NONE) {
+        prep_stop(s, 0);
+    }
+    if (s->hot != NULL) {
+        hot_put(s->hot);
+    } else if (s->oper == OPER_GET && s->fbuf != NULL) {
+        zc_unmap(s->fbuf, s->file_len);
+    } else {
+        free(s->fbuf);
+    }
+    if (s->f != NULL) {
+        fclose(s->f);
+    }
+    free(s->acked);
+    free(s->pkt_arr);
+    if (s->z != NULL && s->z->basis != NULL) {
+        munmap(s->z->basis, s->z->basis_len);
+    }
+    free(s->z);
+    free(s->name);
+    free(s->dest);
+    timer_stop(s);
+
+    /* Unhash and put the slot on the free list */
+    for (p = &sess_hash[sess_key(&s->addr, s->xid)]; *p != NULL; p = &(*p)->h_next) {
+        if (*p == s) {
+            *p = s->h_next;
+            break;
+        }
+    }
+    s->used = 0;
+    s->h_next = sess_idle;
+    sess_idle = s;
+}
+
+/* Send a message with len bytes of data to the session's client, stamped with its transfer ID and timestamps */
+int sess_send(sess_t *s, msg_t *m, int len) {
+    m->xid = s->xid;
+    rtt_stamp(&s->rtt, m);
+    return msg_send(m, len, &s->addr);
+}
+
+/* Send the next round of frames the client is missing (GET) */
+void get_round(sess_t *s) {
+    uint32_t high = s->sent_high;
+    uint64_t bytes = tx_bytes;
+    uint64_t parity = tx_parity;
+
+    s->round_start = now_sec();
+    s->round_sent = send_round(&s->d, &s->rtt, &s->addr, s->fbuf, s->file_len, s->frame, s->acked, s->curr_dpkt, s->num_dpkt, s->rwnd, cc_window(&s->cc), fec_group(s->loss), &s->sent_high);
+
+    /* Frames up to the old high were sent before, anything past it is sent for the first time */
+    STAT_ADD(s, frames_sent, s->round_sent);
+    STAT_ADD(s, frames_resent, s->round_sent - (s->sent_high - high));
+    STAT_ADD(s, parity_sent, tx_parity - parity);
+    STAT_ADD(s, bytes_sent, tx_bytes - bytes);
+
+    /* The round is out, give the poll one RTO to be answered */
+    timer_set(s, s->rtt.rto);
+}
+
+/* What a transfer is a copy of and how far it has got, to check or save as a checkpoint */
+void sess_ident(sess_t *s, ckpt_t *c) {
+    c->raw_len = s->raw_len;
+    c->mtime = s->mtime;
+    c->wire_len = s->file_len;
+    c->codec = s->codec;
+    c->frames = s->curr_dpkt;
+    c->frame = s->frame;
+    c->crc = s->crc;
+}
+
+/* Save how far a PUT has got beside the file it is writing */
+void put_ckpt(sess_t *s) {
+    ckpt_t c;
+
+    /* A stream of a parallel PUT only has part of the file, nothing a later attempt could resume */
+    if (s->ranged) {
+        return;
+    }
+    sess_ident(s, &c);
+    ckpt_save(s->name, &c, s->f, s->z);
+    s->ckpt_dpkt = s->curr_dpkt;
+}
+
+/* Add the paths of the files under dir to a growing list, one per line */
+void tree_walk(char *dir, char **buf, size_t *len, size_t *cap) {
+    DIR *dr;
+    struct dirent *de;
+    struct stat st;
+    char path[CKPT_NAME];
+    size_t n = 0;
+
+    dr = opendir(dir);
+    if (dr == NULL) {
+        return;
+    }
+    while ((de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        n = snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+        if (n >= DATA_SIZE || lstat(path, &st) < 0) {
+            continue;
+        }
+        if (S_ISDIR(st.st_mode)) {
+            tree_walk(path, buf, len, cap);
+            continue;
+        }
+        if (!S_ISREG(st.st_mode)) {
+            continue;
+        }
+        while (*len + n + 1 > *cap) {
+            *cap = *cap ? 2 * *cap : 4096;
+            *buf = realloc(*buf, *cap);
+        }
+        memcpy(*buf + *len, path, n);
+        (*buf)[*len + n] = '\n';
+        *len += n + 1;
+    }
+    closedir(dr);
+}
+
+/* Map the list of files under dir, sent in place of a file for a recursive GET, MAP_FAILED if
+ * there are none */
+char *tree_map(char *dir, uint64_t *len) {
+    char *buf = NULL;
+    size_t n = 0;
+    size_t cap = 0;
+    char *map;
+
+    tree_walk(dir, &buf, &n, &cap);
+    *len = n;
+    if (n == 0) {
+        free(buf);
+        return MAP_FAILED;
+    }
+    map = mmap(NULL, n, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map != MAP_FAILED) {
+        memcpy(map, buf, n);
+    }
+    free(buf);
+    return map;
+}
+
+/* Fold what the client has into the file checksum, before its pages are dropped (a compressed
+ * copy can't be read back as file data, so that was summed whole up front) */
+void get_digest(sess_t *s, uint64_t upto) {
+    if (s->codec == COMP_NONE && upto > s->crc_len) {
+        s->crc = crc32c(s->crc, (uint8_t *) s->fbuf + s->crc_len, upto - s->crc_len);
+        s->crc_len = upto;
+    }
+}
+
+/* Get operation server side, one client message at a time */
+void get(sess_t *s, msg_t *rec) {
+    int ret = 0;
+    msg_t init;
+    msg_t done;
+    int fd = -1;
+    struct stat st;
+    char *zbuf;
+    ckpt_t ck;
+    ckpt_t cur;
+    int newly = 0;
+    int lost = 0;
+    int rebuilt = 0;
+    uint64_t off = 0;
+    char *name = rec->data + 9 + RESUME_SIZE + RANGE_SIZE;
+    int tree = (rec->data[4] & GET_TREE) != 0;
+    int whole = 0;
+ 
+    /* Create init response */
+    init.oper = OPER_GET;
+    init.func = GET_INIT;
+    init.data[0] = 0;
+
+    /* Create done packet */
+    done.oper = OPER_GET;
+    done.func = GET_DONE;  
+    done.data[0] = 0;
+
+    /* Send init response  with file size */
+    if (rec->func == GET_INIT) {
+
+        /* Still building what is sent, the INIT is answered once it is ready */
+        if (s->prep != PREP_NONE) {
+            return;
+        }
+        printf("Received GET init\n");
+//        printf("Filename is %s\n",rec->data+9+RESUME_SIZE+RANGE_SIZE);
+
+        /* Never have more frames in flight than the client can hold */
+        s->rwnd = get_u32(rec->data);
+        if (s->rwnd == 0) {
+            s->rwnd = 1;
+        }
+
+        /* Map the file, frames are sent straight from the page cache (a directory for a recursive
+         * GET is sent as the list of files under it), unless a whole file GET finds a copy of it
+         * in the hot file cache */
+        whole = !tree && !(rec->data[4] & (GET_RANGE | GET_SIGS)) && path_ok(name);
+        if (s->fbuf == NULL && (!whole || hot_load(s, name, (rec->data[4] & 1 << COMP_LZ) != 0) < 0)) {
+            fd = path_ok(name) ? open(name, O_RDONLY) : -1;
+            if (fd < 0 || fstat(fd, &st) < 0 || !(tree ? S_ISDIR(st.st_mode) : S_ISREG(st.st_mode))) {
+                warn("Couldn't open file");
+                tree = 0;
+                st.st_size = 0;
+                st.st_mtime = 0;
+            }
+            s->file_len = st.st_size;
+            s->mtime = st.st_mtime;
+            s->total = st.st_size;
+
+            /* One stream of a parallel GET only maps its range, which has to start on a page */
+            if (rec->data[4] & GET_RANGE) {
+                off = get_u64(rec->data + 5 + RESUME_SIZE);
+                s->file_len = get_u64(rec->data + 5 + RESUME_SIZE + 8);
+                if (off >= s->total || off % getpagesize() != 0) {
+                    s->file_len = 0;
+                } else if (s->file_len > s->total - off) {
+                    s->file_len = s->total - off;
+                }
+            }
+
+            /* Empty files and files too big for 32 bit frame IDs are refused like missing ones */
+            if (s->file_len > MAX_FILE_LEN) {
+                printf("File too large for GET\n");
+                s->file_len = 0;
+            }
+            if (tree) {
+                s->fbuf = tree_map(name, &s->file_len);
+                s->total = s->file_len;
+            } else if (s->file_len > 0) {
+                s->fbuf = mmap(NULL, s->file_len, PROT_READ, MAP_SHARED, fd, off);
+                if (s->fbuf == MAP_FAILED) {
+                    warn("Couldn't map file");
+                }
+            }
+            if (s->fbuf == MAP_FAILED) {
+                s->fbuf = NULL;
+                s->file_len = 0;
+            }
+            if (fd >= 0) {
+                close(fd);
+            }
+            if (s->file_len == 0) {
+                put_u64(init.data, 0);
+                put_u64(init.data + 9, 0);
+                put_u64(init.data + 21, s->mtime);
+                put_u64(init.data + 29, s->total);
+                sess_send(s, &init, 37);
+                sess_free(s);
+                return;
+            }
+
+            /* Read ahead aggressively and drop pages once they're behind us */
+            madvise(s->fbuf, s->file_len, MADV_SEQUENTIAL);
+
+            /* Client is after a delta PUT, send it our block signatures in place of the file, they
+             * are worked out a few blocks at a time like a compressed copy */
+            s->raw_len = s->file_len;
+            if (rec->data[4] & GET_SIGS) {
+                zbuf = mmap(NULL, sig_size(s->raw_len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (zbuf != MAP_FAILED && prep_start(s, rec, PREP_SIGS, zbuf, 0, &st) == 0) {
+                    sig_head(s->raw_len, s->mtime, (uint8_t *) zbuf);
+                    s->file_len = SIG_HDR;
+                    return;
+                }
+                warn("Couldn't map signatures");
+                if (zbuf != MAP_FAILED) {
+                    munmap(zbuf, sig_size(s->raw_len));
+                }
+                put_u64(init.data, 0);
+                sess_send(s, &init, 8);
+                sess_free(s);
+                return;
+            }
+
+            /* Send a compressed copy instead if the client can decode it and a sample of the file
+             * shrinks, it is coded a few blocks at a time between other transfers' messages */
+            if ((rec->data[4] & 1 << COMP_LZ) && comp_worth((uint8_t *) s->fbuf, s->raw_len)) {
+                zbuf = mmap(NULL, comp_bound(s->raw_len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (zbuf != MAP_FAILED && prep_start(s, rec, PREP_LZ, zbuf, whole, &st) == 0) {
+                    return;
+                }
+                if (zbuf != MAP_FAILED) {
+                    munmap(zbuf, comp_bound(s->raw_len));
+                }
+            }
+
+            /* Keep what is sent for the next GET of the file */
+            if (whole) {
+                hot_keep(s, name, (rec->data[4] & 1 << COMP_LZ) != 0, &st);
+            }
+        }
+
+        /* Set up the frames once, a repeated INIT only gets the reply again */
+        if (s->acked == NULL) {
+
+            /* Frames are the size the client's path takes, or the size of the frames it already
+             * holds of this very file from an earlier attempt */
+            resume_get(rec->data + 5, &ck);
+            sess_ident(s, &cur);
+            if (!ckpt_match(&ck, &cur) || frame_pick(ck.frame) != ck.frame) {
+                ck.frames = 0;
+            }
+            s->frame = frame_pick((ck.frames > 0) ? ck.frame : get_u32(rec->data + 5 + RESUME_SIZE + RANGE_SIZE));
+
+            /* Calculate number of packets and set up the frame template */
+            s->num_dpkt = (s->file_len + (s->frame - 1)) / s->frame;
+            s->acked = bits_new(s->num_dpkt);
+            if (s->acked == NULL) {
+                warn("Couldn't allocate GET acks");
+                put_u64(init.data, 0);
+                sess_send(s, &init, 8);
+                sess_free(s);
+                return;
+            }
+            s->d.oper = OPER_GET;
+            s->d.func = GET_DATA;
+            s->d.xid = s->xid;
+            cc_init(&s->cc, cc_algo);
+
+            /* Skip what the client already has */
+            if (ck.frames > 0 && ck.frames < s->num_dpkt) {
+                printf("Resuming GET at frame %" PRIu32 "\n", ck.frames);
+                bits_fill(s->acked, 0, ck.frames, 1);
+                s->curr_dpkt = ck.frames;
+            }
+            s->sent_high = s->curr_dpkt;
+        }
+
+        /* Set length sent, its codec, the file size, where the client resumes (no ack can have
+         * moved that yet), the mtime it checks a later resume against, the whole file's size and
+         * the frame size */
+        put_u64(init.data, s->file_len);
+        init.data[8] = s->codec;
+        put_u64(init.data + 9, s->raw_len);
+        put_u32(init.data + 17, s->curr_dpkt);
+        put_u64(init.data + 21, s->mtime);
+        put_u64(init.data + 29, s->total);
+        put_u32(init.data + 37, s->frame);
+
+        /* Send init response */
+        ret = sess_send(s, &init, 41);
+        if (ret < 0) {
+            warn("Init response failure in GET");
+        }
+        return;
+    }
+
+    /* Selective ack, resend only the frames the client is missing */
+    if (rec->func == GET_SACK && s->acked != NULL) {
+        s->curr_dpkt = sack_apply(rec, s->acked, s->curr_dpkt, s->num_dpkt, &newly, &rebuilt);
+        //printf("Pkt ID is %d\n", s->curr_dpkt);
+
+        /* Late ack for a round we already resent, another round would double what is in flight */
+        if (rtt_stale(&s->d, rec)) {
+            return;
+        }
+
+        /* Whatever the ack didn't cover from the last round was lost */
+        if (s->round_sent > 0) {
+            lost = s->round_sent - newly;
+            cc_on_round(&s->cc, s->round_sent, newly, lost > 0 ? lost : 0, now_sec() - s->round_start);
+
+            /* Loss before parity repair sets the parity rate, what is left after it would undersell the link */
+            s->loss = (1 - FEC_LOSS_EWMA)*s->loss + FEC_LOSS_EWMA*fmax(lost + rebuilt, 0) / s->round_sent;
+        }
+
+        /* Release mapped pages the client has, so RSS doesn't grow with the file (a cached copy
+         * stays whole for the next GET) */
+        get_digest(s, ((uint64_t) s->frame*s->curr_dpkt < s->file_len) ? (uint64_t) s->frame*s->curr_dpkt : s->file_len);
+        while (s->hot == NULL && (uint64_t) s->frame*s->curr_dpkt - s->dropped >= MAP_DROP_SIZE) {
+            madvise(s->fbuf + s->dropped, MAP_DROP_SIZE, MADV_DONTNEED);
+            s->dropped += MAP_DROP_SIZE;
+        }
+
+        /* Send next round of missing packets */
+        get_round(s);
+        return;
+    }
+
+    /* Agree that we are done with our checksum of the file, and release file and ack array */
+    if (rec->func == GET_DONE) {
+        get_digest(s, s->file_len);
+        s->complete = 1;
+
+        /* Later GETs from the cache can take the checksum this one summed */
+        if (s->hot != NULL && !s->hot->crc_ok && s->crc_len == s->file_len) {
+            s->hot->crc = s->crc;
+            s->hot->crc_ok = 1;
+        }
+        done.data[0] = 1;
+        put_u32(done.data + 1, s->crc);
+        ret = sess_send(s, &done, 5);
+        if (ret < 0) {
+            warn("Done response failure in GET");
+        }
+        sess_free(s);
+    }
+}
+
+/* Build the next few blocks of the copy the first GET waiting on one sends, and once it is whole
+ * keep it if it is a whole file and answer the saved INIT (signatures may go on to be compressed) */
+void prep_run() {
+    sess_t *s = prep_head;
+    msg_t *rec;
+    char *zbuf;
+    uint32_t block = 0;
+    uint64_t n = 0;
+
+    if (s == NULL) {
+        return;
+    }
+    n = (uint64_t) COMP_BLOCK*PREP_BLOCKS;
+    if (s->prep == PREP_SIGS) {
+        block = sig_block(s->raw_len);
+        n -= n % block;
+    }
+    if (n > s->raw_len - s->src_off) {
+        n = s->raw_len - s->src_off;
+    }
+    if (s->prep == PREP_SIGS) {
+        sig_build((uint8_t *) s->src + s->src_off, n, block, (uint8_t *) s->fbuf + s->file_len);
+        s->file_len += SIG_ENTRY*(n / block);
+    } else {
+        s->crc = crc32c(s->crc, (uint8_t *) s->src + s->src_off, n);
+        s->file_len += comp_stream((uint8_t *) s->src + s->src_off, n, (uint8_t *) s->fbuf + s->file_len);
+    }
+    s->src_off += n;
+
+    /* Not done, the next GET waiting gets a turn */
+    if (s->src_off < s->raw_len) {
+        if (s != prep_tail) {
+            prep_head = s->p_next;
+            prep_tail->p_next = s;
+            prep_tail = s;
+            s->p_next = NULL;
+        }
+        return;
+    }
+
+    munmap(s->src, s->raw_len);
+    rec = s->pend;
+
+    /* Signatures are what is sent now, compressed too if the client can decode that and they shrink */
+    if (s->prep == PREP_SIGS) {
+        s->raw_len = s->file_len;
+        s->crc = 0;
+        if ((rec->data[4] & 1 << COMP_LZ) && comp_worth((uint8_t *) s->fbuf, s->raw_len)) {
+            zbuf = mmap(NULL, comp_bound(s->raw_len), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (zbuf != MAP_FAILED) {
+                s->prep = PREP_LZ;
+                s->src = s->fbuf;
+                s->src_off = 0;
+                s->fbuf = zbuf;
+                s->file_len = 0;
+                return;
+            }
+        }
+    } else {
+        s->fbuf = mremap(s->fbuf, comp_bound(s->raw_len), s->file_len, 0);
+        s->codec = COMP_LZ;
+    }
+    s->pend = NULL;
+    prep_stop(s, 1);
+    if (s->keep) {
+        hot_keep(s, (char *) rec->data + 9 + RESUME_SIZE + RANGE_SIZE, 1, &s->src_st);
+    }
+    get(s, rec);
+    free(rec);
+}
+
+/* Open a file one stream of a parallel PUT writes a range of, sized for the whole file (every
+ * stream sizes it the same, so they can open it in any order) and positioned at the range */
+FILE *range_open(char *file, uint64_t off, uint64_t total) {
+    int fd = -1;
+    FILE *f;
+
+    fd = open(file, O_WRONLY | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    if (off > total || ftruncate(fd, total) < 0) {
+        close(fd);
+        return NULL;
+    }
+    f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (fseeko(f, off, SEEK_SET) < 0) {
+        fclose(f);
+        return NULL;
+    }
+    return f;
+}
+
+/* Map our copy a delta PUT is against, if it is still the copy the client has the signatures
+ * (block size, file size, mtime) of */
+int delta_basis(sess_t *s, uint8_t *sig) {
+    int fd = -1;
+    struct stat st;
+    uint32_t block = get_u32(sig);
+
+    fd = open(s->dest, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0 || (uint64_t) st.st_size != get_u64(sig + 4)
+            || (uint64_t) st.st_mtime != get_u64(sig + 12) || block != sig_block(st.st_size)) {
+        close(fd);
+        return -1;
+    }
+    s->z->basis = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (s->z->basis == MAP_FAILED) {
+        s->z->basis = NULL;
+        return -1;
+    }
+    s->z->basis_len = st.st_size;
+    s->z->block = block;
+    return 0;
+}
+
+/* Put operation server side, one client message at a time */
+void put(sess_t *s, msg_t *rec) {
+    msg_t init;
+    msg_t done;
+    int ret = 0;
+    int sack_len = 0;
+    uint32_t pkt_id = 0;
+    double rtt = 0;
+    ckpt_t ck;
+    ckpt_t cur;
+
+    /* Create init response */
+    init.oper = OPER_PUT;
+    init.func = PUT_INIT;
+    init.data[0] = 0;
+
+    /* Create done packet */
+    done.oper = OPER_PUT;
+    done.func = PUT_DONE;
+    done.data[0] = 0;
+
+    /* Save progress now and then, so a later attempt can resume if this one dies */
+    if (s->f != NULL && (uint64_t) s->frame*(s->curr_dpkt - s->ckpt_dpkt) >= CKPT_BYTES) {
+        put_ckpt(s);
+    }
+
+    /* Send init response and malloc the reassembly window */
+    if (rec->func == PUT_INIT) {
+        printf("Received PUT init\n");
+        //printf("Filename is %s\n",rec->data+65);
+
+        /* Get file size */
+        s->file_len = get_u64(rec->data);
+        if (s->file_len > MAX_FILE_LEN) {
+            printf("File too large for PUT\n");
+            sess_send(s, &init, 1);
+            sess_free(s);
+            return;
+        }
+
+        /* Refuse codecs we can't decode */
+        if (rec->data[8] != COMP_NONE && rec->data[8] != COMP_LZ && rec->data[8] != COMP_DELTA) {
+            printf("Unknown codec for PUT\n");
+            sess_send(s, &init, 1);
+            sess_free(s);
+            return;
+        }
+
+        /* Open file buffer */
+        if (s->f == NULL) {
+            s->codec = rec->data[8];
+            s->raw_len = get_u64(rec->data + 9);
+            s->mtime = get_u64(rec->data + 17);
+            s->name = strdup(rec->data + 65);
+            if (!path_ok(s->name) || make_parents(s->name) < 0) {
+                printf("Refused PUT path %s\n", s->name);
+                sess_send(s, &init, 1);
+                sess_free(s);
+                return;
+            }
+            s->total = get_u64(rec->data + 53);
+            s->ranged = get_u64(rec->data + 45) != 0 || s->total != s->raw_len;
+            if (s->codec != COMP_NONE) {
+                s->z = calloc(1, sizeof(zdec_t));
+                s->z->have = 0;
+            }
+
+            /* Written beside the file and renamed over it once it checks out, never truncated in
+             * place under a GET still sending the old copy from its mapping (a stream of a
+             * parallel PUT writes its range in place) */
+            if (!s->ranged) {
+                s->dest = s->name;
+                s->name = malloc(strlen(s->dest) + sizeof(".delta"));
+                sprintf(s->name, "%s.%s", s->dest, (s->codec == COMP_DELTA) ? "delta" : "part");
+            }
+
+            /* Delta against our copy, rebuilt from the copy as it was when the client had its
+             * signatures, the reply tells the client if it has changed since */
+            if (s->codec == COMP_DELTA) {
+                if (s->ranged || delta_basis(s, rec->data + 25) < 0) {
+                    printf("Copy changed since its signatures were sent\n");
+                    init.data[0] = 2;
+                    sess_send(s, &init, 1);
+                    sess_free(s);
+                    return;
+                }
+            }
+
+            /* Pick up a partial copy an earlier attempt left of this very file (in frames of the
+             * size it was sent in), or start it over in frames the size the client's path takes,
+             * a stream of a parallel PUT writes its range in place */
+            sess_ident(s, &cur);
+            s->frame = frame_pick(get_u32(rec->data + 61));
+            if (!s->ranged && ckpt_load(s->name, &ck) == 0 && ckpt_match(&ck, &cur) && ck.frames > 0 && frame_pick(ck.frame) == ck.frame
+                    && ck.frames < (s->file_len + (ck.frame - 1)) / ck.frame) {
+                s->frame = ck.frame;
+                s->f = ckpt_open(s->name, &ck, s->z);
+            }
+            s->num_dpkt = (s->file_len + (s->frame - 1)) / s->frame;
+            if (s->ranged) {
+                s->f = range_open(s->name, get_u64(rec->data + 45), s->total);
+            } else if (s->f != NULL) {
+                printf("Resuming PUT at frame %" PRIu32 "\n", ck.frames);
+                s->curr_dpkt = ck.frames;
+                s->high_dpkt = ck.frames;
+                s->ckpt_dpkt = ck.frames;
+                s->crc = ck.crc;
+            } else {
+                ckpt_drop(s->name);
+                if (s->z != NULL) {
+                    s->z->have = 0;
+                }
+                s->f = fopen(s->name, "wb");
+            }
+            if (s->f == NULL) {
+                warn("Couldn't open file");
+                sess_send(s, &init, 1);
+                sess_free(s);
+                return;
+            }
+
+            /* Allocate window of frames, written out as the front completes */
+            s->fbuf = malloc((size_t) s->frame*rx_window);
+            s->pkt_arr = bits_new(rx_window);
+            if (s->fbuf == NULL || s->pkt_arr == NULL) {
+                warn("Couldn't allocate PUT window");
+                sess_send(s, &init, 1);
+                sess_free(s);
+                return;
+            }
+            s->d.oper = OPER_PUT;
+            s->d.func = PUT_SACK;
+        }
+
+        /* Set okay response, our window, where the client resumes (no frame can have moved
+         * that yet) and the frame size in init packet */
+        init.data[0] = 1;
+        put_u32(init.data + 1, rx_window);
+        put_u32(init.data + 5, s->curr_dpkt);
+        put_u32(init.data + 9, s->frame);
+
+        /* Send init response */
+        ret = sess_send(s, &init, 13);
+        if (ret < 0) {
+            warn("Init response failure in PUT");
+        }
+        return;
+    }
+
+    /* Handle data packet */
+    if (rec->func == PUT_DATA && s->pkt_arr != NULL) {
+        
+        /* Decode packet ID, frames that fail their checksum are dropped and resent like lost ones
+         * (counted, not logged, this is the hot path) */
+        pkt_id = get_u32(rec->data);
+        //printf("Pkt ID is %d\n", pkt_id);
+        if (pkt_id >= s->num_dpkt) {
+            STAT_ADD(s, frames_range, 1);
+            return;
+        }
+        if (!frame_ok(rec->data, frame_len(s->file_len, s->frame, pkt_id))) {
+            STAT_ADD(s, frames_bad, 1);
+            return;
+        }
+        STAT_ADD(s, frames_recv, 1);
+        STAT_ADD(s, bytes_recv, frame_len(s->file_len, s->frame, pkt_id));
+        if (pkt_id < s->curr_dpkt || (pkt_id - s->curr_dpkt < rx_window && bits_test(s->pkt_arr, pkt_id % rx_window))) {
+            STAT_ADD(s, frames_dup, 1);
+        }
+        if (pkt_id >= s->curr_dpkt && pkt_id < s->num_dpkt && pkt_id - s->curr_dpkt < rx_window) {
+
+            /* Save into window and write out what is now contiguous */
+            rx_store(s->fbuf, s->pkt_arr, rx_window, s->frame, s->curr_dpkt, s->num_dpkt, pkt_id, rec->data + FRAME_HDR);
+            if (pkt_id >= s->high_dpkt) {
+                s->high_dpkt = pkt_id + 1;
+            }
+            if (pkt_id == s->curr_dpkt) {
+                s->curr_dpkt = rx_flush(s->f, s->z, &s->crc, s->fbuf, s->pkt_arr, rx_window, s->frame, s->curr_dpkt, s->num_dpkt, s->file_len);
+            }
+        }
+
+        /* Last frame of a round, tell the client what we have */
+        if (rec->data[4] & FRAME_POLL) {
+            sack_len = sack_build(&s->d, s->pkt_arr, rx_window, s->curr_dpkt, s->high_dpkt, s->rebuilt);
+            ret = sess_send(s, &s->d, sack_len);
+            if (ret < 0) {
+                warn("Data request failure in PUT");
+            }
+            s->rebuilt = 0;
+        }
+        return;
+    }
+
+    /* Parity, fill in the one frame of its group that went missing */
+    if (rec->func == PUT_PARITY && s->pkt_arr != NULL) {
+        if (!frame_ok(rec->data, s->frame)) {
+            STAT_ADD(s, frames_bad, 1);
+            return;
+        }
+        STAT_ADD(s, parity_recv, 1);
+        if (fec_rebuild(s->fbuf, s->pkt_arr, rx_window, s->frame, s->curr_dpkt, s->high_dpkt, s->num_dpkt, s->file_len, rec->data)) {
+            s->rebuilt++;
+            STAT_ADD(s, frames_rebuilt, 1);
+            s->curr_dpkt = rx_flush(s->f, s->z, &s->crc, s->fbuf, s->pkt_arr, rx_window, s->frame, s->curr_dpkt, s->num_dpkt, s->file_len);
+        }
+
+        /* Stands in for the poll of its round if that never arrived (it has the same timestamp) */
+        if ((rec->data[4] & FRAME_POLL) && rec->ts != s->rtt.peer_ts) {
+            rtt = rtt_recv(&s->rtt, rec);
+            if (rtt > 0) {
+                stats_rtt(s, rtt);
+            }
+            sack_len = sack_build(&s->d, s->pkt_arr, rx_window, s->curr_dpkt, s->high_dpkt, s->rebuilt);
+            ret = sess_send(s, &s->d, sack_len);
+            if (ret < 0) {
+                warn("Data request failure in PUT");
             }
-
+            s->rebuilt = 0;
         }
+        return;
+    }
 
-        /* Get  packet from client */
-        ret = recvfrom(sock, rec, MSG_SIZE, 0 , (struct sockaddr *) &client_addr, &client_len);
+    /* Agree that we are done, once the file is all here with our checksum of what was written */
+    if (rec->func == PUT_DONE) {
+        if (s->curr_dpkt >= s->num_dpkt) {
+            done.data[0] = 1;
+            put_u32(done.data + 1, s->crc);
+            if (rec->data[0] == 1 && get_u32(rec->data + 1) != s->crc) {
+                printf("File checksum mismatch in PUT\n");
+            }
+        }
+        ret = sess_send(s, &done, done.data[0] ? 5 : 1);
         if (ret < 0) {
-            if (data_flag == 1){
-
-                /* Send request packet for curr_dpkt */
-                d.data[0] = curr_dpkt >> 8;
-                d.data[1] = curr_dpkt >> 0;
-                ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                if (ret < 0) {
-                    warn("Data request failure in PUT");
-                    continue;
+            warn("Done response failure in PUT");
+        }
+
+        /* File is already written, close it and release memory, it only replaces the copy it
+         * goes over if it checks out (GETs already sending that copy keep it until they finish) */
+        if (s->curr_dpkt >= s->num_dpkt) {
+            s->complete = 1;
+            ckpt_drop(s->name);
+            if (s->dest != NULL) {
+                fclose(s->f);
+                s->f = NULL;
+                if (rec->data[0] == 1 && get_u32(rec->data + 1) == s->crc && rename(s->name, s->dest) == 0) {
+                    if (s->codec == COMP_DELTA) {
+                        printf("Rebuilt %s from its delta\n", s->dest);
+                    }
+                } else {
+                    remove(s->name);
                 }
+            }
+            hot_forget(s->dest != NULL ? s->dest : s->name);
+            sess_free(s);
+            return;
+        }
 
-            }     
+        /* Send selective ack for missing frames */
+        if (s->pkt_arr != NULL) {
+            sack_len = sack_build(&s->d, s->pkt_arr, rx_window, s->curr_dpkt, s->high_dpkt, s->rebuilt);
+            ret = sess_send(s, &s->d, sack_len);
+            if (ret < 0) {
+                warn("Data request failure in PUT");
+            }
+            s->rebuilt = 0;
         }
     }
 }
 
-void del(msg_t *rec) {
+void del(sess_t *s, msg_t *rec) {
     msg_t init;
     msg_t done;
-    char file_name[64];
-    int success = 0;
     int ret = 0;
     FILE *f;
 
@@ -374,63 +3515,233 @@ void del(msg_t *rec) {
     done.func = GET_DONE;
     done.data[0] = 0;
 
-    while(1) {
-        
-        /* Send init response */
-        if (rec->oper == OPER_DEL && rec->func == DEL_INIT) {
-            printf("Filename is %s\n", rec->data);
-            strcpy(file_name, rec->data);
+    /* Send init response */
+    if (rec->func == DEL_INIT) {
+        printf("Filename is %s\n", rec->data);
 
-            /* Send init response */
-            ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Init response failure in DEL");
-                continue;
-            }
+        /* Send init response */
+        ret = sess_send(s, &init, 0);
+        if (ret < 0) {
+            warn("Init response failure in DEL");
+        }
 
-            /* Try to delete file, set success (default 0) */
-            f = fopen(file_name, "rb");   
+        /* Try to delete file once per session, set success (default 0) */
+        if (s->success < 0) {
+            s->success = 0;
+            f = path_ok(rec->data) ? fopen(rec->data, "rb") : NULL;
             if (f != NULL) {
                 fclose(f);
-                remove(file_name);
-                f = fopen(file_name, "rb");
+                remove(rec->data);
+                hot_forget((char *) rec->data);
+                f = fopen(rec->data, "rb");
                 if (f == NULL) {
-                    success = 1;
+                    s->success = 1;
                 } else {
                     fclose(f);
                 }
             }
-        }    
+        }
+        return;
+    }    
+
+    /* Send done with success value */
+    if (rec->func == DEL_DONE) {
+        done.data[0] = s->success > 0;
+        ret = sess_send(s, &done, 1);
+        if (ret < 0) {
+            warn("Done response failure in DEL");
+        }
+        sess_free(s);
+    }
+}
 
-        /* Send done with success value */
-        if (rec->oper == OPER_DEL && rec->func == DEL_DONE) {
-            done.data[0] = success;
-            ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
+/* Order index entries by name */
+int dent_cmp(const void *a, const void *b) {
+    return strcmp(((const dent_t *) a)->name, ((const dent_t *) b)->name);
+}
 
-            if (ret < 0) {
-                warn("Done response failure in DEL");
-            }
+/* Slot of the first index entry not before name */
+int dir_find(char *name) {
+    int lo = 0;
+    int hi = dir_cnt;
+    int mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo)/2;
+        if (strcmp(dir_ent[mid].name, name) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Fill an index entry from the inode behind name, -1 if there is none */
+int dent_stat(dent_t *e, char *name) {
+    struct stat st;
+
+    if (lstat(name, &st) < 0) {
+        return -1;
+    }
+    e->size = st.st_size;
+    e->mtime = st.st_mtime;
+    e->dir = S_ISDIR(st.st_mode);
+    return 0;
+}
+
+/* Make room for one more index entry */
+int dir_grow(void) {
+    dent_t *ent;
+
+    if (dir_cnt < dir_cap) {
+        return 0;
+    }
+    ent = realloc(dir_ent, (dir_cap ? 2*dir_cap : 1024)*sizeof(dent_t));
+    if (ent == NULL) {
+        return -1;
+    }
+    dir_ent = ent;
+    dir_cap = dir_cap ? 2*dir_cap : 1024;
+    return 0;
+}
+
+/* Bring the index entry for name in line with the directory, adding, refreshing or dropping it */
+void dir_set(char *name) {
+    dent_t e;
+    int i;
+    int found;
+
+    i = dir_find(name);
+    found = i < dir_cnt && strcmp(dir_ent[i].name, name) == 0;
+    if (dent_stat(&e, name) < 0) {
+        if (found) {
+            free(dir_ent[i].name);
+            memmove(dir_ent + i, dir_ent + i + 1, (dir_cnt - i - 1)*sizeof(dent_t));
+            dir_cnt--;
+        }
+        return;
+    }
+    if (found) {
+        e.name = dir_ent[i].name;
+        dir_ent[i] = e;
+        return;
+    }
+    if (dir_grow() < 0 || (e.name = strdup(name)) == NULL) {
+        warn("Error growing directory index");
+        return;
+    }
+    memmove(dir_ent + i + 1, dir_ent + i, (dir_cnt - i)*sizeof(dent_t));
+    dir_ent[i] = e;
+    dir_cnt++;
+}
+
+/* Drop the index, the next listing rebuilds it */
+void dir_clear(void) {
+    for (int i = 0; i < dir_cnt; i++) {
+        free(dir_ent[i].name);
+    }
+    dir_cnt = 0;
+    dir_ready = 0;
+}
 
-            /* Can break out of loop since another GET DONE from client puts us back in loop */
+/* Scan the directory into the index, the watch is already in place so nothing is missed after */
+void dir_build(void) {
+    DIR *dr;
+    struct dirent *de;
+    dent_t e;
+
+    dir_clear();
+    dr = opendir(".");
+    if (dr == NULL) {
+        warn("Could not open directory");
+        return;
+    }
+    while ((de = readdir(dr)) != NULL) {
+        if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) {
+            continue;
+        }
+        if (dent_stat(&e, de->d_name) < 0) {
+            continue;
+        }
+        if (dir_grow() < 0 || (e.name = strdup(de->d_name)) == NULL) {
+            warn("Error growing directory index");
             break;
         }
+        dir_ent[dir_cnt++] = e;
+    }
+    closedir(dr);
+    qsort(dir_ent, dir_cnt, sizeof(dent_t), dent_cmp);
+    dir_ready = 1;
+    printf("Indexed %d directory entries\n", dir_cnt);
+}
 
-        /* Get packet from client */
-        ret = recvfrom(sock, rec, MSG_SIZE, 0 , (struct sockaddr *) &client_addr, &client_len);
-        if (ret < 0) {
-            warn("Recieve failure in DEL");
+/* Apply queued directory changes to the index and drop cached copies of what changed, each event
+ * just says which name to look at again */
+void dir_events(void) {
+    char buf[DIR_EVBUF] __attribute__((aligned(__alignof__(struct inotify_event))));
+    struct inotify_event *ev;
+    ssize_t n;
+
+    while ((n = read(dir_fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+            ev = (struct inotify_event *) p;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                dir_clear();
+                while (hot_tail != NULL) {
+                    hot_evict(hot_tail);
+                }
+                continue;
+            }
+            if (ev->len == 0) {
+                continue;
+            }
+            hot_forget(ev->name);
+            if (dir_ready) {
+                dir_set(ev->name);
+            }
         }
-    } 
+    }
+}
+
+/* Watch the directory so the LS index follows it without rescanning, and cached copies of files
+ * written by another worker go as soon as they're stale */
+void dir_watch(int epfd) {
+    struct epoll_event ev;
+
+    dir_fd = inotify_init1(IN_NONBLOCK);
+    if (dir_fd < 0 || inotify_add_watch(dir_fd, ".", IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                                        IN_MOVED_TO | IN_CLOSE_WRITE | IN_ATTRIB) < 0) {
+        warn("Error watching directory, LS will rescan it");
+        goto fail;
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = dir_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, dir_fd, &ev) < 0) {
+        warn("Error adding directory watch to event loop");
+        goto fail;
+    }
+    return;
+
+fail:
+    if (dir_fd >= 0) {
+        close(dir_fd);
+    }
+    dir_fd = -1;
 }
 
-void ls(msg_t *rec) {
+/* List operation server side, a page of the index per request picking up after the name the
+ * client last saw, so pages stay consistent while the directory changes underneath */
+void ls(sess_t *s, msg_t *rec) {
     msg_t init;
     msg_t d;
     msg_t done;
     int ret = 0;
-    char lsbuf[DATA_SIZE];
-    struct dirent *de;
-    DIR *dr; 
+    int i;
+    int len;
+    int n;
+    uint32_t cnt = 0;
+    char *after;
 
     /* Create init response */
     init.oper = OPER_LS;
@@ -447,60 +3758,66 @@ void ls(msg_t *rec) {
     done.func = LS_DONE;
     done.data[0] = 0;
 
-    while(1) {
-
-        /* Send init response  with file size */
-        if (rec->oper == OPER_LS  && rec->func == LS_INIT) {
-            printf("Received LS init\n");            
-
-            /* Send init response */
-            ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Init response failure in GET");
-                continue;
-            }
+    /* Send init response with the number of entries, unwatched the index is rebuilt every time */
+    if (rec->func == LS_INIT) {
+        printf("Received LS init\n");            
+        if (!dir_ready || dir_fd < 0) {
+            dir_build();
         }
+        put_u32(init.data, dir_cnt);
 
-        /* Data packet */
-        if (rec->oper == OPER_LS && rec->func == LS_DATA) {
-            
-            /* Put contents of directory into buffer */
-            lsbuf[0] = 0;
-            dr = opendir(".");
-            if (dr == NULL) {
-                warn("Could not open directory");
-                continue;
-            }
-            while((de = readdir(dr)) != NULL) {
-                strcat(lsbuf, de->d_name);
-                strcat(lsbuf, "\n");
-            }
-
-            memcpy(d.data, lsbuf, DATA_SIZE);
+        /* Send init response */
+        ret = sess_send(s, &init, 4);
+        if (ret < 0) {
+            warn("Init response failure in LS");
+        }
+        return;
+    }
 
-            /* Send data packet */
-            ret = sendto(sock, &d, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                warn("Data response failure in LS");
-            }
+    /* Data packet, request number and the last name the client has */
+    if (rec->func == LS_DATA) {
+        if (!dir_ready) {
+            dir_build();
+        }
+        rec->data[DATA_SIZE - 1] = 0;
+        after = (char *) rec->data + 4;
+        i = dir_find(after);
+        if (i < dir_cnt && strcmp(dir_ent[i].name, after) == 0) {
+            i++;
         }
 
-        /* Done handshake */
-        if  (rec->oper == OPER_LS && rec->func == LS_DONE) {
-            ret = sendto(sock, &done, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-            if (ret < 0) {
-                    warn("Done response failure in LS");
+        /* Pack as many entries as fit */
+        len = LS_HDR;
+        for (; i < dir_cnt; i++, cnt++) {
+            n = strlen(dir_ent[i].name) + 1;
+            if (len + LS_ENTRY + n > DATA_SIZE) {
+                break;
             }
+            put_u64(d.data + len, dir_ent[i].size);
+            put_u64(d.data + len + 8, dir_ent[i].mtime);
+            d.data[len + 16] = dir_ent[i].dir;
+            memcpy(d.data + len + LS_ENTRY, dir_ent[i].name, n);
+            len += LS_ENTRY + n;
+        }
+        memcpy(d.data, rec->data, 4);
+        d.data[4] = i < dir_cnt;
+        put_u32(d.data + 5, cnt);
 
-            /* Can break out of loop since another GET DONE from client puts us back in loop */
-            break;
+        /* Send data packet */
+        ret = sess_send(s, &d, len);
+        if (ret < 0) {
+            warn("Data response failure in LS");
         }
+        return;
+    }
 
-        /* Get packet from client */
-        ret = recvfrom(sock, rec, MSG_SIZE, 0 , (struct sockaddr *) &client_addr, &client_len);
+    /* Done handshake */
+    if (rec->func == LS_DONE) {
+        ret = sess_send(s, &done, 0);
         if (ret < 0) {
-            warn("Recieve failure in LS");
+                warn("Done response failure in LS");
         }
+        sess_free(s);
     }
 }
 
@@ -511,56 +3828,221 @@ void ex(msg_t *rec) {
     /* Create init response */
     init.oper = OPER_EXIT;
     init.func = EXIT_INIT;
+    init.xid = rec->xid;
+    init.ts = 0;
+    init.ts_echo = 0;
     init.data[0] = 0;
 
-    while(1) {
-
-        /* Send init response */
-        if (rec->oper == OPER_EXIT && rec->func == EXIT_INIT) {
-            printf("Shutting down server...\n");
-
-            /* Send init response multiple times since we are shutting down */
-            for (int i = 0; i < 10; i++) {
-                ret = sendto(sock, &init, MSG_SIZE, 0, (struct sockaddr *) &client_addr, sizeof(client_addr));
-                if (ret < 0) {
-                    warn("Init response failure in DEL");
-                    continue;
-                }
-            }
+    /* Send init response */
+    if (rec->oper == OPER_EXIT && rec->func == EXIT_INIT) {
+        printf("Shutting down server...\n");
 
-            /* Shutdown socket and exit */
-            ret = close(sock);
+        /* Send init response multiple times since we are shutting down */
+        for (int i = 0; i < 10; i++) {
+            ret = msg_send(&init, 0, &client_addr);
             if (ret < 0) {
-                warn("Couldn't shut down socket");
-                printf("Forcefully quitting - Goodbye!\n");
-                exit(0);
-            } else {
-                printf("Successfully shut down socket\n");
-                printf("Goodbye!\n");
-                exit(0);
+                warn("Init response failure in EXIT");
+                continue;
             }
         }
 
-        /* Get packet from client */
-        ret = recvfrom(sock, rec, MSG_SIZE, 0 , (struct sockaddr *) &client_addr, &client_len);
+        /* Shutdown socket and exit */
+        ret = close(sock);
         if (ret < 0) {
-            warn("Recieve failure in EXIT");
+            warn("Couldn't shut down socket");
+            printf("Forcefully quitting - Goodbye!\n");
+            exit(0);
+        } else {
+            printf("Successfully shut down socket\n");
+            printf("Goodbye!\n");
+            exit(0);
         }
     }
 }
 
-int main(int argc, char **argv) {
-    int serv_port = 0;
+/* Done for a session that already finished, our first done response was lost */
+void stale_done(msg_t *rec) {
+    msg_t done;
+
+    done.oper = rec->oper;
+    done.func = rec->func;
+    done.xid = rec->xid;
+    done.ts = 0;
+    done.ts_echo = 0;
+    done.data[0] = 0;
+
+    if ((rec->oper == OPER_GET && rec->func == GET_DONE) ||
+        (rec->oper == OPER_PUT && rec->func == PUT_DONE) ||
+        (rec->oper == OPER_LS && rec->func == LS_DONE)) {
+        msg_send(&done, 1, &client_addr);
+    } else if (rec->oper == OPER_DEL && rec->func == DEL_DONE) {
+        done.oper = OPER_GET;
+        done.func = GET_DONE;
+        msg_send(&done, 1, &client_addr);
+    }
+}
+
+/* Echo a path MTU probe at the size it arrived, the client learns both directions carried it */
+void probe(msg_t *rec, int len) {
+    if (msg_send(rec, len - MSG_HDR, &client_addr) < 0 && errno != EMSGSIZE) {
+        warn("Probe response failure");
+    }
+}
+
+/* Hand a client message of len bytes to its session, starting one on an init */
+void dispatch(msg_t *rec, int len) {
+    sess_t *s;
+    double rtt = 0;
+
+    if (rec->oper == OPER_EXIT) {
+        ex(rec);
+        return;
+    }
+    if (rec->oper == OPER_PROBE) {
+        probe(rec, len);
+        return;
+    }
+    if (rec->oper == OPER_STATS) {
+        stats_reply(rec);
+        return;
+    }
+    if (rec->oper > OPER_EXIT) {
+        warn("Received packet with invalid operation\n");
+        return;
+    }
+
+    /* Every operation starts with function 0 (init) */
+    s = sess_find(&client_addr, rec->xid);
+    if (s == NULL && rec->func == 0) {
+        s = sess_new(&client_addr, rec->xid, rec->oper);
+        if (s == NULL) {
+            printf("Too many sessions, dropping init\n");
+            return;
+        }
+    }
+    if (s == NULL) {
+        stale_done(rec);
+        return;
+    }
+    if (rec->oper != s->oper) {
+        return;
+    }
+
+    /* Heard from the client, restart its timer (only the last frame of a round times the round) */
+    s->heard = now_sec();
+    if (rec->oper != OPER_PUT || rec->func == PUT_INIT || rec->func == PUT_DONE || (rec->func == PUT_DATA && (rec->data[4] & FRAME_POLL))) {
+        rtt = rtt_recv(&s->rtt, rec);
+        if (rtt > 0) {
+            stats_rtt(s, rtt);
+        }
+    }
+    timer_set(s, s->rtt.rto);
+
+    switch(rec->oper) {
+        case OPER_GET:
+            get(s, rec);
+            break;
+        case OPER_PUT:
+            put(s, rec);
+            break;
+        case OPER_DEL:
+            del(s, rec);
+            break;
+        case OPER_LS:
+            ls(s, rec);
+            break;
+    }
+}
+
+/* Session timer fired, GET resends a round and everything else just waits */
+void sess_expire(sess_t *s) {
+
+    /* Client went away, drop the transfer (a PUT keeps what it has for the client to resume) */
+    if (now_sec() - s->heard >= PEER_TIMEOUT) {
+        printf("Client timed out in %s\n", oper_names[s->oper]);
+        STAT_INC(abandoned, 1);
+        if (s->oper == OPER_PUT && s->f != NULL && s->curr_dpkt < s->num_dpkt) {
+            put_ckpt(s);
+        }
+        sess_free(s);
+        return;
+    }
+
+    /* Round went unacked, back off and send it again */
+    rtt_backoff(&s->rtt);
+    timer_set(s, s->rtt.rto);
+    if (s->oper == OPER_GET && s->acked != NULL) {
+        STAT_ADD(s, timeouts, 1);
+        if (s->round_sent > 0) {
+            cc_on_timeout(&s->cc);
+        }
+        get_round(s);
+    }
+}
+
+/* Run the wheel up to the current tick, firing every timer that came due */
+void wheel_advance(uint64_t tick) {
+    sess_t *s;
+    sess_t *next;
+    int slot = 0;
+
+    while (wheel_now < tick && wheel_armed > 0) {
+        wheel_now++;
+
+        /* A higher level slot comes up, spread its sessions over the levels below */
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel_now & ((1ULL << (WHEEL_BITS*level)) - 1)) != 0) {
+                break;
+            }
+            slot = (wheel_now >> (WHEEL_BITS*level)) & (WHEEL_SLOTS - 1);
+            s = wheel[level][slot];
+            wheel[level][slot] = NULL;
+            for (; s != NULL; s = next) {
+                next = s->t_next;
+                wheel_insert(s);
+            }
+        }
+
+        /* Fire everything in this tick's slot, handlers may re-arm */
+        slot = wheel_now & (WHEEL_SLOTS - 1);
+        while ((s = wheel[0][slot]) != NULL) {
+            timer_stop(s);
+            sess_expire(s);
+        }
+    }
+
+    /* Nothing armed, catch up without walking idle ticks */
+    if (wheel_armed == 0) {
+        wheel_now = tick;
+    }
+}
+
+/* One worker, with its own socket on the port, event loop and sessions */
+void *worker(void *arg) {
+    int id = (intptr_t) arg;
     int optval = 0; 
     msg_t rec;
     int ret = 0;
+    int len = 0;
+    int epfd = -1;
+    uint64_t expired = 0;
+    struct epoll_event ev;
+    struct epoll_event events[4];
+    struct itimerspec its;
+    cpu_set_t cpus;
 
-    /* Parse server IP and port */
-    if (argc != 2) {
-        printf("%s", usage);
-        exit(1);
+    /* Stats are read by whichever worker a STATS query lands on */
+    worker_id = id;
+    worker_stats[id] = &stats;
+
+    /* Keep each worker, and so each flow, on its own core */
+    if (workers > 1) {
+        CPU_ZERO(&cpus);
+        CPU_SET(id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            printf("Couldn't pin worker %d\n", id);
+        }
     }
-    serv_port = atoi(argv[1]);
 
     /* Create socket */
     sock = socket(AF_INET, SOCK_DGRAM, 0);
@@ -572,55 +4054,268 @@ int main(int argc, char **argv) {
     optval = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval, sizeof(int));
 
-    /* Set socket recieve timeout (200ms) */
-    struct timeval tv;
-    tv.tv_sec = 0;
-    tv.tv_usec = 50000;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0) {
-        error("Error setting socket timeout");
+    /* Workers share the port, the kernel hashes each client flow to one of them */
+    if (workers > 1 && setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0) {
+        error("Error sharing port between workers");
     }
 
-    /* Create server IP and port */
-    bzero((char *) &serv_addr, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    serv_addr.sin_port = htons((unsigned short) serv_port);
+    /* Never block on the socket, epoll says when to read and the timer wheel keeps time */
+    if (fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) < 0) {
+        error("Error making socket non-blocking");
+    }
+
+    /* Leave room for whole rounds in flight, the default buffer drops the tail of a round */
+    optval = SOCK_BUF_SIZE;
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval)) < 0) {
+        warn("Error setting socket buffer size");
+    }
+
+    /* Never fragment, a frame too big for the path is dropped (which is how a probe finds the
+     * path MTU) rather than split into fragments that all have to arrive */
+    optval = IP_PMTUDISC_DO;
+    if (setsockopt(sock, IPPROTO_IP, IP_MTU_DISCOVER, &optval, sizeof(optval)) < 0) {
+        warn("Error turning on path MTU discovery");
+    }
+
+    /* Zero-copy sends if asked for */
+    if (zerocopy) {
+        zc_init();
+    }
+
+    /* Offload if asked for, then size the receive slots for coalesced runs */
+    if (offload) {
+        offload_init();
+    }
+    rx_slot = gro_on ? GRO_BUF_SIZE : MSG_MAX;
+    rx_area = malloc((size_t) rx_slot*batch_size);
+    tx_par = malloc((size_t) FRAME_MAX*BATCH_MAX);
+    if (rx_area == NULL || tx_par == NULL) {
+        error("Error allocating packet buffers");
+    }
+    sessions = calloc(MAX_SESSIONS, sizeof(sess_t));
+    if (sessions == NULL) {
+        error("Error allocating sessions");
+    }
 
     /* Bind to port */
     if (bind(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
         error("Error binding socket");
     }
 
-    printf("Waiting for command...\n");
+    /* Wait on the socket, the wheel's tick and changes to the directory */
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    epfd = epoll_create1(0);
+    if (timer_fd < 0 || epfd < 0) {
+        error("Error creating event loop");
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = sock;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, sock, &ev) < 0) {
+        error("Error adding socket to event loop");
+    }
+    ev.events = EPOLLIN;
+    ev.data.fd = timer_fd;
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, timer_fd, &ev) < 0) {
+        error("Error adding timer to event loop");
+    }
+    dir_watch(epfd);
+
+    /* Dump stats every few seconds if asked */
+    if (stats_every > 0) {
+        stats_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+        memset(&its, 0, sizeof(its));
+        its.it_value.tv_sec = stats_every;
+        its.it_interval.tv_sec = stats_every;
+        ev.events = EPOLLIN;
+        ev.data.fd = stats_fd;
+        if (stats_fd < 0 || timerfd_settime(stats_fd, 0, &its, NULL) < 0 || epoll_ctl(epfd, EPOLL_CTL_ADD, stats_fd, &ev) < 0) {
+            error("Error starting stats timer");
+        }
+    }
+    wheel_now = now_tick();
 
     client_len = sizeof(client_addr);
     while(1) {
-        ret = recvfrom(sock, &rec, MSG_SIZE, 0, (struct sockaddr *) &client_addr, &client_len);
+
+        /* Don't sleep while a GET is waiting on its copy to be built */
+        ret = epoll_wait(epfd, events, 4, (prep_head != NULL) ? 0 : -1);
         if (ret < 0) {
+            if (errno != EINTR) {
+                warn("Event loop failure");
+            }
             continue;
         }
-        
-        switch(rec.oper) {
-            case OPER_GET:
-                get(&rec);
+
+        for (int i = 0; i < ret; i++) {
+            if (events[i].data.fd == timer_fd) {
+                read(timer_fd, &expired, sizeof(expired));
+                continue;
+            }
+            if (events[i].data.fd == dir_fd) {
+                dir_events();
+                continue;
+            }
+            if (events[i].data.fd == stats_fd) {
+                read(stats_fd, &expired, sizeof(expired));
+                stats_dump();
+                continue;
+            }
+
+            /* Error queue holds zero-copy completions */
+            if (events[i].events & EPOLLERR) {
+                zc_reap();
+            }
+
+            /* Drain the socket, but leave the timers a turn under heavy load */
+            for (int j = 0; j < RX_BUDGET; j++) {
+                len = recv_msg(&rec, &client_addr, &client_len);
+                if (len < 0) {
+                    break;
+                }
+                dispatch(&rec, len);
+            }
+        }
+
+        /* Fire due timers, stop ticking once none are left */
+        wheel_advance(now_tick());
+        if (wheel_armed == 0 && wheel_ticking) {
+            wheel_tick(0);
+        }
+
+        /* Build a little more of a GET's copy */
+        prep_run();
+    }
+
+    return NULL;
+}
+
+/* A file a GET sends from its mapping was cut short under it (a stream of a parallel PUT sizing
+ * it in place, or another program), zeros are read where its pages went so the client fails its
+ * checksum instead of the server dying, any other bus error still kills it */
+void map_fault(int sig, siginfo_t *si, void *ctx) {
+    void *page = (void *) ((uintptr_t) si->si_addr & ~(page_size - 1));
+
+    if (si->si_code != BUS_ADRERR ||
+            mmap(page, page_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+}
+
+int main(int argc, char **argv) {
+    int serv_port = 0;
+    int opt = 0;
+    pthread_t threads[MAX_WORKERS];
+    struct sigaction sa;
+
+    /* Parse options */
+    while ((opt = getopt(argc, argv, "c:w:b:gzt:f:m:S:")) != -1) {
+        switch (opt) {
+            case 'c':
+                cc_algo = cc_parse(optarg);
+                if (cc_algo < 0) {
+                    printf("%s", usage);
+                    exit(1);
+                }
                 break;
-            case OPER_PUT:
-                put(&rec);
+            case 'w':
+                if (atoi(optarg) < 1 || atoi(optarg) > RX_WINDOW_MAX) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                rx_window = atoi(optarg);
                 break;
-            case OPER_DEL:
-                del(&rec);
+            case 'g':
+                offload = 1;
                 break;
-            case OPER_LS:
-                ls(&rec);
+            case 'z':
+                zerocopy = 1;
                 break;
-            case OPER_EXIT:
-                ex(&rec);
+            case 'f':
+                fec_min = atof(optarg) / 100;
+                if (fec_min <= 0 || fec_min > 1.0 / FEC_MIN_GROUP) {
+                    printf("%s", usage);
+                    exit(1);
+                }
                 break;
-            default:
-                warn("Received packet with invalid operation\n");
+            case 't':
+                workers = atoi(optarg);
+                if (workers < 1 || workers > MAX_WORKERS) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'm':
+                if (atoll(optarg) < 0) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                hot_budget = (uint64_t) atoll(optarg) << 20;
+                break;
+            case 'S':
+                stats_every = atoi(optarg);
+                if (stats_every <= 0) {
+                    printf("%s", usage);
+                    exit(1);
+                }
+                break;
+            case 'b':
+                batch_size = atoi(optarg);
+                if (batch_size < 1 || batch_size > BATCH_MAX) {
+                    printf("%s", usage);
+                    exit(1);
+                }
                 break;
+            default:
+                printf("%s", usage);
+                exit(1);
+        }
+    }
+
+    /* Parse server port */
+    if (argc - optind != 1) {
+        printf("%s", usage);
+        exit(1);
+    }
+    serv_port = atoi(argv[optind]);
+
+    /* Frame and file checksums, shared read-only by the workers */
+    crc_init();
+
+    /* Survive files shrinking under their mappings */
+    page_size = getpagesize();
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = map_fault;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) < 0) {
+        warn("Couldn't catch bus errors");
+    }
+
+    /* Create server IP and port */
+    bzero((char *) &serv_addr, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    serv_addr.sin_port = htons((unsigned short) serv_port);
+
+    printf("Using %s congestion control\n", cc_names[cc_algo]);
+    printf("Waiting for command...\n");
+
+    /* Single worker runs right here, otherwise one thread per worker */
+    if (workers == 1) {
+        worker(0);
+        return 0;
+    }
+    printf("Starting %d workers\n", workers);
+    for (int i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker, (void *) (intptr_t) i) != 0) {
+            error("Error starting worker");
         }
     }
+    for (int i = 0; i < workers; i++) {
+        pthread_join(threads[i], NULL);
+    }
 
     return 0;
 }
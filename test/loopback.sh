@@ -0,0 +1,232 @@
+#!/bin/bash
+# Loopback test, round trips files between the client and the server through a relay that drops
+# a share of datagrams each way: plain GET/PUT, with parity (-f), parallel streams (-s), a delta
+# PUT (-d), batches (mget/mput), a GET killed partway and resumed, a listing over many pages and a
+# PUT over a file a GET is sending, every copy checked with cmp, then the server's stats
+#
+# usage: loopback.sh [loss_percent]   (default 2, TMO seconds a client run may take, default 120)
+#        loopback.sh bench [size_mb]   (times GETs straight from the server, -b 1 against batches)
+
+cd "$(dirname "$0")" || exit 2
+HERE=$(pwd)
+LOSS=${1:-2}
+BENCH_MB=${2:-200}
+TMO=${TMO:-120}
+SERVER=$HERE/../server/server
+CLIENT=$HERE/../client/client
+RELAY=$HERE/relay
+DIR=$(mktemp -d)
+PORT=$((20000 + $$ % 20000))
+BATCH_SIZE=32
+fails=0
+
+cleanup() {
+    kill $SP $RP 2>/dev/null
+    rm -rf "$DIR"
+}
+trap cleanup EXIT
+
+# Start a client called name in a directory with flags on some commands, fed through descriptor
+# fd, the listing after them tells when it is done, it talks to the relay unless CPORT says
+start() {
+    local name=$1 fd=$2 dir=$3 flags=$4
+    shift 4
+    rm -f "$DIR/$name.in" "$DIR/$name.log"
+    mkfifo "$DIR/$name.in"
+    (cd "$DIR/$dir" && exec stdbuf -oL "$CLIENT" $flags 127.0.0.1 ${CPORT:-$((PORT + 1))}) < "$DIR/$name.in" > "$DIR/$name.log" 2>&1 &
+    eval "pid_$name=$!"
+    eval "exec $fd> \"\$DIR/$name.in\""
+    printf '%s\n' "$@" ls >&$fd
+}
+
+# Wait until a client is done and stop it
+finish() {
+    local name=$1 fd=$2
+    for i in $(seq 1 $((TMO * 10))); do
+        grep -q "^Completed ls" "$DIR/$name.log" && break
+        sleep 0.1
+    done
+    eval "kill \$pid_$name 2>/dev/null; wait \$pid_$name 2>/dev/null"
+    eval "exec $fd>&-"
+    LOG=$DIR/$name.log
+}
+
+# Run the client with flags on some commands
+client() {
+    start c 3 cli "$@"
+    finish c 3
+}
+
+# Compare a copy with the file it came from
+check() {
+    if cmp -s "$DIR/$1" "$DIR/$2"; then
+        echo "ok   $3"
+    else
+        echo "FAIL $3"
+        tail -5 "$LOG"
+        fails=$((fails + 1))
+    fi
+}
+
+# Benchmark, GETs of one random file straight from the server (no relay, no loss) sending a
+# datagram per call and in batches of the default size, the best of three runs each
+if [ "$1" = bench ]; then
+    mkdir "$DIR/srv" "$DIR/cli"
+    head -c $((BENCH_MB * 1000000)) /dev/urandom > "$DIR/srv/bench.bin"
+    CPORT=$PORT
+    LOG=$DIR/c.log
+    echo "Loopback benchmark, GET of $BENCH_MB MB"
+    for flags in "-b 1" ""; do
+        (cd "$DIR/srv" && exec stdbuf -oL "$SERVER" $flags $PORT) > "$DIR/server.log" 2>&1 &
+        SP=$!
+        sleep 0.5
+        best=0
+        for run in 1 2 3; do
+            rm -f "$DIR/cli/bench.bin"
+            t0=$(date +%s.%N)
+            start c 3 cli "-u $flags" "get bench.bin"
+            for i in $(seq 1 $((TMO * 100))); do
+                grep -q "^Completed get" "$DIR/c.log" && break
+                sleep 0.01
+            done
+            t1=$(date +%s.%N)
+            finish c 3
+            check srv/bench.bin cli/bench.bin "get ${flags:--b $BATCH_SIZE} run $run"
+            best=$(awk -v b="$best" -v t0="$t0" -v t1="$t1" -v mb="$BENCH_MB" 'BEGIN { r = mb / (t1 - t0); print (r > b) ? r : b }')
+        done
+        printf "%-6s %8.1f MB/s\n" "${flags:--b $BATCH_SIZE}" "$best"
+        kill $SP
+        wait $SP 2>/dev/null
+    done
+    if [ $fails -gt 0 ]; then
+        echo "$fails copies FAILED"
+        exit 1
+    fi
+    exit 0
+fi
+
+# Random and compressible files on each side, big ones split over streams (at least two 1 MB
+# ranges), and a server copy of a file the client has edited for the delta
+mkdir "$DIR/srv" "$DIR/cli"
+head -c 3000000 /dev/urandom > "$DIR/srv/rand.bin"
+seq 1 400000 > "$DIR/srv/text.txt"
+head -c 5000000 /dev/urandom > "$DIR/srv/big.bin"
+head -c 2500000 /dev/urandom > "$DIR/cli/urand.bin"
+seq 1 300000 | tac > "$DIR/cli/utext.txt"
+head -c 5000000 /dev/urandom > "$DIR/cli/ubig.bin"
+for i in 1 2 3; do
+    head -c $((i * 400000)) /dev/urandom > "$DIR/srv/s$i.bin"
+    head -c $((i * 300000)) /dev/urandom > "$DIR/cli/m$i.bin"
+done
+seq 1 200000 > "$DIR/srv/edit.txt"
+sed 's/^1000$/changed/; s/^150000$/and this line too/' "$DIR/srv/edit.txt" > "$DIR/cli/edit.txt"
+
+# A file big enough to checkpoint a few times before the GET of it is killed
+head -c 60000000 /dev/urandom > "$DIR/srv/resume.bin"
+
+# A file big enough to still be sending when a second client puts a small one over it
+mkdir "$DIR/cli2"
+head -c 100000000 /dev/urandom > "$DIR/srv/busy.bin"
+cp "$DIR/srv/busy.bin" "$DIR/busy.old"
+head -c 5000 /dev/urandom > "$DIR/cli2/busy.bin"
+
+# Server, and the relay clients talk to it through
+(cd "$DIR/srv" && exec stdbuf -oL "$SERVER" $PORT) > "$DIR/server.log" 2>&1 &
+SP=$!
+"$RELAY" $((PORT + 1)) $PORT "$LOSS" > "$DIR/relay.log" 2>&1 &
+RP=$!
+sleep 0.5
+
+echo "Loopback test, dropping $LOSS% of datagrams each way"
+
+client "" "get rand.bin" "get text.txt" "put urand.bin" "put utext.txt"
+check srv/rand.bin cli/rand.bin "get"
+check srv/text.txt cli/text.txt "get compressed"
+check cli/urand.bin srv/urand.bin "put"
+check cli/utext.txt srv/utext.txt "put compressed"
+rm -f "$DIR/cli/rand.bin" "$DIR/srv/urand.bin"
+
+client "-f 20" "get rand.bin" "put urand.bin"
+check srv/rand.bin cli/rand.bin "get -f 20"
+check cli/urand.bin srv/urand.bin "put -f 20"
+
+client "-s 4" "get big.bin" "put ubig.bin"
+check srv/big.bin cli/big.bin "get -s 4"
+check cli/ubig.bin srv/ubig.bin "put -s 4"
+
+client "-d" "put edit.txt"
+check cli/edit.txt srv/edit.txt "put -d"
+
+client "" "mput m1.bin m2.bin m3.bin" "mget s1.bin s2.bin s3.bin"
+for i in 1 2 3; do
+    check cli/m$i.bin srv/m$i.bin "mput m$i.bin"
+    check srv/s$i.bin cli/s$i.bin "mget s$i.bin"
+done
+
+# A GET killed once it has saved a checkpoint picks up from it when it is run again
+start c 3 cli "-u" "get resume.bin"
+for i in $(seq 1 $((TMO * 100))); do
+    [ -e "$DIR/cli/resume.bin.resume" ] && break
+    sleep 0.01
+done
+{ kill -9 $pid_c; wait $pid_c; } 2>/dev/null
+exec 3>&-
+client "-u" "get resume.bin"
+if grep -q "^Resuming at frame" "$LOG"; then
+    echo "ok   get resumed"
+else
+    echo "FAIL get resumed"
+    tail -5 "$LOG"
+    fails=$((fails + 1))
+fi
+check srv/resume.bin cli/resume.bin "get of a resumed file"
+
+# A listing many pages long of files made and deleted under the running server, every name
+# comes back once and in order
+for i in $(seq 1 300); do
+    : > "$DIR/srv/listed_with_a_name_long_enough_to_fill_pages_$i"
+done
+rm -f "$DIR"/srv/listed_*_2?
+client ""
+sed -n 's/^ *[0-9]*  [0-9-]* [0-9:]*  //p' "$LOG" > "$DIR/ls.out"
+(cd "$DIR/srv" && ls -A | LC_ALL=C sort) > "$DIR/ls.want"
+check ls.want ls.out "ls over pages"
+rm -f "$DIR"/srv/listed_*
+
+# A PUT over a file a GET is still sending, the GET finishes with the copy it started on and the
+# PUT replaces it after
+start a 3 cli "-u" "get busy.bin"
+for i in $(seq 1 $((TMO * 10))); do
+    grep -q "^File length" "$DIR/a.log" && break
+    sleep 0.1
+done
+start b 4 cli2 "" "put busy.bin"
+finish b 4
+check cli2/busy.bin srv/busy.bin "put over a file being sent"
+finish a 3
+check busy.old cli/busy.bin "get of a file put over"
+if ! kill -0 $SP 2>/dev/null; then
+    echo "FAIL server died"
+    fails=$((fails + 1))
+fi
+
+# The server's totals count the transfers above (only the killed GET may not have timed out yet),
+# the frames they sent and took in and, with datagrams dropped, the ones it sent again
+client "" "stats"
+stat() {
+    sed -n 's/^Server stats: //p' "$LOG" | tr ' ' '\n' | sed -n "s/^$1=//p"
+}
+if [ "$(stat sessions)" -gt 10 ] && [ "$(stat active)" -le 1 ] && [ "$(stat frames_sent)" -gt 0 ] &&
+        [ "$(stat bytes_recv)" -gt 0 ] && { [ "$LOSS" = 0 ] || [ "$(stat frames_resent)" -gt 0 ]; }; then
+    echo "ok   stats"
+else
+    echo "FAIL stats"
+    grep "^Server stats" "$LOG"
+    fails=$((fails + 1))
+fi
+
+if [ $fails -gt 0 ]; then
+    echo "$fails checks FAILED"
+    exit 1
+fi
+echo "All checks passed"
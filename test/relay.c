@@ -0,0 +1,162 @@
+/**************************************
+ * Network Systems Project 1
+ * Test Relay
+ *
+ * This file implements a lossy UDP
+ * relay for the loopback test. It
+ * forwards datagrams between clients
+ * and a server on this host and drops
+ * a share of them each way.
+ *************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/* Most client sockets relayed at once (every stream and batch thread has its own), the largest
+ * datagram and socket buffers that hold whole rounds (so only the drops we choose are lost) */
+#define MAX_FLOWS     256
+#define BUF_SIZE      65536
+#define SOCK_BUF_SIZE (4 << 20)
+
+/* One client socket, and our socket to the server for it */
+typedef struct flow_s {
+    struct sockaddr_in addr;
+    int sock;
+} flow_t;
+
+flow_t flows[MAX_FLOWS];
+int flow_cnt = 0;
+struct sockaddr_in serv_addr;
+double loss = 0;
+
+/* Error handler */
+void error(char *msg) {
+    perror(msg);
+    exit(2);
+}
+
+/* Give a socket room for whole rounds */
+void sock_bufs(int sock) {
+    int optval = SOCK_BUF_SIZE;
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval));
+}
+
+/* Whether to drop the next datagram */
+int drop() {
+    return drand48() < loss;
+}
+
+/* Our socket to the server for a client, opened the first time it sends, -1 if there are too many */
+int flow_sock(struct sockaddr_in *from) {
+    int sock = -1;
+
+    for (int i = 0; i < flow_cnt; i++) {
+        if (flows[i].addr.sin_port == from->sin_port && flows[i].addr.sin_addr.s_addr == from->sin_addr.s_addr) {
+            return flows[i].sock;
+        }
+    }
+    if (flow_cnt == MAX_FLOWS) {
+        return -1;
+    }
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        error("Error opening socket to server");
+    }
+    sock_bufs(sock);
+    flows[flow_cnt].addr = *from;
+    flows[flow_cnt].sock = sock;
+    flow_cnt++;
+    return sock;
+}
+
+int main(int argc, char **argv) {
+    int sock = -1;
+    int fd = -1;
+    int ret = 0;
+    int optval = 1;
+    int n = 0;
+    ssize_t len = 0;
+    socklen_t from_len = 0;
+    struct sockaddr_in addr;
+    struct sockaddr_in from;
+    struct pollfd pfd[MAX_FLOWS + 1];
+    static char buf[BUF_SIZE];
+
+    /* Parse arguments */
+    if (argc < 4) {
+        printf("relay <listen_port> <server_port> <loss_percent> [seed]\n");
+        exit(1);
+    }
+    loss = atof(argv[3]) / 100;
+    srand48((argc > 4) ? atol(argv[4]) : time(NULL) ^ getpid());
+
+    /* Server is on this host */
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_port = htons(atoi(argv[2]));
+    serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    /* Socket clients send to */
+    sock = socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0) {
+        error("Error initializing socket");
+    }
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const void *) &optval, sizeof(int));
+    sock_bufs(sock);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(atoi(argv[1]));
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        error("Error binding socket");
+    }
+    printf("Relaying port %s to %s, dropping %.1f%% each way\n", argv[1], argv[2], 100*loss);
+    fflush(stdout);
+
+    while (1) {
+        n = flow_cnt;
+        pfd[0].fd = sock;
+        pfd[0].events = POLLIN;
+        for (int i = 0; i < n; i++) {
+            pfd[i + 1].fd = flows[i].sock;
+            pfd[i + 1].events = POLLIN;
+        }
+        ret = poll(pfd, n + 1, -1);
+        if (ret < 0) {
+            continue;
+        }
+
+        /* Client to server */
+        if (pfd[0].revents & POLLIN) {
+            from_len = sizeof(from);
+            len = recvfrom(sock, buf, BUF_SIZE, 0, (struct sockaddr *) &from, &from_len);
+            fd = (len >= 0) ? flow_sock(&from) : -1;
+            if (fd >= 0 && !drop()) {
+                send(fd, buf, len, 0);
+            }
+        }
+
+        /* Server to client, on the sockets that were polled */
+        for (int i = 0; i < n; i++) {
+            if (!(pfd[i + 1].revents & POLLIN)) {
+                continue;
+            }
+            len = recv(flows[i].sock, buf, BUF_SIZE, 0);
+            if (len >= 0 && !drop()) {
+                sendto(sock, buf, len, 0, (struct sockaddr *) &flows[i].addr, sizeof(flows[i].addr));
+            }
+        }
+    }
+
+    return 0;
+}